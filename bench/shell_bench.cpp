@@ -0,0 +1,258 @@
+// Hot-path microbenchmarks
+// Times the shell's own functions, linked from the shell_core library, on
+// synthetic inputs: command-line compilation (lexing + parsing) with and
+// without the plan cache, variable and wildcard expansion, PATH lookup
+// through the hash table, syntax highlighting, and launching and reaping
+// N-stage pipelines. Results are written to stdout as JSON so runs can be
+// compared between releases.
+//
+// Each benchmark runs its body in batches sized to take ~200us, until
+// --min-time seconds have passed; per-operation times are reported as the
+// minimum, median and mean over the batches.
+//
+// Usage: shell_bench [--min-time secs] [filter]
+//        (filter: only run benchmarks whose name contains it)
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <thread>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "shell_core.hpp"
+using namespace std;
+
+struct BenchResult {
+    string name;
+    uint64_t iterations = 0;
+    size_t samples = 0;
+    double min_ns = 0;
+    double median_ns = 0;
+    double mean_ns = 0;
+};
+
+double min_seconds = 0.3;  // Measuring time per benchmark
+string filter;
+vector<BenchResult> results;
+
+// Results are folded in here so the compiler cannot drop the calls
+volatile size_t sink = 0;
+
+void keep(size_t value) {
+    sink = sink + value;
+}
+
+double elapsed_ns(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+}
+
+// Time body (one operation per call) and record the result under name
+void run_benchmark(const string& name, const function<void()>& body) {
+    if (!filter.empty() && name.find(filter) == string::npos) return;
+    
+    // Warm up, then size batches from one timed call
+    body();
+    auto start = chrono::steady_clock::now();
+    body();
+    double single_ns = max(elapsed_ns(start), 1.0);
+    uint64_t batch = max<uint64_t>(1, (uint64_t)(200000.0 / single_ns));
+    
+    vector<double> per_op;
+    double total_ns = 0;
+    uint64_t iterations = 0;
+    while (total_ns < min_seconds * 1e9 || per_op.size() < 5) {
+        start = chrono::steady_clock::now();
+        for (uint64_t i = 0; i < batch; i++) body();
+        double batch_ns = elapsed_ns(start);
+        per_op.push_back(batch_ns / batch);
+        total_ns += batch_ns;
+        iterations += batch;
+    }
+    
+    BenchResult result;
+    result.name = name;
+    result.iterations = iterations;
+    result.samples = per_op.size();
+    result.mean_ns = total_ns / iterations;
+    sort(per_op.begin(), per_op.end());
+    result.min_ns = per_op.front();
+    result.median_ns = per_op[per_op.size() / 2];
+    results.push_back(result);
+    cerr << name << ": " << result.median_ns << " ns" << endl;
+}
+
+// Synthetic tree for the wildcard benchmarks:
+// root/dN (N < 20) with 50 .txt and 50 .c files each, and root/dN/sub/deep
+// holding 10 more .c files
+struct Fixture {
+    string root;
+    vector<string> files;
+    vector<string> directories;  // Parents first
+};
+
+bool make_fixture(Fixture& fixture) {
+    char path[] = "/tmp/shell_bench.XXXXXX";
+    if (mkdtemp(path) == nullptr) return false;
+    fixture.root = path;
+    
+    auto add_file = [&](const string& file) {
+        int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) close(fd);
+        fixture.files.push_back(file);
+    };
+    for (int d = 0; d < 20; d++) {
+        string directory = fixture.root + "/d" + to_string(d);
+        string deep = directory + "/sub/deep";
+        for (const string& dir : {directory, directory + "/sub", deep}) {
+            mkdir(dir.c_str(), 0755);
+            fixture.directories.push_back(dir);
+        }
+        for (int f = 0; f < 50; f++) {
+            add_file(directory + "/file" + to_string(f) + ".txt");
+            add_file(directory + "/file" + to_string(f) + ".c");
+        }
+        for (int f = 0; f < 10; f++) {
+            add_file(deep + "/deep" + to_string(f) + ".c");
+        }
+    }
+    return true;
+}
+
+void remove_fixture(const Fixture& fixture) {
+    for (const auto& file : fixture.files) unlink(file.c_str());
+    for (auto it = fixture.directories.rbegin(); it != fixture.directories.rend(); ++it) {
+        rmdir(it->c_str());
+    }
+    rmdir(fixture.root.c_str());
+}
+
+// Write the results as JSON to stdout
+void print_results() {
+    cout << "{\n";
+    cout << "  \"context\": {\"timestamp\": " << time(nullptr)
+         << ", \"cpus\": " << thread::hardware_concurrency()
+         << ", \"min_time_s\": " << min_seconds << "},\n";
+    cout << "  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        char line[512];
+        snprintf(line, sizeof(line),
+                 "%s\n    {\"name\": \"%s\", \"iterations\": %llu, \"samples\": %zu, "
+                 "\"min_ns\": %.1f, \"median_ns\": %.1f, \"mean_ns\": %.1f}",
+                 i == 0 ? "" : ",", r.name.c_str(), (unsigned long long)r.iterations,
+                 r.samples, r.min_ns, r.median_ns, r.mean_ns);
+        cout << line;
+    }
+    cout << "\n  ]\n}" << endl;
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--min-time" && i + 1 < argc) {
+            min_seconds = atof(argv[++i]);
+        } else if (arg[0] == '-') {
+            cerr << "Usage: shell_bench [--min-time secs] [filter]" << endl;
+            return 2;
+        } else {
+            filter = arg;
+        }
+    }
+    
+    // Same startup as a non-interactive shell
+    job_control = false;
+    import_environment();
+    setup_signals();
+    
+    // Parsing
+    const vector<pair<string, string>> lines = {
+        {"simple", "ls -la /tmp"},
+        {"chain", "cd src && make -j8 2> err.log || echo 'build failed' ; ls *.o | wc -l"},
+        {"quoted", "echo \"$HOME/projects\" 'it''s' \"a | b && c\" x\\ y > out.txt &"},
+        {"pipeline", "cat access.log | grep -v 127.0.0.1 | cut -d' ' -f1 | sort | uniq -c | sort -rn | head -20"},
+    };
+    for (const auto& [label, line] : lines) {
+        run_benchmark("compile_command_line/" + label, [&]() {
+            keep(compile_command_line(line) != nullptr);
+        });
+    }
+    for (const auto& [label, line] : lines) {
+        run_benchmark("get_command_plan/" + label, [&]() {
+            keep(get_command_plan(line) != nullptr);
+        });
+    }
+    
+    // Variable expansion
+    const vector<pair<string, string>> words = {
+        {"none", "plain-word-without-variables"},
+        {"single", "$HOME"},
+        {"mixed", "${HOME}/src/$USER-$$/x.$?.log"},
+        {"path", "$PATH:$PATH:$PATH"},
+    };
+    for (const auto& [label, word] : words) {
+        run_benchmark("expand_variables/" + label, [&]() {
+            keep(expand_variables(word).size());
+        });
+    }
+    
+    // Wildcard expansion; the listing cache lives for one command, so it is
+    // cleared before every expansion like the shell does
+    Fixture fixture;
+    if (make_fixture(fixture)) {
+        const vector<pair<string, string>> patterns = {
+            {"literal", fixture.root + "/d3/file7.c"},
+            {"star", fixture.root + "/d3/*.c"},
+            {"bracket", fixture.root + "/d[1-5]/file?.txt"},
+            {"two_level", fixture.root + "/d*/*.c"},
+            {"recursive", fixture.root + "/**/*.c"},
+        };
+        for (const auto& [label, pattern] : patterns) {
+            run_benchmark("expand_wildcards/" + label, [&]() {
+                glob_cache_clear();
+                keep(expand_wildcards(pattern).size());
+            });
+        }
+        remove_fixture(fixture);
+    } else {
+        cerr << "shell_bench: cannot create fixture: " << strerror(errno) << endl;
+    }
+    
+    // PATH lookup: hashed, after the hash was cleared, and a miss
+    string full_path;
+    run_benchmark("find_executable_in_path/hashed", [&]() {
+        keep(find_executable_in_path("ls", full_path));
+    });
+    run_benchmark("find_executable_in_path/cold", [&]() {
+        clear_command_hash();
+        keep(find_executable_in_path("ls", full_path));
+    });
+    run_benchmark("find_executable_in_path/miss", [&]() {
+        keep(find_executable_in_path("no-such-command-xyz", full_path));
+    });
+    
+    // Highlighting
+    for (const auto& [label, line] : lines) {
+        run_benchmark("highlight_syntax/" + label, [&]() {
+            keep(highlight_syntax(line).size());
+        });
+    }
+    
+    // Pipeline launch: N stages of `true`, spawned and reaped
+    for (int stages : {2, 4, 8}) {
+        vector<vector<string>> commands(stages, vector<string>{"true"});
+        run_benchmark("pipeline_spawn/" + to_string(stages), [&]() {
+            execute_multi_pipeline(commands, {});
+        });
+    }
+    
+    print_results();
+    return 0;
+}
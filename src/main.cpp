@@ -4,22 +4,43 @@
 #include <vector>
 #include <unordered_set>
 #include <unordered_map>
-#include <cstdlib>      // for getenv, setenv
+#include <algorithm>    // for remove_if, max
+#include <cstdlib>      // for getenv
 #include <unistd.h>     // for access, fork, execvp
 #include <sys/wait.h>   // for waitpid, WIFEXITED, WEXITSTATUS
 #include <fcntl.h>      // for open, O_WRONLY, O_CREAT, O_TRUNC
 #include <dirent.h>     // for opendir, readdir, closedir
 #include <cstring>      // for strlen, strdup
+#include <cmath>        // for calculator functions
 #include <fstream>      // for file operations
-#include <glob.h>       // for wildcard expansion
+#include <sys/syscall.h>  // for getdents64
 #include <chrono>       // for timing
 #include <ctime>        // for timestamps
 #include <iomanip>      // for formatting
 #include <sys/stat.h>   // for stat
+#include <sys/time.h>     // for timeradd, timersub
+#include <sys/resource.h>  // for rusage, wait4
 #include <signal.h>     // for signal handling
+#include <sys/signalfd.h>  // for child supervision
+#include <poll.h>
 #include <termios.h>    // for terminal control
+#include <sys/ioctl.h>  // for the terminal size
+#include <spawn.h>      // for posix_spawn
+#include <sys/sendfile.h>  // for sendfile
+#include <thread>       // for builtin pipeline stages
+#include <mutex>
+#include <condition_variable>
+#include <atomic>       // for the trace switch
+#include <deque>        // for history store index
+#include <list>         // for the command plan LRU
+#include <array>
+#include <memory>       // for shared_ptr
+#include <string_view>
+#include <sys/mman.h>   // for mmap
+#include <sys/file.h>   // for flock
 #include <readline/readline.h>  // for readline, tab completion
 #include <readline/history.h>   // for history functions
+#include "shell_core.hpp"
 using namespace std;
 
 // Job status enum
@@ -36,6 +57,13 @@ struct Job {
     string command;
     JobStatus status;
     bool is_background;
+    int exit_status = 0;  // $? once DONE (or 128+signal while STOPPED)
+    bool notify = false;  // State change not reported yet
+    
+    // CPU baseline of the last `jobs -l`/`--watch` sample (for CPU%)
+    bool sampled = false;
+    unsigned long long sampled_ticks = 0;
+    chrono::steady_clock::time_point sampled_at;
 };
 
 // Global variables for job control
@@ -43,6 +71,10 @@ vector<Job> jobs;
 int next_job_id = 1;
 pid_t foreground_pgid = 0;
 
+// Process groups and terminal hand-off; off when running a script or -c
+// string, where children stay in the shell's group like in other shells
+bool job_control = true;
+
 // ANSI color codes
 #define COLOR_RESET   "\033[0m"
 #define COLOR_RED     "\033[31m"
@@ -55,85 +87,730 @@ pid_t foreground_pgid = 0;
 #define COLOR_BOLD    "\033[1m"
 
 // Global variables for shell state
-unordered_map<string, string> shell_variables;  // Shell-local variables
 unordered_map<string, string> bookmarks;        // Directory bookmarks
 int last_exit_status = 0;  // Last command exit status ($?)
+vector<int> pipe_status = {0};  // Exit status of each stage of the last pipeline ($PIPESTATUS)
 chrono::steady_clock::time_point cmd_start_time;  // For timing commands
 
-// Signal handler for SIGCHLD (child process state change)
-void sigchld_handler(int sig) {
-    int saved_errno = errno;
-    pid_t pid;
-    int status;
+// ---------------------------------------------------------------------------
+// Tracing
+// `trace on` (or $SHELL_TRACE at startup) records a timestamped span for
+// each phase of a command - reading the line, lexing, expansion, PATH
+// lookup, launch, waiting - into a ring buffer owned by the recording
+// thread, so recording takes no lock shared with other threads. `trace
+// dump` writes the buffers as Chrome trace JSON (chrome://tracing,
+// ui.perfetto.dev). While tracing is off a span is one load and a branch.
+// ---------------------------------------------------------------------------
+
+atomic<bool> trace_enabled{false};
+
+// One finished span
+struct TraceEvent {
+    const char* name;     // Phase (a string literal)
+    char detail[40];      // Command name, pattern, ... (truncated)
+    uint64_t start_ns;    // CLOCK_MONOTONIC
+    uint64_t duration_ns;
+    pid_t tid;
+};
+
+constexpr size_t TRACE_RING_SIZE = 8192;  // Events kept per thread
+
+// A thread's ring: the newest TRACE_RING_SIZE events. Buffers outlive their
+// threads (pipeline stages and glob workers are short-lived) and are handed
+// to the next new thread once released
+struct TraceBuffer {
+    mutex lock;           // Only contended while a dump copies the ring
+    vector<TraceEvent> events;
+    uint64_t written = 0; // Total events recorded; the ring holds the last ones
+    pid_t tid = 0;
+    bool in_use = false;
+};
+
+mutex trace_buffers_mutex;
+vector<unique_ptr<TraceBuffer>> trace_buffers;
+
+uint64_t trace_clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// The calling thread's buffer, claimed on its first span
+struct TraceThread {
+    TraceBuffer* buffer = nullptr;
+    ~TraceThread() {
+        if (buffer == nullptr) return;
+        lock_guard<mutex> lock(trace_buffers_mutex);
+        buffer->in_use = false;
+    }
+};
+
+thread_local TraceThread trace_thread;
+
+TraceBuffer* trace_thread_buffer() {
+    if (trace_thread.buffer != nullptr) return trace_thread.buffer;
     
-    // Reap all zombie processes
-    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
-        // Find the job
-        for (auto& job : jobs) {
-            if (job.pid == pid) {
-                if (WIFEXITED(status) || WIFSIGNALED(status)) {
-                    job.status = DONE;
-                    if (job.is_background) {
-                        cout << "\n[" << job.job_id << "]+ Done\t\t" << job.command << endl;
-                    }
-                } else if (WIFSTOPPED(status)) {
-                    job.status = STOPPED;
-                    if (job.is_background) {
-                        cout << "\n[" << job.job_id << "]+ Stopped\t" << job.command << endl;
-                    }
-                } else if (WIFCONTINUED(status)) {
-                    job.status = RUNNING;
-                }
-                break;
-            }
+    lock_guard<mutex> lock(trace_buffers_mutex);
+    TraceBuffer* buffer = nullptr;
+    for (auto& candidate : trace_buffers) {
+        if (!candidate->in_use) {
+            buffer = candidate.get();
+            break;
         }
     }
+    if (buffer == nullptr) {
+        trace_buffers.push_back(make_unique<TraceBuffer>());
+        buffer = trace_buffers.back().get();
+        buffer->events.resize(TRACE_RING_SIZE);
+    }
+    buffer->in_use = true;
+    buffer->tid = (pid_t)syscall(SYS_gettid);
+    trace_thread.buffer = buffer;
+    return buffer;
+}
+
+// Records the span from construction to destruction when tracing was on at
+// construction
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name, string_view detail = {}) {
+        if (!trace_enabled.load(memory_order_relaxed)) return;
+        this->name = name;
+        size_t length = min(detail.size(), sizeof(this->detail) - 1);
+        memcpy(this->detail, detail.data(), length);
+        this->detail[length] = '\0';
+        start_ns = trace_clock_ns();
+    }
     
-    errno = saved_errno;
+    ~TraceSpan() {
+        if (name == nullptr) return;
+        uint64_t end_ns = trace_clock_ns();
+        TraceBuffer* buffer = trace_thread_buffer();
+        lock_guard<mutex> lock(buffer->lock);
+        TraceEvent& event = buffer->events[buffer->written % TRACE_RING_SIZE];
+        event.name = name;
+        memcpy(event.detail, detail, sizeof(detail));
+        event.start_ns = start_ns;
+        event.duration_ns = end_ns - start_ns;
+        event.tid = buffer->tid;
+        buffer->written++;
+    }
+    
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+    
+private:
+    const char* name = nullptr;
+    char detail[sizeof(TraceEvent::detail)];
+    uint64_t start_ns = 0;
+};
+
+// Drop every recorded event
+void trace_clear() {
+    lock_guard<mutex> lock(trace_buffers_mutex);
+    for (auto& buffer : trace_buffers) {
+        lock_guard<mutex> buffer_lock(buffer->lock);
+        buffer->written = 0;
+    }
 }
 
-// Initialize signal handlers
-void setup_signals() {
-    struct sigaction sa;
-    sa.sa_handler = sigchld_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-    sigaction(SIGCHLD, &sa, nullptr);
+// Write a string as a JSON string literal
+void trace_write_json_string(ostream& out, const char* text) {
+    out << '"';
+    for (const char* p = text; *p != '\0'; p++) {
+        unsigned char c = *p;
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out << escaped;
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+// Write every buffered event as a Chrome trace ("X" complete events with
+// microsecond timestamps, plus thread names)
+void trace_write_json(ostream& out) {
+    pid_t pid = getpid();
+    bool first = true;
+    auto separator = [&]() {
+        out << (first ? "\n" : ",\n");
+        first = false;
+    };
     
-    // Ignore SIGINT and SIGTSTP in shell (children will get them)
-    signal(SIGINT, SIG_IGN);
-    signal(SIGTSTP, SIG_IGN);
+    out << "{\"traceEvents\":[";
+    lock_guard<mutex> lock(trace_buffers_mutex);
+    for (auto& buffer : trace_buffers) {
+        // Copy the ring out so recording threads are only held up briefly
+        vector<TraceEvent> events;
+        {
+            lock_guard<mutex> buffer_lock(buffer->lock);
+            uint64_t count = min<uint64_t>(buffer->written, TRACE_RING_SIZE);
+            for (uint64_t i = buffer->written - count; i < buffer->written; i++) {
+                events.push_back(buffer->events[i % TRACE_RING_SIZE]);
+            }
+        }
+        
+        unordered_set<pid_t> threads;
+        for (const auto& event : events) {
+            if (threads.insert(event.tid).second) {
+                separator();
+                out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << event.tid
+                    << ",\"args\":{\"name\":\"" << (event.tid == pid ? "shell" : "worker") << "\"}}";
+            }
+            separator();
+            char times[64];
+            snprintf(times, sizeof(times), "\"ts\":%.3f,\"dur\":%.3f", event.start_ns / 1000.0, event.duration_ns / 1000.0);
+            out << "{\"name\":";
+            trace_write_json_string(out, event.name);
+            out << ",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << event.tid << "," << times;
+            if (event.detail[0] != '\0') {
+                out << ",\"args\":{\"detail\":";
+                trace_write_json_string(out, event.detail);
+                out << "}";
+            }
+            out << "}";
+        }
+    }
+    out << "\n]}\n";
+}
+
+// Trace file named by $SHELL_TRACE, written when the shell exits
+string trace_exit_file;
+
+// Write the trace to a file. Returns false (after reporting why) on failure
+bool trace_dump(const string& path) {
+    ofstream file(path);
+    if (!file) {
+        cerr << "trace: " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+    trace_write_json(file);
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Variable store
+// Shell and environment variables live in one table; exported ones make up
+// the environment of launched programs. The envp array handed to
+// posix_spawn() is a cached snapshot rebuilt only when an exported variable
+// changed since it was made, and `environ` points at it so getenv() and
+// system() agree with the table.
+// ---------------------------------------------------------------------------
+
+struct ShellVariable {
+    string value;
+    bool exported = false;
+};
+
+unordered_map<string, ShellVariable> variables;
+
+// Bumped whenever an exported variable is set, exported or unset
+uint64_t exported_version = 0;
+
+struct EnvironmentSnapshot {
+    uint64_t version = UINT64_MAX;
+    vector<string> entries;  // "NAME=value"
+    vector<char*> envp;      // Pointers into entries, NULL-terminated
+};
+
+EnvironmentSnapshot environment_snapshot;
+
+// $$ is fixed for the life of the shell
+string shell_pid_text;
+
+// Load the inherited environment as exported variables
+void import_environment() {
+    extern char** environ;
+    for (char** env = environ; *env != nullptr; env++) {
+        const char* eq = strchr(*env, '=');
+        if (eq == nullptr) continue;
+        variables[string(*env, eq - *env)] = {string(eq + 1), true};
+    }
+    exported_version++;
+    shell_pid_text = to_string(getpid());
+}
+
+// Look up a variable; nullptr if it is not set
+const string* find_variable(const string& name) {
+    auto it = variables.find(name);
+    return it == variables.end() ? nullptr : &it->second.value;
+}
+
+// Value of a variable, "" if it is not set
+string variable_value(const string& name) {
+    const string* value = find_variable(name);
+    return value ? *value : "";
+}
+
+// Set a variable, keeping its export flag
+void set_variable(const string& name, const string& value) {
+    ShellVariable& variable = variables[name];
+    variable.value = value;
+    if (variable.exported) exported_version++;
+}
+
+// Mark an existing variable for export; returns false if it isn't set
+bool export_variable(const string& name) {
+    auto it = variables.find(name);
+    if (it == variables.end()) return false;
+    if (!it->second.exported) {
+        it->second.exported = true;
+        exported_version++;
+    }
+    return true;
+}
+
+void unset_variable(const string& name) {
+    auto it = variables.find(name);
+    if (it == variables.end()) return;
+    if (it->second.exported) exported_version++;
+    variables.erase(it);
+}
+
+// envp for launched programs (rebuilt only if exports changed)
+char** exported_environment() {
+    EnvironmentSnapshot& snapshot = environment_snapshot;
+    if (snapshot.version != exported_version) {
+        snapshot.entries.clear();
+        for (const auto& [name, variable] : variables) {
+            if (variable.exported) snapshot.entries.push_back(name + "=" + variable.value);
+        }
+        sort(snapshot.entries.begin(), snapshot.entries.end());
+        
+        snapshot.envp.clear();
+        for (auto& entry : snapshot.entries) snapshot.envp.push_back(&entry[0]);
+        snapshot.envp.push_back(nullptr);
+        snapshot.version = exported_version;
+        
+        extern char** environ;
+        environ = snapshot.envp.data();
+    }
+    return snapshot.envp.data();
+}
+
+// ---------------------------------------------------------------------------
+// Child supervision
+// SIGCHLD stays blocked for the whole life of the shell and is read from a
+// signalfd, so nothing runs in signal context. Children are reaped on the
+// main thread by reap_children(): a job's state change is found through
+// job_index (pid -> position in jobs), and every other child (foreground
+// commands and pipeline stages) parks its status in unclaimed_children
+// until the code waiting for it collects it. Background notifications are
+// printed before the next prompt.
+// ---------------------------------------------------------------------------
+
+int child_signal_fd = -1;
+
+// Status of a reaped child nobody has collected yet
+struct ChildStatus {
+    int status;
+    struct rusage usage;
+};
+unordered_map<pid_t, ChildStatus> unclaimed_children;
+
+// pid -> index into jobs, rebuilt whenever jobs is compacted
+unordered_map<pid_t, size_t> job_index;
+
+// Guards job states against builtin pipeline threads listing them
+mutex jobs_mutex;
+
+// Set when the signalfd reports SIGINT (only while `wait` listens for it)
+bool child_wait_interrupted = false;
+
+// Convert a wait status to a shell exit status ($?)
+int status_to_exit_code(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    if (WIFSTOPPED(status)) return 128 + WSTOPSIG(status);
+    return 1;  // Abnormal termination
+}
+
+// Block SIGCHLD and open the signalfd that reports it
+void setup_child_supervision() {
+    sigset_t chld_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, nullptr);
+    child_signal_fd = signalfd(-1, &chld_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+// Find job by process ID
+Job* find_job_by_pid(pid_t pid) {
+    auto it = job_index.find(pid);
+    return it == job_index.end() ? nullptr : &jobs[it->second];
+}
+
+// Reap every child that changed state, without blocking
+// Returns false once the shell has no children left
+bool reap_children() {
+    // The signalfd is only a wakeup; wait4() below finds every event
+    struct signalfd_siginfo info;
+    while (child_signal_fd >= 0 && read(child_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGINT) child_wait_interrupted = true;
+    }
+    
+    while (true) {
+        int status = 0;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage);
+        if (pid == 0) return true;
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            return errno != ECHILD;
+        }
+        
+        lock_guard<mutex> lock(jobs_mutex);
+        Job* job = find_job_by_pid(pid);
+        if (job == nullptr) {
+            // A foreground child: keep the status for its waiter
+            if (!WIFCONTINUED(status)) unclaimed_children[pid] = {status, usage};
+            continue;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            job->status = DONE;
+            job->exit_status = status_to_exit_code(status);
+            job->notify = true;
+        } else if (WIFSTOPPED(status)) {
+            job->status = STOPPED;
+            job->exit_status = status_to_exit_code(status);
+            job->notify = true;
+        } else if (WIFCONTINUED(status)) {
+            job->status = RUNNING;
+        }
+    }
+}
+
+// Sleep until a child changes state or timeout_ms passes (-1 = no limit)
+void wait_for_child_event(int timeout_ms) {
+    struct pollfd fds = {child_signal_fd, POLLIN, 0};
+    if (child_signal_fd < 0) {
+        // No signalfd: poll every 10ms
+        poll(nullptr, 0, timeout_ms < 0 ? 10 : min(timeout_ms, 10));
+        return;
+    }
+    poll(&fds, 1, timeout_ms);
+}
+
+// Take the status of a foreground child reaped by reap_children()
+bool claim_child(pid_t pid, ChildStatus& result) {
+    auto it = unclaimed_children.find(pid);
+    if (it == unclaimed_children.end()) return false;
+    result = it->second;
+    unclaimed_children.erase(it);
+    return true;
+}
+
+// Wait until a (non-job) child exits or stops
+// Returns false if the child is gone without a status
+bool wait_for_child(pid_t pid, int& status, struct rusage* usage = nullptr) {
+    TraceSpan span("wait");
+    ChildStatus result;
+    while (true) {
+        bool have_children = reap_children();
+        if (claim_child(pid, result)) break;
+        if (!have_children) return false;
+        wait_for_child_event(-1);
+    }
+    status = result.status;
+    if (usage != nullptr) *usage = result.usage;
+    return true;
 }
 
 // Remove completed jobs from job list
 void cleanup_jobs() {
+    lock_guard<mutex> lock(jobs_mutex);
+    size_t before = jobs.size();
     jobs.erase(remove_if(jobs.begin(), jobs.end(),
         [](const Job& j) { return j.status == DONE; }), jobs.end());
+    if (jobs.size() == before) return;
+    
+    job_index.clear();
+    for (size_t i = 0; i < jobs.size(); i++) {
+        job_index[jobs[i].pid] = i;
+    }
 }
 
 // Add job to job list
 int add_job(pid_t pid, const string& command, bool is_background) {
     cleanup_jobs();
+    lock_guard<mutex> lock(jobs_mutex);
     Job job;
     job.job_id = next_job_id++;
     job.pid = pid;
     job.command = command;
     job.status = RUNNING;
     job.is_background = is_background;
+    job_index[pid] = jobs.size();
     jobs.push_back(job);
     return job.job_id;
 }
 
-// Find job by job ID
+// Find job by job ID (jobs are kept in job ID order)
 Job* find_job_by_id(int job_id) {
+    auto it = lower_bound(jobs.begin(), jobs.end(), job_id,
+        [](const Job& j, int id) { return j.job_id < id; });
+    if (it == jobs.end() || it->job_id != job_id) return nullptr;
+    return &(*it);
+}
+
+// Report background jobs that finished or stopped since the last prompt,
+// then drop the finished ones
+void notify_job_changes() {
+    reap_children();
     for (auto& job : jobs) {
-        if (job.job_id == job_id) {
-            return &job;
+        if (!job.notify) continue;
+        job.notify = false;
+        if (!job.is_background || !job_control) continue;
+        if (job.status == DONE) {
+            cout << "[" << job.job_id << "]+ Done\t\t" << job.command << endl;
+        } else if (job.status == STOPPED) {
+            cout << "[" << job.job_id << "]+ Stopped\t" << job.command << endl;
         }
     }
-    return nullptr;
+    cleanup_jobs();
+}
+
+// Print the job table (finished jobs are left out)
+void print_jobs(ostream& out) {
+    lock_guard<mutex> lock(jobs_mutex);
+    for (const auto& job : jobs) {
+        string status_str;
+        switch (job.status) {
+            case RUNNING:
+                status_str = string(COLOR_GREEN) + "Running" + COLOR_RESET;
+                break;
+            case STOPPED:
+                status_str = string(COLOR_YELLOW) + "Stopped" + COLOR_RESET;
+                break;
+            case DONE:
+                continue;
+        }
+        out << "[" << job.job_id << "]  " << status_str << "\t\t" << job.command << endl;
+    }
+}
+
+// Resume a job in the foreground and wait until it exits or stops again
+// Returns the exit status for $?
+int foreground_job(Job* job, ostream& out) {
+    pid_t pid = job->pid;
+    int job_id = job->job_id;
+    string cmd = job->command;
+    
+    // Send SIGCONT to resume if stopped
+    kill(pid, SIGCONT);
+    job->status = RUNNING;
+    job->is_background = false;
+    
+    // Give terminal control to job
+    if (job_control) tcsetpgrp(STDIN_FILENO, pid);
+    foreground_pgid = pid;
+    
+    out << cmd << endl;
+    
+    // Wait for the job to leave the RUNNING state
+    while (true) {
+        bool have_children = reap_children();
+        job = find_job_by_pid(pid);
+        if (job == nullptr || job->status != RUNNING || !have_children) break;
+        wait_for_child_event(-1);
+    }
+    
+    // Take back terminal control
+    if (job_control) tcsetpgrp(STDIN_FILENO, getpgrp());
+    foreground_pgid = 0;
+    
+    if (job == nullptr || job->status == RUNNING) return 1;  // Not our child
+    job->notify = false;
+    if (job->status == STOPPED) {
+        // Job stopped again
+        out << "\n[" << job_id << "]+ Stopped\t" << cmd << endl;
+        return 0;
+    }
+    int status = job->exit_status;
+    cleanup_jobs();
+    return status;
+}
+
+// wait [-n] [-t seconds] [job...]
+// Waits for the given jobs (%N or N), or for all jobs, to finish or stop;
+// -n returns as soon as one of them does. Returns the status of the last
+// job waited for, 124 on timeout, 127 for an unknown job (or for -n with
+// nothing to wait for) and 130 when interrupted with Ctrl+C
+int run_wait_builtin(const vector<string>& args) {
+    bool any = false;
+    double timeout_seconds = -1;
+    vector<pid_t> targets;
+    
+    for (size_t i = 1; i < args.size(); i++) {
+        const string& arg = args[i];
+        if (arg == "-n") {
+            any = true;
+        } else if (arg == "-t" && i + 1 < args.size()) {
+            char* end = nullptr;
+            timeout_seconds = strtod(args[++i].c_str(), &end);
+            if (*end != '\0' || timeout_seconds < 0) {
+                cerr << "wait: " << args[i] << ": invalid timeout" << endl;
+                return 2;
+            }
+        } else {
+            string spec = (!arg.empty() && arg[0] == '%') ? arg.substr(1) : arg;
+            char* end = nullptr;
+            long job_id = strtol(spec.c_str(), &end, 10);
+            Job* job = (!spec.empty() && *end == '\0') ? find_job_by_id((int)job_id) : nullptr;
+            if (job == nullptr) {
+                cerr << "wait: " << arg << ": no such job" << endl;
+                return 127;
+            }
+            targets.push_back(job->pid);
+        }
+    }
+    
+    bool explicit_targets = !targets.empty();
+    if (!explicit_targets) {
+        for (const auto& job : jobs) {
+            if (job.status == RUNNING) targets.push_back(job.pid);
+        }
+    }
+    if (targets.empty()) return any ? 127 : 0;
+    
+    // Let Ctrl+C interrupt the wait: SIGINT is normally ignored, so block it
+    // and read it from the signalfd alongside SIGCHLD while waiting
+    sigset_t wait_mask;
+    sigemptyset(&wait_mask);
+    sigaddset(&wait_mask, SIGCHLD);
+    if (job_control && child_signal_fd >= 0) {
+        sigset_t int_mask;
+        sigemptyset(&int_mask);
+        sigaddset(&int_mask, SIGINT);
+        sigprocmask(SIG_BLOCK, &int_mask, nullptr);
+        signal(SIGINT, SIG_DFL);
+        sigaddset(&wait_mask, SIGINT);
+        signalfd(child_signal_fd, &wait_mask, 0);
+    }
+    
+    child_wait_interrupted = false;
+    auto deadline = chrono::steady_clock::now() + chrono::duration<double>(max(timeout_seconds, 0.0));
+    int result = 0;
+    while (true) {
+        bool have_children = reap_children();
+        if (child_wait_interrupted) {
+            result = 130;
+            break;
+        }
+        
+        // Finished (or stopped) targets, in the order they were given
+        size_t remaining = 0;
+        bool found = false;
+        for (pid_t pid : targets) {
+            Job* job = find_job_by_pid(pid);
+            if (job == nullptr) continue;
+            if (job->status == RUNNING) {
+                remaining++;
+            } else {
+                result = job->exit_status;
+                found = true;
+                if (any) break;
+            }
+        }
+        // No children at all: the jobs belong to another process (a forked
+        // pipeline stage), so there is nothing to wait for here
+        if (remaining == 0 || (any && found) || !have_children) break;
+        
+        int timeout_ms = -1;
+        if (timeout_seconds >= 0) {
+            auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+            if (left <= 0) {
+                result = 124;
+                break;
+            }
+            timeout_ms = (int)min<long long>(left, 86400000);
+        }
+        
+        wait_for_child_event(timeout_ms);
+    }
+    
+    if (sigismember(&wait_mask, SIGINT)) {
+        // Back to SIGCHLD only; ignoring SIGINT again discards a pending one
+        sigdelset(&wait_mask, SIGINT);
+        signalfd(child_signal_fd, &wait_mask, 0);
+        signal(SIGINT, SIG_IGN);
+        sigset_t int_mask;
+        sigemptyset(&int_mask);
+        sigaddset(&int_mask, SIGINT);
+        sigprocmask(SIG_UNBLOCK, &int_mask, nullptr);
+        if (result == 130) cout << endl;
+    }
+    
+    // Jobs that were waited for are not reported again
+    for (pid_t pid : targets) {
+        Job* job = find_job_by_pid(pid);
+        if (job != nullptr && job->status == DONE) job->notify = false;
+    }
+    cleanup_jobs();
+    return result;
+}
+
+// Initialize signal handlers
+void setup_signals() {
+    setup_child_supervision();
+    
+    // Without job control Ctrl+C stops the script itself
+    if (!job_control) return;
+    
+    // Ignore SIGINT and SIGTSTP in shell (children will get them)
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    
+    // Ignore terminal access signals so the shell can take the terminal
+    // back from a finished foreground job without being stopped
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
 }
 
+// ---------------------------------------------------------------------------
+// Builtin registry
+// Every builtin is one entry of builtin_table (defined with the handlers,
+// further down): name, handler, flags and argument completion hook. The
+// table is constexpr and indexed by a perfect hash whose seed the compiler
+// finds, so find_builtin() costs one hash and one compare and allocates
+// nothing. Dispatch, `type`, tab completion and highlighting all use it.
+// ---------------------------------------------------------------------------
+
+// Where a builtin reads and writes: the shell's own 0/1/2 (with the
+// command's redirections applied) when standalone, the stage's pipe ends or
+// redirection targets in a pipeline
+struct BuiltinIO {
+    int in_fd;
+    int out_fd;
+    ostream& out;   // Writes to out_fd
+    bool pipeline;  // Running as a pipeline stage (thread or forked copy)
+};
+
+enum BuiltinFlags {
+    BUILTIN_OUTPUT_ONLY = 1 << 0,  // Only reads shell state: may run on a pipeline thread
+    BUILTIN_KEYWORD = 1 << 1,      // Prefix keyword (`time`) rather than a command
+    BUILTIN_RAW_FDS = 1 << 2       // Moves bytes between io.in_fd and io.out_fd itself
+};
+
+typedef int (*BuiltinHandler)(const vector<string>& args, BuiltinIO& io);
+typedef bool (*BuiltinPredicate)(const vector<string>& args);
+typedef void (*BuiltinCompleter)(const string& prefix, vector<string>& matches);
+
+struct Builtin {
+    const char* name;
+    BuiltinHandler handler;
+    unsigned flags;
+    BuiltinPredicate output_only;  // Invocations that are output-only despite the flags, or nullptr
+    BuiltinCompleter complete;     // Argument completion, nullptr = file names
+};
+
+const Builtin* find_builtin(string_view name);
+
 // Syntax highlighting for input (simple version)
 // Returns colored version of command for display
 string highlight_syntax(const string& line) {
@@ -155,13 +832,6 @@ string highlight_syntax(const string& line) {
     
     if (tokens.empty()) return line;
     
-    // Check if first token is a builtin or command
-    unordered_set<string> builtins = {
-        "exit", "echo", "type", "pwd", "cd", "export", "unset", "env",
-        "history", "calc", "bookmark", "jump", "git-status", "git-branch",
-        "jobs", "fg", "bg", "timer"
-    };
-    
     for (size_t i = 0; i < tokens.size(); i++) {
         if (i > 0) result += " ";
         
@@ -169,7 +839,7 @@ string highlight_syntax(const string& line) {
         
         if (i == 0) {
             // First token: command
-            if (builtins.count(token)) {
+            if (find_builtin(token) != nullptr) {
                 result += COLOR_GREEN + token + COLOR_RESET;
             } else if (token[0] == '#') {
                 // Comment - rest of line
@@ -197,7 +867,7 @@ string highlight_syntax(const string& line) {
             } else if (token == "|" || token == "&&" || token == "||" || token == ";") {
                 // Operators
                 result += COLOR_BOLD + token + COLOR_RESET;
-            } else if (token == ">" || token == ">>" || token == "2>" || token == "2>>") {
+            } else if (token == ">" || token == ">>" || token == "2>" || token == "2>>" || token == "<") {
                 // Redirection
                 result += COLOR_MAGENTA + token + COLOR_RESET;
             } else {
@@ -209,831 +879,5160 @@ string highlight_syntax(const string& line) {
     return result;
 }
 
-// Custom function to load history from a plain text file
-// Reads line by line and adds to history using add_history()
-int custom_read_history(const char* filename) {
-    ifstream file(filename);
-    if (!file.is_open()) {
-        return -1;  // Error opening file
-    }
-    
-    string line;
-    while (getline(file, line)) {
-        // Skip empty lines
-        if (!line.empty()) {
-            add_history(line.c_str());
+// Read a whole file into content
+bool read_file(const string& path, string& content) {
+    ifstream file(path, ios::binary);
+    if (!file.is_open()) return false;
+    ostringstream buffer;
+    buffer << file.rdbuf();
+    content = buffer.str();
+    return true;
+}
+
+// Write a whole buffer, retrying short writes
+// Returns 0 on success, -1 with errno set on error
+int write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
         }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Append history records (complete lines) to an O_APPEND descriptor
+// The records go out in a single write(), so appends from concurrent
+// sessions never interleave; a file not ending in a newline gets one first
+int append_history_records(int fd, string records) {
+    struct stat st;
+    char last = '\n';
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        if (pread(fd, &last, 1, st.st_size - 1) != 1) last = '\n';
     }
+    if (last != '\n') records.insert(records.begin(), '\n');
     
-    file.close();
-    return 0;  // Success
+    return write_all(fd, records.data(), records.size());
 }
 
 // Custom function to append new history entries to a file
 // Similar to append_history from GNU readline, but implemented manually
 int custom_append_history(int num_entries, const char* filename) {
     // Open file in append mode
-    ofstream file(filename, ios::app);
-    if (!file.is_open()) {
+    int fd = open(filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
         return -1;  // Error opening file
     }
     
     // Calculate starting position (last num_entries)
     int start_index = max(0, history_length - num_entries);
     
-    // Write the last num_entries to the file
+    // Collect the last num_entries and write them in one go
+    string records;
     for (int i = start_index; i < history_length; i++) {
         HIST_ENTRY* entry = history_get(i + history_base);
         if (entry) {
-            file << entry->line << endl;
+            records += entry->line;
+            records += '\n';
         }
     }
     
-    file.close();
-    return 0;  // Success
+    int result = append_history_records(fd, records);
+    close(fd);
+    return result;
 }
 
-// Get git branch name for current directory
-string get_git_branch() {
-    FILE* pipe = popen("git branch --show-current 2>/dev/null", "r");
-    if (!pipe) return "";
-    
-    char buffer[256];
-    string result = "";
-    if (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
-        result = buffer;
-        // Remove trailing newline
-        if (!result.empty() && result[result.length()-1] == '\n') {
-            result.erase(result.length()-1);
-        }
-    }
-    pclose(pipe);
-    return result;
+// ---------------------------------------------------------------------------
+// History store
+// $HISTFILE stays a plain-text file (one command per line), but instead of
+// copying every line into readline at startup it is mmap'd and read lazily.
+// Entries are located on demand by scanning backwards from the end, so
+// arrow-key navigation and `history N` only touch the tail of the file.
+// The file is shared by all sessions: each accepted command is appended
+// with O_APPEND as one write(), and before every prompt the shell stats the
+// file and indexes whatever other sessions appended since.
+// If the file can't be opened for writing, the store is read-only and this
+// session's commands live in readline's list after the store's entries.
+// ---------------------------------------------------------------------------
+
+struct HistoryStore {
+    string path;
+    int fd = -1;               // O_APPEND descriptor (-1: read-only store)
+    ino_t inode = 0;
+    const char* data = nullptr;
+    size_t size = 0;           // Bytes mapped
+    deque<size_t> starts;      // Start offsets of indexed entries, ascending
+    size_t indexed_from = 0;   // Entries before this offset are not indexed yet
+    size_t prefix_count = 0;   // Entries before indexed_from (once counted)
+    bool prefix_counted = false;
+};
+
+HistoryStore history_store;
+
+// Check whether commands are recorded straight into $HISTFILE
+bool history_shared() {
+    return history_store.fd >= 0;
 }
 
-// Get git status (clean, dirty, or untracked files)
-string get_git_status() {
-    FILE* pipe = popen("git status --porcelain 2>/dev/null", "r");
-    if (!pipe) return "";
-    
-    char buffer[256];
-    bool has_changes = false;
-    while (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
-        has_changes = true;
-        break;
-    }
-    pclose(pipe);
-    
-    return has_changes ? "✗" : "✓";
+// Session entries (readline's list) that are part of the history view
+size_t history_session_count() {
+    return history_shared() ? 0 : history_length;
 }
 
-// Check if in a git repository
-bool is_git_repo() {
-    struct stat buffer;
-    return (stat(".git", &buffer) == 0);
+void history_store_close() {
+    HistoryStore& store = history_store;
+    if (store.data) munmap((void*)store.data, store.size);
+    if (store.fd >= 0) close(store.fd);
+    string path = store.path;
+    store = HistoryStore();
+    store.path = path;
 }
 
-// Calculator function - evaluates simple mathematical expressions
-double calculate(const string& expr) {
-    // Simple calculator using eval-like approach
-    // This is a basic implementation for +, -, *, /
-    string clean_expr = expr;
-    
-    // Remove spaces
-    clean_expr.erase(remove(clean_expr.begin(), clean_expr.end(), ' '), clean_expr.end());
+// Map a plain-text history file; nothing is read until entries are needed
+bool history_store_open(const char* filename) {
+    history_store_close();
+    HistoryStore& store = history_store;
+    store.path = filename;
     
-    // Use a simple stack-based evaluation
-    // For simplicity, we'll use system's bc command
-    string cmd = "echo '" + clean_expr + "' | bc -l 2>/dev/null";
-    FILE* pipe = popen(cmd.c_str(), "r");
-    if (!pipe) return 0.0;
+    int fd = open(filename, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    bool writable = fd >= 0;
+    if (!writable) fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
     
-    char buffer[256];
-    string result = "";
-    if (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
-        result = buffer;
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        store.inode = st.st_ino;
+        if (st.st_size > 0) {
+            void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (mapped != MAP_FAILED) {
+                store.data = (const char*)mapped;
+                store.size = st.st_size;
+            }
+        }
     }
-    pclose(pipe);
     
-    try {
-        return stod(result);
-    } catch (...) {
-        return 0.0;
+    if (writable) {
+        store.fd = fd;
+    } else {
+        close(fd);
     }
+    store.indexed_from = store.size;
+    return true;
 }
 
-// Calculate and return result as string
-string calculate_str(const string& expr) {
-    string clean_expr = expr;
+// Pick up entries appended by other sessions (or by this one)
+// Growth is mapped and indexed forward; a replaced or truncated file
+// (e.g. `history -w` elsewhere) is reopened from scratch
+void history_store_refresh() {
+    HistoryStore& store = history_store;
+    if (store.path.empty()) return;
     
-    // Use bc command for calculation
-    string cmd = "echo '" + clean_expr + "' | bc -l 2>/dev/null";
-    FILE* pipe = popen(cmd.c_str(), "r");
-    if (!pipe) return "";
+    struct stat st;
+    if (stat(store.path.c_str(), &st) != 0) return;
+    if (st.st_ino != store.inode || (size_t)st.st_size < store.size) {
+        history_store_open(store.path.c_str());
+        return;
+    }
+    if ((size_t)st.st_size == store.size) return;
     
-    char buffer[256];
-    string result = "";
-    if (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
-        result = buffer;
-        // Remove trailing newline
-        if (!result.empty() && result.back() == '\n') {
-            result.pop_back();
+    int fd = (store.fd >= 0) ? store.fd : open(store.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (fd != store.fd) close(fd);
+    if (mapped == MAP_FAILED) return;
+    
+    size_t old_size = store.size;
+    if (store.data) munmap((void*)store.data, store.size);
+    store.data = (const char*)mapped;
+    store.size = st.st_size;
+    
+    // A partial last line just grew; it was already counted or indexed
+    size_t pos = old_size;
+    if (old_size > 0 && store.data[old_size - 1] != '\n') {
+        const void* newline = memchr(store.data + pos, '\n', store.size - pos);
+        pos = newline ? (const char*)newline - store.data + 1 : store.size;
+    }
+    while (pos < store.size) {
+        const void* newline = memchr(store.data + pos, '\n', store.size - pos);
+        size_t end = newline ? (const char*)newline - store.data : store.size;
+        if (end > pos) store.starts.push_back(pos);
+        pos = end + 1;
+    }
+}
+
+// Record a command in the shared store
+void history_store_append(const string& line) {
+    if (!history_shared()) return;
+    append_history_records(history_store.fd, line + "\n");
+    history_store_refresh();
+}
+
+// Index one more (older) entry; returns false at the start of the file
+// Empty lines are skipped, as the plain-text loader always did
+bool history_store_extend() {
+    HistoryStore& store = history_store;
+    while (store.indexed_from > 0) {
+        size_t end = store.indexed_from;
+        size_t text_end = (store.data[end - 1] == '\n') ? end - 1 : end;
+        const void* newline = text_end > 0 ? memrchr(store.data, '\n', text_end) : nullptr;
+        size_t start = newline ? (const char*)newline - store.data + 1 : 0;
+        
+        store.indexed_from = start;
+        if (text_end > start) {
+            store.starts.push_front(start);
+            if (store.prefix_counted) store.prefix_count--;
+            return true;
         }
     }
-    pclose(pipe);
-    
-    return result;
+    return false;
 }
 
-// Load bookmarks from file
-void load_bookmarks() {
-    string bookmark_file = string(getenv("HOME")) + "/.myshell_bookmarks";
-    ifstream file(bookmark_file);
-    if (!file.is_open()) return;
-    
-    string line;
-    while (getline(file, line)) {
-        size_t eq_pos = line.find('=');
-        if (eq_pos != string::npos) {
-            string name = line.substr(0, eq_pos);
-            string path = line.substr(eq_pos + 1);
-            bookmarks[name] = path;
+// Number of entries in the store (counts the unindexed prefix once)
+size_t history_store_count() {
+    HistoryStore& store = history_store;
+    if (!store.prefix_counted) {
+        size_t count = 0;
+        size_t pos = 0;
+        while (pos < store.indexed_from) {
+            const void* newline = memchr(store.data + pos, '\n', store.indexed_from - pos);
+            size_t end = newline ? (const char*)newline - store.data : store.indexed_from;
+            if (end > pos) count++;
+            pos = end + 1;
         }
+        store.prefix_count = count;
+        store.prefix_counted = true;
     }
-    file.close();
+    return store.prefix_count + store.starts.size();
 }
 
-// Save bookmarks to file
-void save_bookmarks() {
-    string bookmark_file = string(getenv("HOME")) + "/.myshell_bookmarks";
-    ofstream file(bookmark_file);
-    if (!file.is_open()) return;
+// Text of the store entry `back` positions from the newest (0 = newest)
+bool history_store_entry_from_end(size_t back, string& entry) {
+    HistoryStore& store = history_store;
+    while (store.starts.size() <= back) {
+        if (!history_store_extend()) return false;
+    }
+    size_t start = store.starts[store.starts.size() - 1 - back];
+    const void* newline = memchr(store.data + start, '\n', store.size - start);
+    size_t end = newline ? (const char*)newline - store.data : store.size;
+    entry.assign(store.data + start, end - start);
+    return true;
+}
+
+// Total entries: the store followed by this session's entries
+size_t history_total_count() {
+    return history_store_count() + history_session_count();
+}
+
+// Entry by position from the newest across store and session (0 = newest)
+bool history_entry_from_end(size_t back, string& entry) {
+    size_t session = history_session_count();
+    if (back < session) {
+        HIST_ENTRY* hist = history_get(history_base + history_length - 1 - back);
+        if (hist == nullptr) return false;
+        entry = hist->line;
+        return true;
+    }
+    return history_store_entry_from_end(back - session, entry);
+}
+
+// Export every entry (store and session) as plain text
+// Written to a temporary file and renamed, so exporting over $HISTFILE
+// never truncates the file while it is mapped
+int history_export(const string& filename) {
+    string temp = filename + ".tmp." + to_string(getpid());
+    ofstream file(temp);
+    if (!file.is_open()) return -1;
     
-    for (const auto& pair : bookmarks) {
-        file << pair.first << "=" << pair.second << endl;
+    size_t total = history_total_count();
+    string entry;
+    for (size_t back = total; back-- > 0;) {
+        if (history_entry_from_end(back, entry)) file << entry << '\n';
     }
     file.close();
+    
+    if (!file || rename(temp.c_str(), filename.c_str()) != 0) {
+        unlink(temp.c_str());
+        return -1;
+    }
+    return 0;
 }
 
-// Check if a command is a builtin command
-bool is_builtin(const string& command) {
-    // Set of all builtin commands
-    unordered_set<string> builtins = {
-        "echo", "exit", "type", "pwd", "cd", "history", 
-        "export", "unset", "env", "bookmark", "jump", 
-        "git-status", "git-branch", "calc", "timer",
-        "jobs", "fg", "bg"  // Job control commands
-    };
-    
-    // Check if command exists in the set
-    return builtins.count(command) > 0;
+// Arrow-key navigation over the combined history
+// history_nav_position counts back from the newest entry; -1 is the line
+// being edited, which is saved when navigation starts
+long history_nav_position = -1;
+string history_nav_saved_line;
+
+void history_nav_show(const string& text) {
+    rl_replace_line(text.c_str(), 0);
+    rl_point = rl_end;
 }
 
-// Expand environment variables and shell variables in a string
-// Supports $VAR, ${VAR}, $?, $$
-string expand_variables(const string& str) {
-    string result = "";
-    int i = 0;
+int history_nav_previous(int count, int key) {
+    string entry;
+    if (!history_entry_from_end(history_nav_position + 1, entry)) {
+        rl_ding();
+        return 0;
+    }
+    if (history_nav_position == -1) history_nav_saved_line = rl_line_buffer;
+    history_nav_position++;
+    history_nav_show(entry);
+    return 0;
+}
+
+int history_nav_next(int count, int key) {
+    if (history_nav_position < 0) {
+        rl_ding();
+        return 0;
+    }
+    history_nav_position--;
+    string entry = history_nav_saved_line;
+    if (history_nav_position >= 0) history_entry_from_end(history_nav_position, entry);
+    history_nav_show(entry);
+    return 0;
+}
+
+// History search (`history search` and Ctrl-R)
+// Each typed character adds a filter level that pulls candidates from the
+// level before it on demand, newest first, and remembers what it has
+// examined; ranking stops as soon as the recency penalty means no older
+// entry could make the top results. Matching uses memchr/memmem (SIMD in
+// glibc) directly on the mapped history buffer.
+struct HistoryCandidate {
+    const char* text;
+    size_t length;
+    size_t age;  // Entries between this one and the newest (0 = newest)
+};
+
+struct HistorySearchLevel {
+    vector<HistoryCandidate> matches;  // Matches found so far, newest first
+    size_t consumed = 0;               // Candidates of the previous level examined
+};
+
+struct HistorySearch {
+    string pattern;
+    vector<HistorySearchLevel> levels;  // levels[i] matches pattern[0..i]
+};
+
+bool is_word_boundary(char c) {
+    return c == ' ' || c == '/' || c == '-' || c == '_' || c == '.' || c == '|' || c == ';';
+}
+
+// Check that the first `count` characters of pattern appear in order in text
+bool history_subsequence_match(const char* text, size_t length, const string& pattern, size_t count) {
+    size_t pos = 0;
+    for (size_t i = 0; i < count; i++) {
+        const void* hit = memchr(text + pos, pattern[i], length - pos);
+        if (hit == nullptr) return false;
+        pos = (const char*)hit - text + 1;
+    }
+    return true;
+}
+
+// Highest score any entry can get for a pattern (before the recency penalty)
+double history_best_score(const string& pattern) {
+    return 140 + 8.0 * pattern.size();
+}
+
+double history_recency_penalty(size_t age) {
+    return 6 * log2(1.0 + age);
+}
+
+// Rank a matching entry: contiguous and word-start matches score highest,
+// gaps cost a little, and older entries lose points logarithmically
+double history_match_score(const HistoryCandidate& candidate, const string& pattern) {
+    const char* text = candidate.text;
+    size_t length = candidate.length;
+    double score = 0;
     
-    while (i < str.length()) {
-        if (str[i] == '$') {
-            // Variable expansion
-            i++;  // Skip $
-            
-            if (i >= str.length()) {
-                result += '$';  // Lone $ at end
-                break;
-            }
-            
-            // Check for special variables
-            if (str[i] == '?') {
-                // Exit status
-                result += to_string(last_exit_status);
-                i++;
-                continue;
-            } else if (str[i] == '$') {
-                // Process ID
-                result += to_string(getpid());
-                i++;
-                continue;
-            } else if (str[i] == '{') {
-                // ${VAR} syntax
-                i++;  // Skip {
-                string var_name = "";
-                while (i < str.length() && str[i] != '}') {
-                    var_name += str[i];
-                    i++;
-                }
-                if (i < str.length()) i++;  // Skip }
-                
-                // Look up variable (shell var first, then env)
-                if (shell_variables.count(var_name)) {
-                    result += shell_variables[var_name];
-                } else {
-                    const char* env_val = getenv(var_name.c_str());
-                    if (env_val) result += env_val;
-                }
+    const char* hit = (const char*)memmem(text, length, pattern.data(), pattern.size());
+    if (hit != nullptr) {
+        score = 100 + 8.0 * pattern.size();
+        if (hit == text || is_word_boundary(hit[-1])) score += 20;
+        if (length == pattern.size()) score += 20;
+    } else {
+        size_t pos = 0;
+        size_t previous = 0;
+        for (size_t i = 0; i < pattern.size(); i++) {
+            const char* found = (const char*)memchr(text + pos, pattern[i], length - pos);
+            if (found == nullptr) return -1e9;
+            size_t index = found - text;
+            score += 4;
+            if (i > 0 && index == previous + 1) {
+                score += 4;
             } else {
-                // $VAR syntax (alphanumeric and underscore)
-                string var_name = "";
-                while (i < str.length() && (isalnum(str[i]) || str[i] == '_')) {
-                    var_name += str[i];
-                    i++;
-                }
-                
-                // Look up variable
-                if (shell_variables.count(var_name)) {
-                    result += shell_variables[var_name];
-                } else {
-                    const char* env_val = getenv(var_name.c_str());
-                    if (env_val) result += env_val;
-                }
+                if (index == 0 || is_word_boundary(text[index - 1])) score += 3;
+                if (i > 0) score -= min<size_t>(index - previous - 1, 10) * 0.5;
             }
-        } else {
-            result += str[i];
-            i++;
+            previous = index;
+            pos = index + 1;
         }
     }
-    
-    return result;
+    return score - history_recency_penalty(candidate.age);
 }
 
-// Expand wildcards in a token using glob
-vector<string> expand_wildcards(const string& pattern) {
-    vector<string> matches;
-    
-    glob_t glob_result;
-    memset(&glob_result, 0, sizeof(glob_result));
-    
-    int ret = glob(pattern.c_str(), GLOB_TILDE, NULL, &glob_result);
+// Unfiltered history entry `age` positions from the newest, without copying
+bool history_candidate_at(size_t age, HistoryCandidate& candidate) {
+    size_t session = history_session_count();
+    if (age < session) {
+        HIST_ENTRY* entry = history_get(history_base + history_length - 1 - age);
+        if (entry == nullptr) return false;
+        candidate = {entry->line, strlen(entry->line), age};
+        return true;
+    }
     
-    if (ret == 0) {
-        for (size_t i = 0; i < glob_result.gl_pathc; i++) {
-            matches.push_back(string(glob_result.gl_pathv[i]));
+    HistoryStore& store = history_store;
+    size_t back = age - session;
+    while (store.starts.size() <= back) {
+        if (!history_store_extend()) return false;
+    }
+    size_t start = store.starts[store.starts.size() - 1 - back];
+    const void* newline = memchr(store.data + start, '\n', store.size - start);
+    size_t end = newline ? (const char*)newline - store.data : store.size;
+    candidate = {store.data + start, end - start, age};
+    return true;
+}
+
+// The index-th match of a level, filtering the previous level as needed
+bool history_search_match(HistorySearch& search, size_t level, size_t index, HistoryCandidate& match) {
+    HistorySearchLevel& current = search.levels[level];
+    while (current.matches.size() <= index) {
+        HistoryCandidate candidate;
+        bool more = (level == 0) ? history_candidate_at(current.consumed, candidate)
+                                 : history_search_match(search, level - 1, current.consumed, candidate);
+        if (!more) return false;
+        current.consumed++;
+        if (history_subsequence_match(candidate.text, candidate.length, search.pattern, level + 1)) {
+            current.matches.push_back(candidate);
         }
-        globfree(&glob_result);
-    } else {
-        // No matches, return original pattern
-        matches.push_back(pattern);
     }
-    
-    return matches;
+    match = current.matches[index];
+    return true;
 }
 
-// Search for an executable in PATH directories
-// Returns true if found, and stores the full path in 'full_path'
-bool find_executable_in_path(const string& command, string& full_path) {
-    // Get the PATH environment variable
-    const char* path_ptr = getenv("PATH");
-    if (path_ptr == nullptr) return false;
+// Point the search at a new pattern, keeping the levels of the common prefix
+void history_search_update(HistorySearch& search, const string& pattern) {
+    size_t common = 0;
+    while (common < pattern.size() && common < search.pattern.size() &&
+           pattern[common] == search.pattern[common]) {
+        common++;
+    }
+    search.levels.resize(common);
+    search.levels.resize(pattern.size());
+    search.pattern = pattern;
+}
+
+// Best distinct matches for the current pattern, best first
+vector<HistoryCandidate> history_search_top(HistorySearch& search, size_t limit) {
+    vector<pair<double, HistoryCandidate>> top;  // Min-heap on score
+    if (search.pattern.empty() || limit == 0) return {};
     
-    string path_env = string(path_ptr);  // Convert to string
-    stringstream ss(path_env);
-    string directory;
+    auto worse = [](const pair<double, HistoryCandidate>& a, const pair<double, HistoryCandidate>& b) {
+        return a.first > b.first || (a.first == b.first && a.second.age < b.second.age);
+    };
+    double best_possible = history_best_score(search.pattern);
+    size_t level = search.pattern.size() - 1;
     
-    // Split PATH by ':' and check each directory
-    while (getline(ss, directory, ':')) {
-        if (directory.empty()) continue;
+    HistoryCandidate candidate;
+    for (size_t i = 0; history_search_match(search, level, i, candidate); i++) {
+        double bound = best_possible - history_recency_penalty(candidate.age);
+        if (top.size() == limit && bound <= top.front().first) break;
         
-        // Build the full path: directory + "/" + command
-        string candidate = directory + "/" + command;
+        double score = history_match_score(candidate, search.pattern);
+        if (top.size() == limit && score <= top.front().first) continue;
         
-        // Check if file exists and is executable
-        // X_OK means check for execute permission
-        if (access(candidate.c_str(), X_OK) == 0) {
-            full_path = candidate;
-            return true;
+        // A repeated command scores no better than its newer copy
+        string_view text(candidate.text, candidate.length);
+        bool repeated = false;
+        for (const auto& entry : top) {
+            if (string_view(entry.second.text, entry.second.length) == text) repeated = true;
         }
+        if (repeated) continue;
+        
+        if (top.size() == limit) {
+            pop_heap(top.begin(), top.end(), worse);
+            top.pop_back();
+        }
+        top.push_back({score, candidate});
+        push_heap(top.begin(), top.end(), worse);
     }
     
-    return false;  // Not found in any directory
+    sort_heap(top.begin(), top.end(), worse);
+    vector<HistoryCandidate> result;
+    for (const auto& entry : top) result.push_back(entry.second);
+    return result;
 }
 
-// Handle the 'type' command
-void check_command_validity(const string& command) {
-    // First, check if it's a builtin
-    if (is_builtin(command)) {
-        cout << command << " is a shell builtin" << endl;
-        return;
-    }
+// After an ESC, read the rest of an escape sequence (arrow and function
+// keys) if one follows at once. Returns the final byte of a CSI/SS3
+// sequence ('A' for Up, ...), 0 for another sequence, or 27 for a lone ESC
+int read_escape_sequence() {
+    // Terminals send a sequence in one write; a lone ESC is followed by silence
+    struct pollfd input = {fileno(rl_instream ? rl_instream : stdin), POLLIN, 0};
+    if (poll(&input, 1, 50) <= 0) return 27;
     
-    // If not builtin, search in PATH
-    string full_path;
-    if (find_executable_in_path(command, full_path)) {
-        cout << command << " is " << full_path << endl;
-    } else {
-        cout << command << ": not found" << endl;
-    }
+    int c = rl_read_key();
+    if (c != '[' && c != 'O') return 0;  // Alt+key
+    // Parameter and intermediate bytes, up to the final byte (0x40-0x7e)
+    do {
+        c = rl_read_key();
+    } while (c >= 0x20 && c < 0x40);
+    return c;
 }
 
-// Parse command line with single and double quote support
-// Returns vector of tokens, handling quotes and preserving spaces within quotes
-vector<string> parse_command_line(const string& line) {
-    vector<string> tokens;
-    string current_token = "";
-    bool inside_single_quotes = false;
-    bool inside_double_quotes = false;
-    
-    // Loop through each character in the line
-    for (int i = 0; i < line.length(); i++) {
-        char ch = line[i];
-        
-        // Check for backslash inside double quotes
-        if (ch == '\\' && inside_double_quotes) {
-            // Look at the next character
-            if (i + 1 < line.length()) {
-                char next_ch = line[i + 1];
-                // Only escape specific characters: double-quote and backslash
-                if (next_ch == '\"' || next_ch == '\\') {
-                    // Skip the backslash and add the next character
-                    i++;
-                    current_token += line[i];
-                } else {
-                    // For other characters, keep the backslash literally
-                    current_token += ch;
-                }
-            } else {
-                // Backslash at end of line, keep it
-                current_token += ch;
-            }
-        }
-        // Check for backslash outside quotes (escape character)
-        else if (ch == '\\' && !inside_single_quotes && !inside_double_quotes) {
-            // Skip the backslash and add the next character literally
-            i++;  // Move to next character
-            if (i < line.length()) {
-                current_token += line[i];  // Add the escaped character
-            }
-            // If no next character, ignore the backslash
-        }
-        // Check for single quote
-        else if (ch == '\'' && !inside_double_quotes) {
-            // Toggle single quote mode (turn on/off)
-            inside_single_quotes = !inside_single_quotes;
-        }
-        // Check for double quote
-        else if (ch == '\"' && !inside_single_quotes) {
-            // Toggle double quote mode (turn on/off)
-            inside_double_quotes = !inside_double_quotes;
+// Ctrl-R: incremental fuzzy search; Ctrl-R or Up moves to the next match
+// and Down back, Enter runs the match, Ctrl-G/Esc restores the line, other
+// keys edit it
+int history_search_interactive(int count, int key) {
+    HistorySearch search;
+    string pattern;
+    string original_line = rl_line_buffer;
+    size_t selected = 0;
+    vector<HistoryCandidate> matches;
+    
+    // The search status replaces the prompt while searching
+    // (rl_message isn't usable from C++ with readline's K&R prototype)
+    string saved_prompt = rl_prompt ? rl_prompt : "";
+    while (true) {
+        string match = original_line;
+        if (!pattern.empty()) {
+            history_search_update(search, pattern);
+            matches = history_search_top(search, selected + 1);
+            if (selected >= matches.size() && selected > 0) selected = matches.size() ? matches.size() - 1 : 0;
+            if (selected < matches.size()) match.assign(matches[selected].text, matches[selected].length);
         }
-        // Check for space outside quotes
-        else if (ch == ' ' && !inside_single_quotes && !inside_double_quotes) {
-            // Space is a separator when not inside any quotes
-            if (!current_token.empty()) {
-                tokens.push_back(current_token);
-                current_token = "";
+        string message = string(!pattern.empty() && matches.empty() ? "(failed search)" : "(search)") +
+                         "`" + pattern + "': ";
+        rl_set_prompt(message.c_str());
+        rl_replace_line(match.c_str(), 0);
+        rl_point = rl_end;
+        rl_redisplay();
+        
+        int c = rl_read_key();
+        if (c == 27) {
+            int final_byte = read_escape_sequence();
+            if (final_byte == 'A') {
+                selected++;
+            } else if (final_byte == 'B') {
+                if (selected > 0) selected--;
             }
+            if (final_byte != 27) continue;  // Other keys are ignored
         }
-        // Any other character (or space inside quotes)
-        else {
-            // Add character to current token
-            current_token += ch;
+        if (c == CTRL('R')) {
+            selected++;
+        } else if (c == CTRL('G') || c == 27) {
+            rl_replace_line(original_line.c_str(), 0);
+            rl_point = rl_end;
+            break;
+        } else if (c == 127 || c == CTRL('H')) {
+            if (!pattern.empty()) pattern.pop_back();
+            selected = 0;
+        } else if (c >= 32 && c < 127) {
+            pattern += (char)c;
+            selected = 0;
+        } else {
+            // Keep the match and let the key act on it (Enter runs it)
+            rl_execute_next(c);
+            break;
         }
     }
     
-    // Add the last token if any
-    if (!current_token.empty()) {
-        tokens.push_back(current_token);
-    }
-    
-    return tokens;
+    rl_set_prompt(saved_prompt.c_str());
+    rl_redisplay();
+    return 0;
 }
 
-// Execute a pipeline of two commands
-// Execute a builtin command (for use in pipelines)
-// Returns true if command was a builtin, false otherwise
-bool execute_builtin_in_pipeline(const vector<string>& args, int& last_appended_position) {
-    if (args.empty()) return false;
-    
-    string command = args[0];
-    
-    if (!is_builtin(command)) {
-        return false;  // Not a builtin
-    }
+// Route up/down arrows and Ctrl-P/Ctrl-N through the history store and
+// replace readline's reverse search with the fuzzy one
+void install_history_navigation() {
+    rl_bind_keyseq("\\e[A", history_nav_previous);
+    rl_bind_keyseq("\\eOA", history_nav_previous);
+    rl_bind_keyseq("\\e[B", history_nav_next);
+    rl_bind_keyseq("\\eOB", history_nav_next);
+    rl_bind_key(CTRL('P'), history_nav_previous);
+    rl_bind_key(CTRL('N'), history_nav_next);
+    rl_bind_key(CTRL('R'), history_search_interactive);
+}
+
+// Print the last num_to_show entries (all when negative), numbered from 1
+void print_history(long num_to_show, ostream& out) {
+    size_t total = history_total_count();
+    size_t shown = (num_to_show < 0 || (size_t)num_to_show > total) ? total : num_to_show;
     
-    // Handle each builtin
-    if (command == "exit") {
-        exit(0);
-    }
-    else if (command == "type") {
-        // Check each argument after 'type'
-        for (int i = 1; i < args.size(); i++) {
-            check_command_validity(args[i]);
-        }
-    }
-    else if (command == "echo") {
-        // Print all words after 'echo'
-        for (int i = 1; i < args.size(); i++) {
-            cout << args[i];
-            if (i < args.size() - 1) {
-                cout << " ";
-            }
-        }
-        cout << endl;
-    }
-    else if (command == "pwd") {
-        // Print current working directory
-        vector<char> cwd(1024);
-        if (getcwd(cwd.data(), cwd.size()) != nullptr) {
-            cout << cwd.data() << endl;
-        } else {
-            cerr << "Error: Unable to get current directory" << endl;
-        }
-    }
-    else if (command == "cd") {
-        // Change directory
-        if (args.size() < 2) {
-            cerr << "cd: missing argument" << endl;
-        } else {
-            string path = args[1];
-            
-            // Handle ~ (home directory)
-            if (path == "~" || path.substr(0, 2) == "~/") {
-                const char* home = getenv("HOME");
-                if (home != nullptr) {
-                    if (path == "~") {
-                        path = string(home);
-                    } else {
-                        path = string(home) + path.substr(1);
-                    }
-                } else {
-                    cerr << "cd: HOME not set" << endl;
-                    return true;
-                }
-            }
-            
-            if (chdir(path.c_str()) != 0) {
-                cerr << "cd: " << path << ": No such file or directory" << endl;
-            }
+    string entry;
+    for (size_t back = shown; back-- > 0;) {
+        if (history_entry_from_end(back, entry)) {
+            out << "    " << (total - back) << "  " << entry << endl;
         }
     }
-    else if (command == "export") {
-        // Export variables to environment
-        for (int i = 1; i < args.size(); i++) {
-            string arg = args[i];
-            size_t eq_pos = arg.find('=');
-            
-            if (eq_pos != string::npos) {
-                // VAR=value format
-                string var_name = arg.substr(0, eq_pos);
-                string var_value = arg.substr(eq_pos + 1);
-                
-                // Set in both shell variables and environment
-                shell_variables[var_name] = var_value;
-                setenv(var_name.c_str(), var_value.c_str(), 1);
-            } else {
-                // Just VAR (export existing shell variable)
-                if (shell_variables.count(arg)) {
-                    setenv(arg.c_str(), shell_variables[arg].c_str(), 1);
-                }
+}
+
+// history builtin: list entries, search them, or -r/-w/-a <file> to
+// import/export plain text (-a appends the session entries added since
+// the last -a/-w)
+int run_history_builtin(const vector<string>& args, int& last_appended_position, ostream& out = cout) {
+    if (args.size() >= 2 && args[1] == "search") {
+        // history search [-n N] <pattern...>
+        size_t limit = 10;
+        size_t first = 2;
+        if (args.size() >= 4 && args[2] == "-n") {
+            try {
+                limit = max(1L, stol(args[3]));
+            } catch (...) {
+                cerr << "history: search: numeric argument required" << endl;
+                return 1;
             }
+            first = 4;
         }
-    }
-    else if (command == "unset") {
-        // Unset variables
-        for (int i = 1; i < args.size(); i++) {
-            shell_variables.erase(args[i]);
-            unsetenv(args[i].c_str());
-        }
-    }
-    else if (command == "env") {
-        // Print all environment variables
-        extern char** environ;
-        for (char** env = environ; *env != nullptr; env++) {
-            cout << *env << endl;
-        }
-    }
-    else if (command == "history") {
-        // Handle history -r <file> (read history from file)
-        if (args.size() >= 3 && args[1] == "-r") {
-            string filename = args[2];
-            // Read history from file and append to current history
-            if (read_history(filename.c_str()) == 0) {
-                // Successfully read history
-            } else {
-                cerr << "history: " << filename << ": cannot read" << endl;
-            }
-            return true;
+        if (first >= args.size()) {
+            cerr << "history: search: pattern required" << endl;
+            return 2;
         }
+        string pattern = args[first];
+        for (size_t i = first + 1; i < args.size(); i++) pattern += " " + args[i];
         
-        // Handle history -w <file> (write history to file)
-        if (args.size() >= 3 && args[1] == "-w") {
-            string filename = args[2];
-            // Write history to file
-            if (write_history(filename.c_str()) == 0) {
-                // Successfully wrote history
-                last_appended_position = history_length;
-            } else {
-                cerr << "history: " << filename << ": cannot write" << endl;
-            }
-            return true;
-        }
+        HistorySearch search;
+        history_search_update(search, pattern);
+        vector<HistoryCandidate> matches = history_search_top(search, limit + 1);
         
-        // Handle history -a <file> (append new commands to file)
-        if (args.size() >= 3 && args[1] == "-a") {
-            string filename = args[2];
-            // Calculate how many new entries to append
-            int new_entries = history_length - last_appended_position;
-            if (new_entries > 0) {
-                // Append only the new entries
-                if (custom_append_history(new_entries, filename.c_str()) == 0) {
-                    // Successfully appended history
-                    last_appended_position = history_length;
-                } else {
-                    cerr << "history: " << filename << ": cannot append" << endl;
-                }
-            } else {
-                // No new entries to append, just update position
-                last_appended_position = history_length;
-            }
-            return true;
-        }
+        // Leave out the search command itself (the newest entry)
+        matches.erase(remove_if(matches.begin(), matches.end(), [](const HistoryCandidate& match) {
+            return history_length > 0 && match.age == 0;
+        }), matches.end());
+        if (matches.size() > limit) matches.resize(limit);
         
-        // Display command history using readline's history
-        int num_to_show = history_length;  // Default: show all
+        for (const auto& match : matches) {
+            out << "    " << string_view(match.text, match.length) << endl;
+        }
+        return matches.empty() ? 1 : 0;
+    }
+    
+    if (args.size() >= 3 && (args[1] == "-r" || args[1] == "-w" || args[1] == "-a")) {
+        const string& filename = args[2];
+        bool to_histfile = filename == history_store.path;
         
-        // Check if user specified a limit
-        if (args.size() > 1) {
-            try {
-                num_to_show = stoi(args[1]);
-                if (num_to_show < 0) {
-                    num_to_show = 0;
+        if (args[1] == "-r") {
+            if (history_shared()) {
+                // Import into the shared store, so the entries are visible
+                // to this and every other session
+                string records;
+                if (!read_file(filename, records)) {
+                    cerr << "history: " << filename << ": cannot read" << endl;
+                    return 1;
                 }
-            } catch (...) {
-                cerr << "history: numeric argument required" << endl;
-                return true;
+                if (!records.empty() && records.back() != '\n') records += '\n';
+                append_history_records(history_store.fd, records);
+                history_store_refresh();
+            } else if (read_history(filename.c_str()) != 0) {
+                // Read history from file and append to current history
+                cerr << "history: " << filename << ": cannot read" << endl;
+                return 1;
             }
-        }
-        
-        // Calculate start index (show last num_to_show entries)
-        int start_index = max(0, history_length - num_to_show);
-        
-        for (int i = start_index; i < history_length; i++) {
-            HIST_ENTRY* entry = history_get(i + history_base);
-            if (entry) {
-                cout << "    " << (i + 1) << "  " << entry->line << endl;
+        } else if (args[1] == "-w") {
+            if (history_export(filename) != 0) {
+                cerr << "history: " << filename << ": cannot write" << endl;
+                return 1;
             }
-        }
-    }
-    else if (command == "git-status") {
-        // Show git status information
-        if (!is_git_repo()) {
-            cout << COLOR_RED << "Not a git repository" << COLOR_RESET << endl;
-            return true;
-        }
-        
-        string branch = get_git_branch();
-        string status = get_git_status();
-        
-        if (branch.empty()) {
-            cout << COLOR_YELLOW << "No branch (detached HEAD?)" << COLOR_RESET << endl;
+            last_appended_position = history_length;
+            if (to_histfile) history_store_refresh();
         } else {
-            cout << COLOR_CYAN << "Branch: " << COLOR_GREEN << branch << COLOR_RESET;
-            if (status == "✓") {
-                cout << COLOR_GREEN << " [clean]" << COLOR_RESET << endl;
-            } else {
-                cout << COLOR_RED << " [dirty]" << COLOR_RESET << endl;
+            // Append only the entries added since the last append
+            // (the shared store already has every command)
+            int new_entries = history_length - last_appended_position;
+            bool already_saved = to_histfile && history_shared();
+            if (new_entries > 0 && !already_saved &&
+                custom_append_history(new_entries, filename.c_str()) != 0) {
+                cerr << "history: " << filename << ": cannot append" << endl;
+                return 1;
             }
+            last_appended_position = history_length;
         }
+        return 0;
     }
-    else if (command == "git-branch") {
-        // Quick branch switching or listing
-        if (!is_git_repo()) {
-            cout << COLOR_RED << "Not a git repository" << COLOR_RESET << endl;
-            return true;
-        }
-        
-        if (args.size() > 1) {
-            // Switch to branch
-            string branch = args[1];
-            string cmd = "git checkout " + branch + " 2>&1";
-            system(cmd.c_str());
-        } else {
-            // List branches
-            system("git branch --color=always");
+    
+    // Display command history, optionally only the last N entries
+    long num_to_show = -1;
+    if (args.size() > 1) {
+        try {
+            num_to_show = max(0L, stol(args[1]));
+        } catch (...) {
+            cerr << "history: numeric argument required" << endl;
+            return 1;
         }
     }
-    else if (command == "bookmark") {
-        // Bookmark management
-        if (args.size() == 1) {
-            // List all bookmarks
-            if (bookmarks.empty()) {
-                cout << COLOR_YELLOW << "No bookmarks saved" << COLOR_RESET << endl;
+    print_history(num_to_show, out);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Native git support
+// The repository is found by walking up from the current directory (a .git
+// file, as used by worktrees, points at the real git directory). The branch
+// comes from HEAD, refs/ and packed-refs; clean/dirty compares the index's
+// stat cache against the working tree, hashing a file only when its stat data
+// no longer matches. Nothing here runs a git process.
+// Only unstaged changes to tracked files count as dirty: staged changes and
+// untracked files would need the object database and .gitignore rules.
+// ---------------------------------------------------------------------------
+
+struct GitRepo {
+    string git_dir;     // Per-worktree git directory (HEAD, index)
+    string common_dir;  // Shared git directory (refs, packed-refs, config)
+    string work_tree;   // Top of the working tree
+};
+
+// Strip trailing newline / carriage return characters
+string chomp(string s) {
+    while (!s.empty() && (s.back() == '\n' || s.back() == '\r')) s.pop_back();
+    return s;
+}
+
+bool same_mtime(const struct timespec& a, const struct timespec& b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// Find the repository containing the current directory
+bool find_git_repo(GitRepo& repo) {
+    char cwd_buf[4096];
+    if (getcwd(cwd_buf, sizeof(cwd_buf)) == nullptr) return false;
+    string dir = cwd_buf;
+    
+    while (true) {
+        string dot_git = (dir == "/" ? "" : dir) + "/.git";
+        struct stat st;
+        if (stat(dot_git.c_str(), &st) == 0) {
+            repo.work_tree = dir;
+            if (S_ISDIR(st.st_mode)) {
+                repo.git_dir = dot_git;
             } else {
-                cout << COLOR_CYAN << "Bookmarks:" << COLOR_RESET << endl;
-                for (const auto& pair : bookmarks) {
-                    cout << "  " << COLOR_GREEN << pair.first << COLOR_RESET 
-                         << " -> " << pair.second << endl;
-                }
+                // "gitdir: <path>" file (worktrees, submodules)
+                string content;
+                if (!read_file(dot_git, content) || content.compare(0, 8, "gitdir: ") != 0) return false;
+                string target = chomp(content.substr(8));
+                repo.git_dir = (target[0] == '/') ? target : dir + "/" + target;
             }
-        } else if (args.size() == 2) {
-            // Save current directory with name
-            char cwd[1024];
-            if (getcwd(cwd, sizeof(cwd)) != nullptr) {
-                bookmarks[args[1]] = string(cwd);
-                save_bookmarks();
-                cout << COLOR_GREEN << "Bookmarked: " << COLOR_RESET 
-                     << args[1] << " -> " << cwd << endl;
-            }
-        } else if (args.size() == 3 && args[1] == "rm") {
-            // Remove bookmark
-            if (bookmarks.erase(args[2])) {
-                save_bookmarks();
-                cout << COLOR_GREEN << "Removed bookmark: " << COLOR_RESET << args[2] << endl;
-            } else {
-                cout << COLOR_RED << "Bookmark not found: " << COLOR_RESET << args[2] << endl;
+            
+            // Linked worktrees keep refs in the main repository's git directory
+            repo.common_dir = repo.git_dir;
+            string common;
+            if (read_file(repo.git_dir + "/commondir", common)) {
+                common = chomp(common);
+                repo.common_dir = (common[0] == '/') ? common : repo.git_dir + "/" + common;
             }
-        }
-    }
-    else if (command == "jump") {
-        // Jump to bookmarked directory
-        if (args.size() < 2) {
-            cout << COLOR_RED << "Usage: jump <bookmark_name>" << COLOR_RESET << endl;
             return true;
         }
         
-        string bookmark_name = args[1];
-        if (bookmarks.count(bookmark_name)) {
-            if (chdir(bookmarks[bookmark_name].c_str()) == 0) {
-                cout << COLOR_GREEN << "Jumped to: " << COLOR_RESET 
-                     << bookmarks[bookmark_name] << endl;
+        if (dir == "/") return false;
+        size_t slash = dir.find_last_of('/');
+        dir = (slash == 0) ? "/" : dir.substr(0, slash);
+    }
+}
+
+// Check if in a git repository
+bool is_git_repo() {
+    GitRepo repo;
+    return find_git_repo(repo);
+}
+
+// Branch name from HEAD, cached on HEAD's path and mtime
+// Returns "" for a detached HEAD (like git branch --show-current)
+string get_git_branch() {
+    static string cached_head;
+    static struct timespec cached_mtime = {0, 0};
+    static string cached_branch;
+    
+    GitRepo repo;
+    if (!find_git_repo(repo)) return "";
+    
+    string head_path = repo.git_dir + "/HEAD";
+    struct stat st;
+    if (stat(head_path.c_str(), &st) != 0) return "";
+    if (head_path == cached_head && same_mtime(st.st_mtim, cached_mtime)) {
+        return cached_branch;
+    }
+    
+    string head;
+    if (!read_file(head_path, head)) return "";
+    head = chomp(head);
+    
+    string branch;
+    const string prefix = "ref: refs/heads/";
+    if (head.compare(0, prefix.size(), prefix) == 0) {
+        branch = head.substr(prefix.size());
+    }
+    
+    cached_head = head_path;
+    cached_mtime = st.st_mtim;
+    cached_branch = branch;
+    return branch;
+}
+
+// Collect branch names from refs/heads and packed-refs, sorted
+vector<string> list_git_branches(const GitRepo& repo) {
+    vector<string> branches;
+    
+    // Loose refs, walked recursively (branch names may contain '/')
+    vector<string> pending = {""};
+    string heads = repo.common_dir + "/refs/heads";
+    while (!pending.empty()) {
+        string relative = pending.back();
+        pending.pop_back();
+        
+        DIR* dir = opendir((heads + (relative.empty() ? "" : "/" + relative)).c_str());
+        if (dir == nullptr) continue;
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != nullptr) {
+            string name = entry->d_name;
+            if (name == "." || name == "..") continue;
+            string ref = relative.empty() ? name : relative + "/" + name;
+            
+            struct stat st;
+            if (stat((heads + "/" + ref).c_str(), &st) != 0) continue;
+            if (S_ISDIR(st.st_mode)) {
+                pending.push_back(ref);
             } else {
-                cout << COLOR_RED << "Failed to jump to: " << COLOR_RESET 
-                     << bookmarks[bookmark_name] << endl;
+                branches.push_back(ref);
             }
-        } else {
-            cout << COLOR_RED << "Bookmark not found: " << COLOR_RESET << bookmark_name << endl;
         }
+        closedir(dir);
     }
-    else if (command == "calc") {
-        // Calculator
-        if (args.size() < 2) {
-            cout << COLOR_RED << "Usage: calc <expression>" << COLOR_RESET << endl;
-            return true;
+    
+    // Packed refs: "<hash> refs/heads/<name>" lines
+    ifstream packed(repo.common_dir + "/packed-refs");
+    string line;
+    const string prefix = "refs/heads/";
+    while (getline(packed, line)) {
+        if (line.empty() || line[0] == '#' || line[0] == '^') continue;
+        size_t space = line.find(' ');
+        if (space == string::npos) continue;
+        string ref = chomp(line.substr(space + 1));
+        if (ref.compare(0, prefix.size(), prefix) == 0) {
+            branches.push_back(ref.substr(prefix.size()));
+        }
+    }
+    
+    sort(branches.begin(), branches.end());
+    branches.erase(unique(branches.begin(), branches.end()), branches.end());
+    return branches;
+}
+
+// Minimal SHA-1, used to hash blobs whose stat data changed
+string sha1_digest(const string& data) {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    
+    string msg = data;
+    uint64_t bit_length = (uint64_t)data.size() * 8;
+    msg += (char)0x80;
+    while (msg.size() % 64 != 56) msg += (char)0;
+    for (int i = 7; i >= 0; i--) msg += (char)((bit_length >> (i * 8)) & 0xff);
+    
+    auto rotl = [](uint32_t x, int n) { return (x << n) | (x >> (32 - n)); };
+    
+    for (size_t chunk = 0; chunk < msg.size(); chunk += 64) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            const unsigned char* p = (const unsigned char*)msg.data() + chunk + i * 4;
+            w[i] = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
         }
+        for (int i = 16; i < 80; i++) {
+            w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+            else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+            else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+            uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+            e = d; d = c; c = rotl(b, 30); b = a; a = temp;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+    
+    string digest;
+    for (int i = 0; i < 5; i++) {
+        for (int j = 3; j >= 0; j--) digest += (char)((h[i] >> (j * 8)) & 0xff);
+    }
+    return digest;
+}
+
+// One tracked path from the index, with the stat data git recorded for it
+struct GitIndexEntry {
+    string path;
+    uint32_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t ino;
+    uint32_t mode;
+    uint32_t size;
+    string hash;       // Raw object id
+    bool ignore_stat;  // assume-unchanged / skip-worktree / unmerged / gitlink
+    bool unmerged;
+};
+
+// Stat data of a file whose content matched its index entry, and when the
+// content was read
+struct GitVerifiedFile {
+    struct timespec mtime;
+    off_t size;
+    ino_t ino;
+    time_t verified_at;
+};
+
+// Parsed index, cached on the index file's path, mtime and size
+struct GitIndexCache {
+    string path;
+    struct timespec mtime = {0, 0};
+    off_t size = -1;
+    vector<GitIndexEntry> entries;
+    // Paths whose content was hashed and found unchanged (like git
+    // refreshing its index)
+    unordered_map<string, GitVerifiedFile> verified;
+};
+
+GitIndexCache git_index_cache;
+
+uint32_t read_be32(const unsigned char* p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+// Parse the index (versions 2, 3 and 4); reuses the cached parse if unchanged
+bool load_git_index(const GitRepo& repo, size_t hash_size) {
+    string index_path = repo.git_dir + "/index";
+    struct stat st;
+    if (stat(index_path.c_str(), &st) != 0) return false;
+    
+    if (git_index_cache.path == index_path && same_mtime(git_index_cache.mtime, st.st_mtim) &&
+        git_index_cache.size == st.st_size) {
+        return true;
+    }
+    
+    string data;
+    if (!read_file(index_path, data) || data.size() < 12 || data.compare(0, 4, "DIRC") != 0) return false;
+    const unsigned char* base = (const unsigned char*)data.data();
+    uint32_t version = read_be32(base + 4);
+    uint32_t count = read_be32(base + 8);
+    if (version < 2 || version > 4) return false;
+    
+    vector<GitIndexEntry> entries;
+    entries.reserve(count);
+    size_t pos = 12;
+    string previous_path;
+    
+    for (uint32_t n = 0; n < count; n++) {
+        size_t fixed = 40 + hash_size + 2;
+        if (pos + fixed > data.size()) return false;
+        const unsigned char* p = base + pos;
         
-        // Join all arguments into expression
-        string expr = "";
-        for (int i = 1; i < args.size(); i++) {
-            expr += args[i];
-            if (i < args.size() - 1) expr += " ";
+        GitIndexEntry entry;
+        entry.mtime_sec = read_be32(p + 8);
+        entry.mtime_nsec = read_be32(p + 12);
+        entry.ino = read_be32(p + 20);
+        entry.mode = read_be32(p + 24);
+        entry.size = read_be32(p + 36);
+        entry.hash = data.substr(pos + 40, hash_size);
+        uint16_t flags = (p[40 + hash_size] << 8) | p[41 + hash_size];
+        size_t cursor = pos + fixed;
+        
+        bool skip_worktree = false;
+        if (version >= 3 && (flags & 0x4000)) {
+            if (cursor + 2 > data.size()) return false;
+            uint16_t extended = (base[cursor] << 8) | base[cursor + 1];
+            skip_worktree = extended & 0x4000;
+            cursor += 2;
         }
         
-        double result = calculate(expr);
-        cout << COLOR_CYAN << result << COLOR_RESET << endl;
+        entry.unmerged = (flags >> 12) & 0x3;
+        entry.ignore_stat = (flags & 0x8000) || skip_worktree || (entry.mode & 0170000) == 0160000;
+        
+        if (version == 4) {
+            // Path is stored as "drop N bytes of the previous path" + suffix
+            size_t strip = 0;
+            unsigned char byte;
+            do {
+                if (cursor >= data.size()) return false;
+                byte = base[cursor++];
+                strip = (strip << 7) | (byte & 0x7f);
+                if (byte & 0x80) strip++;
+            } while (byte & 0x80);
+            size_t end = data.find('\0', cursor);
+            if (end == string::npos || strip > previous_path.size()) return false;
+            entry.path = previous_path.substr(0, previous_path.size() - strip) + data.substr(cursor, end - cursor);
+            pos = end + 1;
+        } else {
+            // NUL-terminated path, entry padded to a multiple of 8 bytes
+            size_t end = data.find('\0', cursor);
+            if (end == string::npos) return false;
+            entry.path = data.substr(cursor, end - cursor);
+            size_t entry_length = end - pos;
+            pos += (entry_length + 8) & ~(size_t)7;
+        }
+        previous_path = entry.path;
+        entries.push_back(entry);
+    }
+    
+    git_index_cache.path = index_path;
+    git_index_cache.mtime = st.st_mtim;
+    git_index_cache.size = st.st_size;
+    git_index_cache.entries.swap(entries);
+    git_index_cache.verified.clear();
+    return true;
+}
+
+// Check whether a tracked file still matches the index entry
+bool git_entry_unchanged(const GitRepo& repo, const GitIndexEntry& entry, bool sha1_repo) {
+    if (entry.ignore_stat) return !entry.unmerged;
+    
+    string full_path = repo.work_tree + "/" + entry.path;
+    struct stat st;
+    if (lstat(full_path.c_str(), &st) != 0) return false;  // Deleted
+    
+    // Type or executable bit changed
+    bool was_link = (entry.mode & 0170000) == 0120000;
+    if (was_link != S_ISLNK(st.st_mode)) return false;
+    if (!was_link && ((entry.mode & 0100) != 0) != ((st.st_mode & S_IXUSR) != 0)) return false;
+    
+    if ((uint32_t)st.st_size != entry.size) return false;
+    
+    // Stat data matches and the file is older than the index: trust it
+    // (a file modified in the same tick as the index was written is "racy")
+    bool stat_match = (uint32_t)st.st_mtim.tv_sec == entry.mtime_sec &&
+                      (uint32_t)st.st_mtim.tv_nsec == entry.mtime_nsec &&
+                      (uint32_t)st.st_ino == entry.ino;
+    bool racy = st.st_mtim.tv_sec >= git_index_cache.mtime.tv_sec;
+    if (stat_match && !racy) return true;
+    
+    // Hashed before and untouched since. The file must be older than the
+    // moment it was read, or a write in that same tick would go unnoticed;
+    // the index mtime does not matter here
+    auto verified = git_index_cache.verified.find(entry.path);
+    if (verified != git_index_cache.verified.end() &&
+        same_mtime(verified->second.mtime, st.st_mtim) && verified->second.size == st.st_size &&
+        verified->second.ino == st.st_ino && st.st_mtim.tv_sec < verified->second.verified_at) {
+        return true;
+    }
+    
+    // Without SHA-1 (sha256 repositories) a stat mismatch has to count as a change
+    if (!sha1_repo) return false;
+    
+    time_t read_at = time(nullptr);
+    string content;
+    if (was_link) {
+        vector<char> target(st.st_size + 1);
+        ssize_t n = readlink(full_path.c_str(), target.data(), target.size());
+        if (n < 0) return false;
+        content.assign(target.data(), n);
+    } else if (!read_file(full_path, content)) {
+        return false;
+    }
+    
+    string blob = "blob " + to_string(content.size()) + '\0' + content;
+    if (sha1_digest(blob) != entry.hash) return false;
+    
+    git_index_cache.verified[entry.path] = {st.st_mtim, st.st_size, st.st_ino, read_at};
+    return true;
+}
+
+// Get git status ("✓" clean, "✗" modified, "" not a repository)
+string get_git_status() {
+    GitRepo repo;
+    if (!find_git_repo(repo)) return "";
+    
+    // Repositories using SHA-256 object ids have longer index entries
+    string config;
+    read_file(repo.common_dir + "/config", config);
+    bool sha1_repo = config.find("objectformat = sha256") == string::npos &&
+                     config.find("objectFormat = sha256") == string::npos;
+    
+    if (!load_git_index(repo, sha1_repo ? 20 : 32)) {
+        // No index yet (fresh repository): nothing tracked, nothing modified
+        return "✓";
     }
-    else if (command == "timer") {
-        // Show last command execution time
-        cout << COLOR_YELLOW << "Use 'timer' before a command to time it" << COLOR_RESET << endl;
-        cout << COLOR_GRAY << "Example: timer sleep 2" << COLOR_RESET << endl;
+    
+    for (const auto& entry : git_index_cache.entries) {
+        if (!git_entry_unchanged(repo, entry, sha1_repo)) return "✗";
     }
-    else if (command == "jobs") {
-        // List all jobs
-        cleanup_jobs();
-        if (jobs.empty()) {
-            // No output if no jobs
+    return "✓";
+}
+
+// Print branches like `git branch`, marking the current one
+void print_git_branches(ostream& out) {
+    GitRepo repo;
+    if (!find_git_repo(repo)) return;
+    
+    string current = get_git_branch();
+    for (const auto& branch : list_git_branches(repo)) {
+        if (branch == current) {
+            out << "* " << COLOR_GREEN << branch << COLOR_RESET << endl;
         } else {
-            for (const auto& job : jobs) {
-                string status_str;
-                switch (job.status) {
-                    case RUNNING:
-                        status_str = string(COLOR_GREEN) + "Running" + COLOR_RESET;
-                        break;
-                    case STOPPED:
-                        status_str = string(COLOR_YELLOW) + "Stopped" + COLOR_RESET;
-                        break;
-                    case DONE:
-                        status_str = string(COLOR_GRAY) + "Done" + COLOR_RESET;
-                        break;
-                }
-                cout << "[" << job.job_id << "]  " << status_str << "\t\t" << job.command << endl;
-            }
+            out << "  " << branch << endl;
         }
     }
-    else if (command == "fg") {
-        // Bring job to foreground
-        if (jobs.empty()) {
-            cerr << "fg: no current job" << endl;
+}
+
+// ---------------------------------------------------------------------------
+// Calculator
+// Expressions are compiled once into postfix code, cached by their text, and
+// evaluated in-process. The default mode uses doubles; `calc -p N` evaluates
+// the same code with decimal big numbers to N digits after the point.
+// Supports + - * / % ^, parentheses and the bc -l functions sqrt, s (sine),
+// c (cosine), a (arctangent), l (natural log) and e (exponential).
+// ---------------------------------------------------------------------------
+
+enum CalcOpcode {
+    CALC_NUMBER,
+    CALC_ADD,
+    CALC_SUB,
+    CALC_MUL,
+    CALC_DIV,
+    CALC_MOD,
+    CALC_POW,
+    CALC_NEG,
+    CALC_FUNC
+};
+
+struct CalcInstruction {
+    CalcOpcode opcode;
+    double value = 0;  // CALC_NUMBER: the literal as a double
+    string text;       // CALC_NUMBER: the literal as written; CALC_FUNC: function name
+};
+
+typedef vector<CalcInstruction> CalcProgram;
+
+// Compiled expressions keyed by their text
+unordered_map<string, CalcProgram> calc_cache;
+const size_t CALC_CACHE_LIMIT = 512;
+
+// Recursive descent parser producing postfix code
+// Precedence follows bc: unary minus binds tighter than ^ (right associative),
+// then * / %, then + -
+struct CalcParser {
+    const string& text;
+    size_t pos;
+    CalcProgram& code;
+    string error;
+    
+    CalcParser(const string& text, CalcProgram& code) : text(text), pos(0), code(code) {}
+    
+    void skip_spaces() {
+        while (pos < text.size() && isspace((unsigned char)text[pos])) pos++;
+    }
+    
+    bool accept(char ch) {
+        skip_spaces();
+        if (pos < text.size() && text[pos] == ch) {
+            pos++;
             return true;
         }
-        
-        Job* job = nullptr;
-        if (args.size() > 1) {
-            // Specific job ID
-            try {
-                int job_id = stoi(args[1]);
-                job = find_job_by_id(job_id);
-                if (!job) {
-                    cerr << "fg: " << job_id << ": no such job" << endl;
-                    return true;
-                }
-            } catch (...) {
-                cerr << "fg: invalid job id" << endl;
+        return false;
+    }
+    
+    void emit(CalcOpcode opcode) {
+        CalcInstruction instr;
+        instr.opcode = opcode;
+        code.push_back(instr);
+    }
+    
+    bool parse() {
+        if (!parse_sum()) return false;
+        skip_spaces();
+        if (pos != text.size()) {
+            error = "syntax error near '" + text.substr(pos) + "'";
+            return false;
+        }
+        return true;
+    }
+    
+    bool parse_sum() {
+        if (!parse_product()) return false;
+        while (true) {
+            if (accept('+')) {
+                if (!parse_product()) return false;
+                emit(CALC_ADD);
+            } else if (accept('-')) {
+                if (!parse_product()) return false;
+                emit(CALC_SUB);
+            } else {
                 return true;
             }
-        } else {
-            // Most recent job
-            job = &jobs.back();
+        }
+    }
+    
+    bool parse_product() {
+        if (!parse_power()) return false;
+        while (true) {
+            CalcOpcode opcode;
+            if (accept('*')) opcode = CALC_MUL;
+            else if (accept('/')) opcode = CALC_DIV;
+            else if (accept('%')) opcode = CALC_MOD;
+            else return true;
+            
+            if (!parse_power()) return false;
+            emit(opcode);
+        }
+    }
+    
+    bool parse_power() {
+        if (!parse_unary()) return false;
+        if (accept('^')) {
+            if (!parse_power()) return false;  // Right associative
+            emit(CALC_POW);
+        }
+        return true;
+    }
+    
+    bool parse_unary() {
+        if (accept('-')) {
+            if (!parse_unary()) return false;
+            emit(CALC_NEG);
+            return true;
+        }
+        if (accept('+')) return parse_unary();
+        return parse_primary();
+    }
+    
+    bool parse_primary() {
+        skip_spaces();
+        if (pos >= text.size()) {
+            error = "unexpected end of expression";
+            return false;
         }
         
-        // Send SIGCONT to resume if stopped
-        kill(job->pid, SIGCONT);
-        job->status = RUNNING;
-        job->is_background = false;
+        char ch = text[pos];
         
-        // Give terminal control to job
-        tcsetpgrp(STDIN_FILENO, job->pid);
-        foreground_pgid = job->pid;
+        // Parenthesised sub-expression
+        if (ch == '(') {
+            pos++;
+            if (!parse_sum()) return false;
+            if (!accept(')')) {
+                error = "missing ')'";
+                return false;
+            }
+            return true;
+        }
         
-        cout << job->command << endl;
+        // Number: digits with an optional fraction (".5" is allowed, like bc)
+        if (isdigit((unsigned char)ch) || ch == '.') {
+            size_t start = pos;
+            while (pos < text.size() && isdigit((unsigned char)text[pos])) pos++;
+            if (pos < text.size() && text[pos] == '.') {
+                pos++;
+                while (pos < text.size() && isdigit((unsigned char)text[pos])) pos++;
+            }
+            string literal = text.substr(start, pos - start);
+            if (literal == ".") {
+                error = "syntax error near '.'";
+                return false;
+            }
+            CalcInstruction instr;
+            instr.opcode = CALC_NUMBER;
+            instr.text = literal;
+            instr.value = stod(literal);
+            code.push_back(instr);
+            return true;
+        }
         
-        // Wait for job
-        int status;
-        pid_t pid = job->pid;
-        int job_id = job->job_id;
-        string cmd = job->command;
+        // Function call: bc -l names plus their long spellings
+        if (isalpha((unsigned char)ch)) {
+            size_t start = pos;
+            while (pos < text.size() && isalpha((unsigned char)text[pos])) pos++;
+            string name = text.substr(start, pos - start);
+            
+            static const unordered_map<string, string> functions = {
+                {"sqrt", "sqrt"},
+                {"s", "s"}, {"sin", "s"},
+                {"c", "c"}, {"cos", "c"},
+                {"a", "a"}, {"atan", "a"},
+                {"l", "l"}, {"ln", "l"},
+                {"e", "e"}, {"exp", "e"}
+            };
+            auto it = functions.find(name);
+            if (it == functions.end()) {
+                error = "unknown function '" + name + "'";
+                return false;
+            }
+            if (!accept('(')) {
+                error = "expected '(' after " + name;
+                return false;
+            }
+            if (!parse_sum()) return false;
+            if (!accept(')')) {
+                error = "missing ')'";
+                return false;
+            }
+            CalcInstruction instr;
+            instr.opcode = CALC_FUNC;
+            instr.text = it->second;
+            code.push_back(instr);
+            return true;
+        }
         
-        waitpid(pid, &status, WUNTRACED);
+        error = string("syntax error near '") + ch + "'";
+        return false;
+    }
+};
+
+// Compile an expression, reusing the cached code when the text was seen before
+// Returns nullptr and sets error on a syntax error
+const CalcProgram* compile_expression(const string& expr, string& error) {
+    auto it = calc_cache.find(expr);
+    if (it != calc_cache.end()) return &it->second;
+    
+    CalcProgram code;
+    CalcParser parser(expr, code);
+    if (!parser.parse()) {
+        error = parser.error;
+        return nullptr;
+    }
+    
+    // Keep the cache bounded; expressions in loops are few and repeat
+    if (calc_cache.size() >= CALC_CACHE_LIMIT) {
+        calc_cache.clear();
+    }
+    return &(calc_cache[expr] = code);
+}
+
+// Evaluate compiled code with doubles
+bool evaluate_double(const CalcProgram& code, double& result, string& error) {
+    vector<double> stack;
+    stack.reserve(code.size());
+    
+    for (const auto& instr : code) {
+        if (instr.opcode == CALC_NUMBER) {
+            stack.push_back(instr.value);
+            continue;
+        }
+        if (instr.opcode == CALC_NEG) {
+            stack.back() = -stack.back();
+            continue;
+        }
+        if (instr.opcode == CALC_FUNC) {
+            double x = stack.back();
+            const string& name = instr.text;
+            if (name == "sqrt") {
+                if (x < 0) { error = "square root of negative number"; return false; }
+                stack.back() = sqrt(x);
+            } else if (name == "s") {
+                stack.back() = sin(x);
+            } else if (name == "c") {
+                stack.back() = cos(x);
+            } else if (name == "a") {
+                stack.back() = atan(x);
+            } else if (name == "l") {
+                if (x <= 0) { error = "logarithm of non-positive number"; return false; }
+                stack.back() = log(x);
+            } else {
+                stack.back() = exp(x);
+            }
+            continue;
+        }
         
-        // Take back terminal control
-        tcsetpgrp(STDIN_FILENO, getpgrp());
-        foreground_pgid = 0;
+        double b = stack.back();
+        stack.pop_back();
+        double& a = stack.back();
+        switch (instr.opcode) {
+            case CALC_ADD: a += b; break;
+            case CALC_SUB: a -= b; break;
+            case CALC_MUL: a *= b; break;
+            case CALC_DIV:
+                if (b == 0) { error = "divide by zero"; return false; }
+                a /= b;
+                break;
+            case CALC_MOD:
+                if (b == 0) { error = "divide by zero"; return false; }
+                a = fmod(a, b);
+                break;
+            case CALC_POW: a = pow(a, b); break;
+            default: break;
+        }
+    }
+    
+    result = stack.back();
+    if (!isfinite(result)) {
+        error = "result out of range";
+        return false;
+    }
+    return true;
+}
+
+// Format a double result: integers without a fraction, others to 15 digits
+string format_calc_double(double value) {
+    if (value == 0) return "0";  // Also turns -0 into 0
+    ostringstream out;
+    out << setprecision(15) << value;
+    return out.str();
+}
+
+// calc runs inside the shell, where Ctrl+C cannot stop it, so precision
+// mode is bounded: at most this many fraction digits (the transcendental
+// functions take under a second there) ...
+const int CALC_MAX_PRECISION = 1000;
+// ... and powers whose integer part would exceed this many digits are refused
+const size_t CALC_MAX_POWER_DIGITS = 50000;
+
+// Decimal big number for precision mode: |value| * 10^scale as digits
+struct BigNum {
+    bool negative = false;
+    vector<int> digits;  // Least significant first, no leading zeros (zero is empty)
+    int scale = 0;       // Digits after the decimal point
+};
+
+void mag_trim(vector<int>& mag) {
+    while (!mag.empty() && mag.back() == 0) mag.pop_back();
+}
+
+// Compare two trimmed magnitudes: -1, 0 or 1
+int mag_compare(const vector<int>& a, const vector<int>& b) {
+    if (a.size() != b.size()) return a.size() < b.size() ? -1 : 1;
+    for (size_t i = a.size(); i-- > 0; ) {
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+vector<int> mag_add(const vector<int>& a, const vector<int>& b) {
+    vector<int> sum;
+    int carry = 0;
+    for (size_t i = 0; i < max(a.size(), b.size()) || carry; i++) {
+        int d = carry + (i < a.size() ? a[i] : 0) + (i < b.size() ? b[i] : 0);
+        sum.push_back(d % 10);
+        carry = d / 10;
+    }
+    return sum;
+}
+
+// a - b, requires a >= b
+vector<int> mag_sub(const vector<int>& a, const vector<int>& b) {
+    vector<int> diff(a);
+    int borrow = 0;
+    for (size_t i = 0; i < diff.size(); i++) {
+        int d = diff[i] - borrow - (i < b.size() ? b[i] : 0);
+        borrow = d < 0;
+        diff[i] = d + (borrow ? 10 : 0);
+    }
+    mag_trim(diff);
+    return diff;
+}
+
+// Digits are grouped into base-10^4 limbs for multiplication, so each
+// partial product covers sixteen digit pairs
+const int MAG_LIMB_DIGITS = 4;
+
+vector<uint32_t> mag_to_limbs(const vector<int>& mag) {
+    vector<uint32_t> limbs((mag.size() + MAG_LIMB_DIGITS - 1) / MAG_LIMB_DIGITS, 0);
+    for (size_t i = mag.size(); i-- > 0; ) {
+        limbs[i / MAG_LIMB_DIGITS] = limbs[i / MAG_LIMB_DIGITS] * 10 + mag[i];
+    }
+    return limbs;
+}
+
+vector<int> mag_mul(const vector<int>& a, const vector<int>& b) {
+    if (a.empty() || b.empty()) return {};
+    vector<uint32_t> x = mag_to_limbs(a), y = mag_to_limbs(b);
+    vector<uint64_t> acc(x.size() + y.size(), 0);
+    for (size_t i = 0; i < x.size(); i++) {
+        for (size_t j = 0; j < y.size(); j++) {
+            acc[i + j] += (uint64_t)x[i] * y[j];
+        }
+    }
+    vector<int> product;
+    product.reserve(acc.size() * MAG_LIMB_DIGITS);
+    uint64_t carry = 0;
+    for (size_t i = 0; i < acc.size(); i++) {
+        uint64_t limb = acc[i] + carry;
+        carry = limb / 10000;
+        limb %= 10000;
+        for (int k = 0; k < MAG_LIMB_DIGITS; k++) {
+            product.push_back(limb % 10);
+            limb /= 10;
+        }
+    }
+    mag_trim(product);
+    return product;
+}
+
+// Truncating long division, requires b != 0. A divisor of up to 17 digits
+// fits a machine word; a longer one has each quotient digit estimated from
+// its leading digits, so a digit costs one multiply-subtract, not up to nine
+vector<int> mag_div(const vector<int>& a, const vector<int>& b) {
+    vector<int> quotient(a.size(), 0);
+    if (b.size() <= 17) {
+        uint64_t divisor = 0;
+        for (size_t i = b.size(); i-- > 0; ) divisor = divisor * 10 + b[i];
+        uint64_t remainder = 0;
+        for (size_t i = a.size(); i-- > 0; ) {
+            remainder = remainder * 10 + a[i];
+            quotient[i] = remainder / divisor;
+            remainder %= divisor;
+        }
+        mag_trim(quotient);
+        return quotient;
+    }
+    
+    // Leading 15 digits of b, plus one so the estimate never overshoots
+    const size_t lead_digits = 15;
+    int64_t lead_b = 0;
+    for (size_t k = 0; k < lead_digits; k++) lead_b = lead_b * 10 + b[b.size() - 1 - k];
+    lead_b++;
+    
+    vector<int> remainder;
+    for (size_t i = a.size(); i-- > 0; ) {
+        remainder.insert(remainder.begin(), a[i]);
+        mag_trim(remainder);
+        if (mag_compare(remainder, b) < 0) continue;
         
-        if (WIFEXITED(status) || WIFSIGNALED(status)) {
-            // Job completed
-            jobs.erase(remove_if(jobs.begin(), jobs.end(),
-                [pid](const Job& j) { return j.pid == pid; }), jobs.end());
-        } else if (WIFSTOPPED(status)) {
-            // Job stopped again
-            for (auto& j : jobs) {
-                if (j.pid == pid) {
-                    j.status = STOPPED;
-                    cout << "\n[" << job_id << "]+ Stopped\t" << cmd << endl;
-                    break;
-                }
+        // remainder < 10 * b, so it has the same number of digits or one more
+        size_t extra = remainder.size() - b.size();
+        int64_t lead_r = 0;
+        for (size_t k = 0; k < lead_digits + extra; k++) lead_r = lead_r * 10 + remainder[remainder.size() - 1 - k];
+        int q = (int)(lead_r / lead_b);
+        
+        int borrow = 0;
+        for (size_t j = 0; j < remainder.size(); j++) {
+            int d = remainder[j] - borrow - q * (j < b.size() ? b[j] : 0);
+            borrow = d < 0 ? (9 - d) / 10 : 0;
+            remainder[j] = d + borrow * 10;
+        }
+        mag_trim(remainder);
+        while (mag_compare(remainder, b) >= 0) {
+            remainder = mag_sub(remainder, b);
+            q++;
+        }
+        quotient[i] = q;
+    }
+    mag_trim(quotient);
+    return quotient;
+}
+
+void big_trim(BigNum& n) {
+    mag_trim(n.digits);
+    if (n.digits.empty()) n.negative = false;
+}
+
+BigNum big_from_string(const string& literal) {
+    BigNum n;
+    size_t dot = literal.find('.');
+    string all = literal;
+    if (dot != string::npos) {
+        all.erase(dot, 1);
+        n.scale = literal.size() - dot - 1;
+    }
+    for (size_t i = all.size(); i-- > 0; ) {
+        n.digits.push_back(all[i] - '0');
+    }
+    big_trim(n);
+    return n;
+}
+
+BigNum big_from_int(long long value) {
+    BigNum n = big_from_string(to_string(value < 0 ? -value : value));
+    n.negative = value < 0;
+    return n;
+}
+
+string big_to_string(const BigNum& n) {
+    string s;
+    for (size_t i = n.digits.size(); i-- > 0; ) {
+        s += (char)('0' + n.digits[i]);
+    }
+    if ((int)s.size() <= n.scale) {
+        s.insert(0, n.scale - s.size() + 1, '0');
+    }
+    if (n.scale > 0) {
+        s.insert(s.size() - n.scale, ".");
+    }
+    return (n.negative ? "-" : "") + s;
+}
+
+// Change the number of fraction digits (truncating, like bc)
+BigNum big_rescale(const BigNum& n, int scale) {
+    BigNum r = n;
+    if (scale >= n.scale) {
+        if (!r.digits.empty()) r.digits.insert(r.digits.begin(), scale - n.scale, 0);
+    } else {
+        size_t drop = n.scale - scale;
+        r.digits.erase(r.digits.begin(), r.digits.begin() + min(drop, r.digits.size()));
+    }
+    r.scale = scale;
+    big_trim(r);
+    return r;
+}
+
+BigNum big_neg(BigNum n) {
+    if (!n.digits.empty()) n.negative = !n.negative;
+    return n;
+}
+
+BigNum big_add(const BigNum& a, const BigNum& b) {
+    int scale = max(a.scale, b.scale);
+    BigNum x = big_rescale(a, scale);
+    BigNum y = big_rescale(b, scale);
+    BigNum r;
+    r.scale = scale;
+    if (x.negative == y.negative) {
+        r.digits = mag_add(x.digits, y.digits);
+        r.negative = x.negative;
+    } else if (mag_compare(x.digits, y.digits) >= 0) {
+        r.digits = mag_sub(x.digits, y.digits);
+        r.negative = x.negative;
+    } else {
+        r.digits = mag_sub(y.digits, x.digits);
+        r.negative = y.negative;
+    }
+    big_trim(r);
+    return r;
+}
+
+BigNum big_sub(const BigNum& a, const BigNum& b) {
+    return big_add(a, big_neg(b));
+}
+
+int big_compare(const BigNum& a, const BigNum& b) {
+    BigNum d = big_sub(a, b);
+    if (d.digits.empty()) return 0;
+    return d.negative ? -1 : 1;
+}
+
+// Product keeps at most max(scale, a.scale, b.scale) fraction digits (bc's rule)
+BigNum big_mul(const BigNum& a, const BigNum& b, int scale) {
+    BigNum r;
+    r.digits = mag_mul(a.digits, b.digits);
+    r.scale = a.scale + b.scale;
+    r.negative = a.negative != b.negative;
+    big_trim(r);
+    return big_rescale(r, min(r.scale, max(scale, max(a.scale, b.scale))));
+}
+
+// Quotient with exactly scale fraction digits, requires b != 0
+BigNum big_div(const BigNum& a, const BigNum& b, int scale) {
+    // a/b * 10^scale == A * 10^(scale + b.scale - a.scale) / B
+    int shift = scale + b.scale - a.scale;
+    vector<int> numerator = a.digits;
+    if (shift >= 0) {
+        if (!numerator.empty()) numerator.insert(numerator.begin(), shift, 0);
+    } else {
+        numerator.erase(numerator.begin(), numerator.begin() + min((size_t)-shift, numerator.size()));
+    }
+    BigNum r;
+    r.digits = mag_div(numerator, b.digits);
+    r.scale = scale;
+    r.negative = a.negative != b.negative;
+    big_trim(r);
+    return r;
+}
+
+BigNum big_sqrt(const BigNum& a, int scale) {
+    if (a.digits.empty()) return BigNum();
+    int work = scale + 5;
+    
+    // Start Newton's method from the double approximation when there is one
+    BigNum x = big_from_int(1);
+    try {
+        double approx = sqrt(stod(big_to_string(a)));
+        if (isfinite(approx) && approx > 0) {
+            ostringstream guess;
+            guess << fixed << setprecision(17) << approx;
+            x = big_from_string(guess.str());
+        }
+    } catch (...) {
+        // Out of double range: start from 1
+    }
+    
+    BigNum two = big_from_int(2);
+    for (int i = 0; i < 10000; i++) {
+        BigNum next = big_div(big_add(x, big_div(a, x, work)), two, work);
+        // Truncation can make the last digit flip-flop: a few ulps is converged
+        bool converged = big_sub(next, x).digits.size() <= 1;
+        x = next;
+        if (converged) break;
+    }
+    return big_rescale(x, scale);
+}
+
+// e^x: halve x below 1, sum the Taylor series, then square back up
+BigNum big_exp(const BigNum& x, int scale) {
+    if (x.negative) return big_div(big_from_int(1), big_exp(big_neg(x), scale + 5), scale);
+    
+    int work = scale + 10;
+    BigNum y = x;
+    BigNum one = big_from_int(1), two = big_from_int(2);
+    int halvings = 0;
+    while (big_compare(y, one) > 0) {
+        y = big_div(y, two, work + halvings);
+        halvings++;
+    }
+    work += halvings;
+    
+    BigNum sum = one, term = one;
+    for (int k = 1; k < 10000; k++) {
+        term = big_div(big_mul(term, y, work), big_from_int(k), work);
+        if (term.digits.empty()) break;
+        sum = big_add(sum, term);
+    }
+    for (int i = 0; i < halvings; i++) {
+        sum = big_mul(sum, sum, work);
+    }
+    return big_rescale(sum, scale);
+}
+
+// ln(x): take square roots until x is near 1, then 2*atanh((x-1)/(x+1))
+BigNum big_ln(const BigNum& x, int scale) {
+    int work = scale + 20;
+    BigNum y = x;
+    BigNum one = big_from_int(1);
+    BigNum low = big_from_string("0.5"), high = big_from_int(2);
+    int roots = 0;
+    while (big_compare(y, high) > 0 || big_compare(y, low) < 0) {
+        y = big_sqrt(y, work);
+        roots++;
+    }
+    
+    BigNum z = big_div(big_sub(y, one), big_add(y, one), work);
+    BigNum z2 = big_mul(z, z, work);
+    BigNum sum = z, power = z;
+    for (int k = 3; k < 100000; k += 2) {
+        power = big_mul(power, z2, work);
+        BigNum term = big_div(power, big_from_int(k), work);
+        if (term.digits.empty()) break;
+        sum = big_add(sum, term);
+    }
+    BigNum factor = big_from_int(2LL << roots);  // 2 for atanh, 2^roots for the roots
+    return big_rescale(big_mul(sum, factor, work), scale);
+}
+
+// atan(x): halve the angle until |x| is small, then sum the Taylor series
+BigNum big_atan(const BigNum& x, int scale) {
+    int work = scale + 10;
+    BigNum y = x;
+    BigNum one = big_from_int(1);
+    BigNum small = big_from_string("0.2");
+    int halvings = 0;
+    while (big_compare(y.negative ? big_neg(y) : y, small) > 0) {
+        // atan(y) = 2 * atan(y / (1 + sqrt(1 + y^2)))
+        BigNum root = big_sqrt(big_add(one, big_mul(y, y, work)), work);
+        y = big_div(y, big_add(one, root), work);
+        halvings++;
+    }
+    
+    BigNum y2 = big_mul(y, y, work);
+    BigNum sum = y, power = y;
+    for (int k = 3; k < 100000; k += 2) {
+        power = big_neg(big_mul(power, y2, work));
+        BigNum term = big_div(power, big_from_int(k), work);
+        if (term.digits.empty()) break;
+        sum = big_add(sum, term);
+    }
+    return big_rescale(big_mul(sum, big_from_int(1LL << halvings), work), scale);
+}
+
+// sin(x): reduce into one turn of the circle, then sum the Taylor series
+BigNum big_sin(const BigNum& x, int scale) {
+    int work = scale + 10;
+    BigNum two_pi = big_mul(big_atan(big_from_int(1), work), big_from_int(8), work);
+    BigNum turns = big_div(x, two_pi, 0);
+    BigNum y = big_sub(x, big_mul(turns, two_pi, work));
+    
+    BigNum y2 = big_mul(y, y, work);
+    BigNum sum = y, term = y;
+    for (int n = 1; n < 10000; n++) {
+        term = big_neg(big_div(big_mul(term, y2, work), big_from_int((2LL * n) * (2LL * n + 1)), work));
+        if (term.digits.empty()) break;
+        sum = big_add(sum, term);
+    }
+    return big_rescale(sum, scale);
+}
+
+// cos(x) = sin(x + pi/2)
+BigNum big_cos(const BigNum& x, int scale) {
+    int work = scale + 10;
+    BigNum half_pi = big_mul(big_atan(big_from_int(1), work), big_from_int(2), work);
+    return big_sin(big_add(x, half_pi), scale);
+}
+
+// Evaluate compiled code with decimal big numbers to 'scale' fraction digits
+bool evaluate_bignum(const CalcProgram& code, int scale, BigNum& result, string& error) {
+    vector<BigNum> stack;
+    
+    for (const auto& instr : code) {
+        if (instr.opcode == CALC_NUMBER) {
+            stack.push_back(big_from_string(instr.text));
+            continue;
+        }
+        if (instr.opcode == CALC_NEG) {
+            stack.back() = big_neg(stack.back());
+            continue;
+        }
+        if (instr.opcode == CALC_FUNC) {
+            BigNum x = stack.back();
+            const string& name = instr.text;
+            if (name == "sqrt") {
+                if (x.negative) { error = "square root of negative number"; return false; }
+                stack.back() = big_sqrt(x, scale);
+            } else if (name == "s") {
+                stack.back() = big_sin(x, scale);
+            } else if (name == "c") {
+                stack.back() = big_cos(x, scale);
+            } else if (name == "a") {
+                stack.back() = big_atan(x, scale);
+            } else if (name == "l") {
+                if (x.negative || x.digits.empty()) { error = "logarithm of non-positive number"; return false; }
+                stack.back() = big_ln(x, scale);
+            } else {
+                stack.back() = big_exp(x, scale);
+            }
+            continue;
+        }
+        
+        BigNum b = stack.back();
+        stack.pop_back();
+        BigNum& a = stack.back();
+        switch (instr.opcode) {
+            case CALC_ADD: a = big_add(a, b); break;
+            case CALC_SUB: a = big_sub(a, b); break;
+            case CALC_MUL: a = big_mul(a, b, scale); break;
+            case CALC_DIV:
+                if (b.digits.empty()) { error = "divide by zero"; return false; }
+                a = big_div(a, b, scale);
+                break;
+            case CALC_MOD:
+                if (b.digits.empty()) { error = "divide by zero"; return false; }
+                a = big_sub(a, big_mul(big_div(a, b, 0), b, scale));
+                break;
+            case CALC_POW: {
+                // Integer exponents only, like bc
+                BigNum whole = big_rescale(b, 0);
+                if (big_compare(whole, b) != 0) {
+                    error = "non-integer exponent";
+                    return false;
+                }
+                if (whole.digits.size() > 6) { error = "exponent too large"; return false; }
+                long long n = stoll(big_to_string(whole));
+                bool invert = n < 0;
+                if (invert) n = -n;
+                if (n > 100000) { error = "exponent too large"; return false; }
+                if (!a.digits.empty()) {
+                    // log10 |a| from its leading digits
+                    size_t lead = min<size_t>(a.digits.size(), 15);
+                    double leading = 0;
+                    for (size_t k = 0; k < lead; k++) leading = leading * 10 + a.digits[a.digits.size() - 1 - k];
+                    double magnitude = log10(leading) + (double)a.digits.size() - lead - a.scale;
+                    if (n * magnitude * (invert ? -1 : 1) > CALC_MAX_POWER_DIGITS) {
+                        error = "result too large";
+                        return false;
+                    }
+                }
+                BigNum power = big_from_int(1), base = a;
+                while (n > 0) {
+                    if (n & 1) power = big_mul(power, base, scale);
+                    n >>= 1;
+                    if (n > 0) base = big_mul(base, base, scale);
+                }
+                if (invert) {
+                    if (power.digits.empty()) { error = "divide by zero"; return false; }
+                    power = big_div(big_from_int(1), power, scale);
+                }
+                a = power;
+                break;
+            }
+            default: break;
+        }
+    }
+    
+    result = stack.back();
+    return true;
+}
+
+// Evaluate an expression; precision < 0 selects double mode,
+// otherwise decimal big numbers with that many fraction digits
+bool evaluate_expression(const string& expr, int precision, string& result, string& error) {
+    const CalcProgram* code = compile_expression(expr, error);
+    if (code == nullptr) return false;
+    
+    if (precision < 0) {
+        double value;
+        if (!evaluate_double(*code, value, error)) return false;
+        result = format_calc_double(value);
+    } else {
+        BigNum value;
+        if (!evaluate_bignum(*code, precision, value, error)) return false;
+        result = big_to_string(value);
+    }
+    return true;
+}
+
+// Calculate and return result as string ("" on error)
+string calculate_str(const string& expr) {
+    string result, error;
+    if (!evaluate_expression(expr, -1, result, error)) return "";
+    return result;
+}
+
+// Handle the 'calc' builtin: calc [-p digits] <expression>
+// Returns the exit status
+int run_calc_builtin(const vector<string>& args, ostream& out = cout) {
+    size_t first = 1;
+    int precision = -1;
+    if (args.size() > 2 && args[1] == "-p") {
+        try {
+            precision = stoi(args[2]);
+        } catch (...) {
+            precision = -1;
+        }
+        if (precision < 0 || precision > CALC_MAX_PRECISION) {
+            out << COLOR_RED << "calc: -p needs a digit count between 0 and " << CALC_MAX_PRECISION << COLOR_RESET << endl;
+            return 1;
+        }
+        first = 3;
+    }
+    
+    if (args.size() <= first) {
+        out << COLOR_YELLOW << "Usage: calc [-p digits] <expression>" << COLOR_RESET << endl;
+        out << COLOR_YELLOW << "Example: calc 2 + 2" << COLOR_RESET << endl;
+        return 1;
+    }
+    
+    // Join all arguments into expression
+    string expr;
+    for (size_t i = first; i < args.size(); i++) {
+        if (i > first) expr += " ";
+        expr += args[i];
+    }
+    
+    string result, error;
+    if (!evaluate_expression(expr, precision, result, error)) {
+        out << COLOR_RED << "calc: " << error << COLOR_RESET << endl;
+        return 1;
+    }
+    out << COLOR_CYAN << result << COLOR_RESET << endl;
+    return 0;
+}
+
+// Path of the bookmarks file ("" without $HOME)
+string bookmark_file_path() {
+    const string* home = find_variable("HOME");
+    return home ? *home + "/.myshell_bookmarks" : "";
+}
+
+// Lines in the bookmarks file (changes are appended, so it can hold stale ones)
+size_t bookmark_file_lines = 0;
+
+// Load bookmarks from file (once; later calls do nothing)
+// Later lines override earlier ones; "name=" removes a bookmark
+void load_bookmarks() {
+    static bool loaded = false;
+    if (loaded) return;
+    loaded = true;
+    
+    ifstream file(bookmark_file_path());
+    if (!file.is_open()) return;
+    
+    string line;
+    while (getline(file, line)) {
+        bookmark_file_lines++;
+        size_t eq_pos = line.find('=');
+        if (eq_pos != string::npos) {
+            string name = line.substr(0, eq_pos);
+            string path = line.substr(eq_pos + 1);
+            if (path.empty()) {
+                bookmarks.erase(name);
+            } else {
+                bookmarks[name] = path;
+            }
+        }
+    }
+    file.close();
+}
+
+// Rewrite the bookmarks file with one line per bookmark
+void save_bookmarks() {
+    string bookmark_file = bookmark_file_path();
+    if (bookmark_file.empty()) return;
+    ofstream file(bookmark_file);
+    if (!file.is_open()) return;
+    
+    for (const auto& pair : bookmarks) {
+        file << pair.first << "=" << pair.second << endl;
+    }
+    file.close();
+    bookmark_file_lines = bookmarks.size();
+}
+
+// Record one change (path "" = removed) by appending a line; the file is
+// only rewritten once stale lines outnumber the live ones
+void save_bookmark_change(const string& name, const string& path) {
+    if (bookmark_file_lines > 2 * bookmarks.size() + 16) {
+        save_bookmarks();
+        return;
+    }
+    string bookmark_file = bookmark_file_path();
+    if (bookmark_file.empty()) return;
+    int fd = open(bookmark_file.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    string line = name + "=" + path + "\n";
+    if (write(fd, line.data(), line.size()) == (ssize_t)line.size()) bookmark_file_lines++;
+    close(fd);
+}
+
+// ---------------------------------------------------------------------------
+// Directory frecency database
+// Interactive `cd` and `jump` record visits in ~/.myshell_dirs: a magic
+// followed by variable-length records (a fixed header, then the path). A
+// visit to a known directory rewrites its 8-byte header in place and a new
+// directory appends one record, under flock() so sessions can share the
+// file. Lookups scan the mmap'd file directly. Once the scores add up to
+// DIRDB_MAX_TOTAL they are aged (x0.9, dropping directories below 1) and
+// the file is rewritten compacted through a temporary file and rename;
+// that is the only full rewrite.
+// ---------------------------------------------------------------------------
+
+const char DIRDB_MAGIC[8] = {'M', 'S', 'H', 'D', 'I', 'R', 'S', '1'};
+constexpr double DIRDB_MAX_TOTAL = 100000;  // Room for tens of thousands of directories
+
+struct DirRecord {
+    float score;          // Visits, aged
+    uint32_t last_visit;  // Unix time
+    uint16_t path_length;
+    uint16_t name_offset; // Start of the last path component
+    // path_length bytes of path follow, padded to a multiple of 4
+};
+
+static_assert(sizeof(DirRecord) == 12, "DirRecord is an on-disk format");
+
+struct DirDatabase {
+    string path;
+    int fd = -1;
+    ino_t inode = 0;
+    const char* data = nullptr;  // Read-only mapping of the whole file
+    size_t size = 0;
+};
+
+DirDatabase dir_database;
+
+// Record visits (interactive shells only, so scripts don't skew the ranking)
+bool dir_tracking = false;
+
+size_t dirdb_record_size(uint16_t path_length) {
+    return sizeof(DirRecord) + ((path_length + 3u) & ~3u);
+}
+
+void dirdb_close() {
+    DirDatabase& db = dir_database;
+    if (db.data != nullptr) munmap((void*)db.data, db.size);
+    if (db.fd >= 0) close(db.fd);
+    db.data = nullptr;
+    db.size = 0;
+    db.fd = -1;
+}
+
+// Make the mapping match the file: reopen it if it was replaced (aged by
+// another session), remap it if it grew. Returns false without a database
+bool dirdb_sync() {
+    DirDatabase& db = dir_database;
+    if (db.path.empty()) {
+        const string* home = find_variable("HOME");
+        if (home == nullptr) return false;
+        db.path = *home + "/.myshell_dirs";
+    }
+    
+    struct stat st;
+    if (db.fd >= 0 && (stat(db.path.c_str(), &st) != 0 || st.st_ino != db.inode)) dirdb_close();
+    if (db.fd < 0) {
+        db.fd = open(db.path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (db.fd < 0) return false;
+        if (fstat(db.fd, &st) != 0) {
+            dirdb_close();
+            return false;
+        }
+        db.inode = st.st_ino;
+        if (st.st_size == 0) {
+            if (pwrite(db.fd, DIRDB_MAGIC, sizeof(DIRDB_MAGIC), 0) != (ssize_t)sizeof(DIRDB_MAGIC)) {
+                dirdb_close();
+                return false;
+            }
+        }
+    }
+    
+    if (fstat(db.fd, &st) != 0) return false;
+    if ((size_t)st.st_size != db.size) {
+        if (db.data != nullptr) munmap((void*)db.data, db.size);
+        db.data = nullptr;
+        db.size = 0;
+        void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, db.fd, 0);
+        if (mapped == MAP_FAILED) return false;
+        db.data = (const char*)mapped;
+        db.size = st.st_size;
+    }
+    return db.size >= sizeof(DIRDB_MAGIC) && memcmp(db.data, DIRDB_MAGIC, sizeof(DIRDB_MAGIC)) == 0;
+}
+
+// Call fn(offset, record, path) for every complete record
+template <typename Fn>
+void dirdb_for_each(Fn fn) {
+    const DirDatabase& db = dir_database;
+    size_t offset = sizeof(DIRDB_MAGIC);
+    while (offset + sizeof(DirRecord) <= db.size) {
+        DirRecord record;
+        memcpy(&record, db.data + offset, sizeof(record));
+        size_t record_size = dirdb_record_size(record.path_length);
+        if (offset + record_size > db.size) break;
+        fn(offset, record, string_view(db.data + offset + sizeof(DirRecord), record.path_length));
+        offset += record_size;
+    }
+}
+
+// Age every score by 0.9, drop directories that fall below 1 (except
+// keep, the one just visited) and write the file anew (called with the
+// lock held)
+void dirdb_age(const string& keep) {
+    DirDatabase& db = dir_database;
+    string compacted(DIRDB_MAGIC, sizeof(DIRDB_MAGIC));
+    dirdb_for_each([&](size_t, DirRecord record, string_view path) {
+        record.score *= 0.9f;
+        if (record.score < 1 && path != keep) return;
+        compacted.append((const char*)&record, sizeof(record));
+        compacted.append(path);
+        compacted.append(dirdb_record_size(record.path_length) - sizeof(record) - path.size(), '\0');
+    });
+    
+    string temp_path = db.path + ".tmp" + to_string(getpid());
+    int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return;
+    bool written = write(fd, compacted.data(), compacted.size()) == (ssize_t)compacted.size();
+    close(fd);
+    if (!written || rename(temp_path.c_str(), db.path.c_str()) != 0) {
+        unlink(temp_path.c_str());
+    }
+}
+
+// Count a visit to directory (an absolute path)
+void dirdb_visit(const string& directory) {
+    if (!dir_tracking || directory.empty() || directory.size() > UINT16_MAX) return;
+    TraceSpan span("dirdb_visit", directory);
+    
+    // Lock, then make sure the file we locked is still the current one
+    for (int attempt = 0; attempt < 3; attempt++) {
+        if (!dirdb_sync()) return;
+        flock(dir_database.fd, LOCK_EX);
+        ino_t locked = dir_database.inode;
+        if (dirdb_sync() && dir_database.inode == locked) break;
+        flock(dir_database.fd, LOCK_UN);
+        if (attempt == 2) return;
+    }
+    DirDatabase& db = dir_database;
+    
+    time_t now = time(nullptr);
+    size_t found = 0;
+    double total = 0;
+    DirRecord found_record = {};
+    dirdb_for_each([&](size_t offset, const DirRecord& record, string_view path) {
+        total += record.score;
+        if (found == 0 && path == directory) {
+            found = offset;
+            found_record = record;
+        }
+    });
+    
+    if (found != 0) {
+        // Known directory: update score and time in place
+        found_record.score += 1;
+        found_record.last_visit = (uint32_t)now;
+        pwrite(db.fd, &found_record, offsetof(DirRecord, path_length), found);
+    } else {
+        // New directory: one record at the end
+        DirRecord record = {1, (uint32_t)now, (uint16_t)directory.size(), (uint16_t)(directory.rfind('/') + 1)};
+        string bytes((const char*)&record, sizeof(record));
+        bytes.append(directory);
+        bytes.append(dirdb_record_size(record.path_length) - bytes.size(), '\0');
+        pwrite(db.fd, bytes.data(), bytes.size(), db.size);
+    }
+    
+    if (total + 1 > DIRDB_MAX_TOTAL) {
+        dirdb_sync();
+        dirdb_age(directory);
+    }
+    flock(db.fd, LOCK_UN);
+}
+
+// Visit count weighted by how recently the directory was visited
+double dirdb_frecency(const DirRecord& record, time_t now) {
+    double age = difftime(now, (time_t)record.last_visit);
+    if (age < 3600) return record.score * 4;
+    if (age < 86400) return record.score * 2;
+    if (age < 604800) return record.score * 0.5;
+    return record.score * 0.25;
+}
+
+// ASCII-only lowercase (tolower() goes through the locale on every call)
+inline char ascii_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+// Find needle (lowercase) in haystack from position from, ignoring case
+size_t find_ignoring_case(string_view haystack, const string& needle, size_t from) {
+    if (needle.size() > haystack.size()) return string_view::npos;
+    for (size_t i = from; i + needle.size() <= haystack.size(); i++) {
+        size_t j = 0;
+        while (j < needle.size() && ascii_lower(haystack[i + j]) == needle[j]) j++;
+        if (j == needle.size()) return i;
+    }
+    return string_view::npos;
+}
+
+// How well a directory matches the fragments (lowercase), 0 = not at all:
+// the last fragment must be in the last path component, as a substring (1)
+// or failing that as a subsequence (0.5), and the others must appear in
+// order in the components before it. The last component is checked first,
+// since it is short and rules out most directories
+double dirdb_match_quality(string_view path, size_t base, const vector<string>& fragments) {
+
+    const string& last = fragments.back();
+    double quality = 0;
+    if (find_ignoring_case(path, last, base) != string_view::npos) {
+        quality = 1;
+    } else {
+        size_t j = 0;
+        for (size_t i = base; i < path.size() && j < last.size(); i++) {
+            if (ascii_lower(path[i]) == last[j]) j++;
+        }
+        if (j < last.size()) return 0;
+        quality = 0.5;
+    }
+    
+    string_view parent = path.substr(0, base);
+    size_t position = 0;
+    for (size_t i = 0; i + 1 < fragments.size(); i++) {
+        position = find_ignoring_case(parent, fragments[i], position);
+        if (position == string_view::npos) return 0;
+        position += fragments[i].size();
+    }
+    return quality;
+}
+
+// Directories matching fragments (all of them if none), best first, as
+// (rank, path); at most limit, skipping directories that no longer exist
+// and the current one
+vector<pair<double, string>> dirdb_rank(const vector<string>& fragments, size_t limit) {
+    vector<pair<double, string>> ranked;
+    if (!dirdb_sync()) return ranked;
+    TraceSpan span("dirdb_rank");
+    
+    vector<string> lowered = fragments;
+    for (auto& fragment : lowered) {
+        transform(fragment.begin(), fragment.end(), fragment.begin(), ascii_lower);
+    }
+    
+    time_t now = time(nullptr);
+    vector<pair<double, string_view>> candidates;
+    dirdb_for_each([&](size_t, const DirRecord& record, string_view path) {
+        size_t base = min<size_t>(record.name_offset, path.size());
+        double quality = lowered.empty() ? 1 : dirdb_match_quality(path, base, lowered);
+        if (quality > 0) candidates.push_back({dirdb_frecency(record, now) * quality, path});
+    });
+    
+    // Pop the best candidates off a heap (no full sort), checking at most
+    // DIRDB_MAX_CHECKS of them against the filesystem
+    const size_t DIRDB_MAX_CHECKS = 64;
+    auto worse = [](const auto& a, const auto& b) { return a.first < b.first; };
+    make_heap(candidates.begin(), candidates.end(), worse);
+    
+    char cwd[4096];
+    string current = getcwd(cwd, sizeof(cwd)) ? cwd : "";
+    for (size_t checked = 0; !candidates.empty() && ranked.size() < limit && checked < DIRDB_MAX_CHECKS; checked++) {
+        pop_heap(candidates.begin(), candidates.end(), worse);
+        auto [rank, path] = candidates.back();
+        candidates.pop_back();
+        string directory(path);
+        struct stat st;
+        if (directory == current || stat(directory.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+        ranked.push_back({rank, directory});
+    }
+    return ranked;
+}
+
+// Check if a command is a builtin command
+bool is_builtin(const string& command) {
+    return find_builtin(command) != nullptr;
+}
+
+// Expand the PIPESTATUS array: PIPESTATUS, PIPESTATUS[n], PIPESTATUS[@]
+// Returns false if var_name is not PIPESTATUS
+bool expand_pipe_status(const string& var_name, string& value) {
+    if (var_name.compare(0, 10, "PIPESTATUS") != 0) return false;
+    
+    string subscript = var_name.substr(10);
+    if (subscript.empty()) {
+        // Plain $PIPESTATUS is the first element, like bash
+        value = pipe_status.empty() ? "" : to_string(pipe_status[0]);
+        return true;
+    }
+    if (subscript.size() < 3 || subscript.front() != '[' || subscript.back() != ']') {
+        return false;
+    }
+    
+    string index = subscript.substr(1, subscript.size() - 2);
+    value = "";
+    if (index == "@" || index == "*") {
+        for (size_t i = 0; i < pipe_status.size(); i++) {
+            if (i > 0) value += " ";
+            value += to_string(pipe_status[i]);
+        }
+        return true;
+    }
+    try {
+        size_t n = stoul(index);
+        if (n < pipe_status.size()) value = to_string(pipe_status[n]);
+    } catch (...) {
+        // Bad subscript expands to nothing
+    }
+    return true;
+}
+
+// How a byte of an unescaped word was quoted
+enum QuoteKind : char {
+    QUOTE_NONE,     // Unquoted: expands and globs
+    QUOTE_DOUBLE,   // In double quotes: $ expands, wildcards are literal
+    QUOTE_LITERAL   // In single quotes or escaped: literal
+};
+
+// Expand environment variables and shell variables in a string
+// Supports $VAR, ${VAR}, $?, $$, ${PIPESTATUS[n]}
+// With quoting (a QuoteKind per byte of str), a literal $ is kept and a
+// name ends where its quoting changes; result_quoting then receives the
+// QuoteKind of each byte of the result (a value is quoted if its $ was)
+string expand_variables(const string& str, const string& quoting, string* result_quoting) {
+    TraceSpan span("expand_variables");
+    string result = "";
+    size_t i = 0;
+    auto quote_at = [&](size_t index) {
+        return quoting.empty() ? QUOTE_NONE : (QuoteKind)quoting[index];
+    };
+    
+    while (i < str.length()) {
+        QuoteKind quote = quote_at(i);
+        if (str[i] != '$' || quote == QUOTE_LITERAL) {
+            result += str[i];
+            if (result_quoting) *result_quoting += quote;
+            i++;
+            continue;
+        }
+        
+        // Variable expansion
+        size_t value_start = result.size();
+        i++;  // Skip $
+        auto in_name = [&](size_t index) {
+            return index < str.length() && quote_at(index) == quote;
+        };
+        
+        if (!in_name(i)) {
+            result += '$';  // Lone $ at the end (or before a quote)
+        } else if (str[i] == '?') {
+            // Exit status
+            result += to_string(last_exit_status);
+            i++;
+        } else if (str[i] == '$') {
+            // Process ID
+            result += shell_pid_text;
+            i++;
+        } else if (str[i] == '#') {
+            // Number of positional parameters
+            const string* count = find_variable("#");
+            result += count ? *count : "0";
+            i++;
+        } else if (str[i] == '@' || str[i] == '*') {
+            // All positional parameters, space separated
+            const string* count = find_variable("#");
+            int params = count ? stoi(*count) : 0;
+            for (int n = 1; n <= params; n++) {
+                if (n > 1) result += ' ';
+                result += variable_value(to_string(n));
+            }
+            i++;
+        } else {
+            // ${VAR} or $VAR (alphanumeric and underscore)
+            string var_name = "";
+            if (str[i] == '{') {
+                i++;  // Skip {
+                while (i < str.length() && str[i] != '}') {
+                    var_name += str[i];
+                    i++;
+                }
+                if (i < str.length()) i++;  // Skip }
+            } else {
+                while (in_name(i) && (isalnum(str[i]) || str[i] == '_')) {
+                    var_name += str[i];
+                    i++;
+                }
+            }
+            
+            // Look up variable (PIPESTATUS, then the variable table)
+            string array_value;
+            if (expand_pipe_status(var_name, array_value)) {
+                result += array_value;
+            } else if (const string* value = find_variable(var_name)) {
+                result += *value;
+            }
+        }
+        if (result_quoting) result_quoting->append(result.size() - value_start, quote);
+    }
+    
+    return result;
+}
+
+string expand_variables(const string& str) {
+    return expand_variables(str, "", nullptr);
+}
+
+// ---------------------------------------------------------------------------
+// Glob engine
+// Patterns are split into path components and matched against directory
+// listings read with getdents64(), whose d_type saves a stat() per entry.
+// Listings (and whole-tree walks for `**`) are cached while one command's
+// words are expanded, so several patterns over the same directory read it
+// once. `**` matches any number of directories; its walk spreads over a
+// small thread pool. Results are sorted by byte value.
+// ---------------------------------------------------------------------------
+
+struct GlobEntry {
+    string name;         // File name (or path relative to the walk root)
+    unsigned char type;  // DT_* from getdents64 (resolved if DT_UNKNOWN)
+};
+
+// Layout of the records returned by getdents64()
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+unordered_map<string, vector<GlobEntry>> glob_listing_cache;
+unordered_map<string, vector<GlobEntry>> glob_tree_cache;
+
+// Forget cached listings (called before each command is expanded)
+void glob_cache_clear() {
+    glob_listing_cache.clear();
+    glob_tree_cache.clear();
+}
+
+// Read a directory ("" is the current one), without "." and ".."
+bool read_directory(const string& path, vector<GlobEntry>& entries) {
+    int fd = open(path.empty() ? "." : path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return false;
+    
+    alignas(8) char buffer[64 * 1024];
+    while (true) {
+        long n = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+        if (n <= 0) break;
+        for (long offset = 0; offset < n;) {
+            const LinuxDirent64* entry = (const LinuxDirent64*)(buffer + offset);
+            offset += entry->d_reclen;
+            
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN) {
+                // Some filesystems don't fill d_type
+                struct stat st;
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                    type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+                }
+            }
+            entries.push_back({name, type});
+        }
+    }
+    close(fd);
+    return true;
+}
+
+// Join a directory prefix and a name the way the pattern spelled them
+string glob_join(const string& directory, const string& name) {
+    if (directory.empty()) return name;
+    if (directory.back() == '/') return directory + name;
+    return directory + "/" + name;
+}
+
+// Cached listing of one directory
+const vector<GlobEntry>& glob_listing(const string& directory) {
+    auto it = glob_listing_cache.find(directory);
+    if (it != glob_listing_cache.end()) return it->second;
+    vector<GlobEntry> entries;
+    read_directory(directory, entries);
+    return glob_listing_cache[directory] = move(entries);
+}
+
+// Every non-hidden entry below root (names are paths relative to root)
+// Directories are handed out to worker threads through a shared queue;
+// symlinks are listed but not followed
+vector<GlobEntry> walk_directory_tree(const string& root) {
+    TraceSpan span("walk_tree", root);
+    mutex state_mutex;
+    condition_variable state_changed;
+    vector<string> pending = {""};
+    size_t active = 0;
+    vector<GlobEntry> found;
+    
+    auto worker = [&]() {
+        vector<GlobEntry> listing;
+        unique_lock<mutex> lock(state_mutex);
+        while (true) {
+            state_changed.wait(lock, [&]() { return !pending.empty() || active == 0; });
+            if (pending.empty()) break;  // Nothing queued and nobody can queue more
+            string directory = move(pending.back());
+            pending.pop_back();
+            active++;
+            lock.unlock();
+            
+            listing.clear();
+            {
+                TraceSpan span("read_directory", directory);
+                read_directory(glob_join(root, directory), listing);
+            }
+            vector<GlobEntry> local_found;
+            vector<string> local_dirs;
+            for (auto& entry : listing) {
+                if (entry.name[0] == '.') continue;
+                string relative = directory.empty() ? entry.name : directory + "/" + entry.name;
+                if (entry.type == DT_DIR) local_dirs.push_back(relative);
+                local_found.push_back({move(relative), entry.type});
+            }
+            
+            lock.lock();
+            found.insert(found.end(), make_move_iterator(local_found.begin()), make_move_iterator(local_found.end()));
+            pending.insert(pending.end(), make_move_iterator(local_dirs.begin()), make_move_iterator(local_dirs.end()));
+            active--;
+            state_changed.notify_all();
+        }
+    };
+    
+    unsigned thread_count = min(8u, max(1u, thread::hardware_concurrency()));
+    vector<thread> helpers;
+    for (unsigned i = 1; i < thread_count; i++) helpers.emplace_back(worker);
+    worker();
+    for (auto& helper : helpers) helper.join();
+    return found;
+}
+
+// Cached recursive walk for `**`
+const vector<GlobEntry>& glob_tree(const string& root) {
+    auto it = glob_tree_cache.find(root);
+    if (it != glob_tree_cache.end()) return it->second;
+    return glob_tree_cache[root] = walk_directory_tree(root);
+}
+
+// Match c against the bracket expression at pattern[p] ('[')
+// Returns 1/0 for match/no match and sets end past the ']',
+// or -1 if the bracket is never closed (then '[' is literal)
+int glob_match_bracket(const string& pattern, size_t p, unsigned char c, size_t& end) {
+    size_t i = p + 1;
+    bool negate = false;
+    if (i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^')) {
+        negate = true;
+        i++;
+    }
+    
+    bool matched = false;
+    bool first = true;
+    while (i < pattern.size() && (pattern[i] != ']' || first)) {
+        first = false;
+        unsigned char low = pattern[i];
+        if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+            unsigned char high = pattern[i + 2];
+            if (low <= c && c <= high) matched = true;
+            i += 3;
+        } else {
+            if (low == c) matched = true;
+            i++;
+        }
+    }
+    if (i >= pattern.size()) return -1;
+    end = i + 1;
+    return matched != negate;
+}
+
+// Match one path component against a pattern with *, ? and [...];
+// a backslash makes the next character literal
+bool glob_match(const string& pattern, const string& name) {
+    size_t p = 0, n = 0;
+    size_t star = string::npos, star_name = 0;  // Last * and where it resumed
+    
+    while (n < name.size()) {
+        if (p < pattern.size()) {
+            char c = pattern[p];
+            if (c == '\\' && p + 1 < pattern.size()) {
+                if (pattern[p + 1] == name[n]) {
+                    p += 2;
+                    n++;
+                    continue;
+                }
+            } else if (c == '*') {
+                star = p++;
+                star_name = n;
+                continue;
+            }
+            if (c == '?') {
+                p++;
+                n++;
+                continue;
+            }
+            if (c == '[') {
+                size_t end;
+                int result = glob_match_bracket(pattern, p, name[n], end);
+                if (result == 1) {
+                    p = end;
+                    n++;
+                    continue;
+                }
+                if (result == -1 && name[n] == '[') {
+                    p++;
+                    n++;
+                    continue;
+                }
+            } else if (c == name[n]) {
+                p++;
+                n++;
+                continue;
+            }
+        }
+        // Mismatch: let the last * swallow one more character
+        if (star == string::npos) return false;
+        p = star + 1;
+        n = ++star_name;
+    }
+    while (p < pattern.size() && pattern[p] == '*') p++;
+    return p == pattern.size();
+}
+
+bool has_glob_characters(const string& component) {
+    for (size_t i = 0; i < component.size(); i++) {
+        if (component[i] == '\\') {
+            i++;
+        } else if (component[i] == '*' || component[i] == '?' || component[i] == '[') {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Remove the backslashes that quote characters in a pattern
+string glob_unescape(const string& pattern) {
+    string text;
+    for (size_t i = 0; i < pattern.size(); i++) {
+        if (pattern[i] == '\\' && i + 1 < pattern.size()) i++;
+        text += pattern[i];
+    }
+    return text;
+}
+
+// Expand a pattern to the sorted list of matching paths; a backslash
+// quotes the next character
+// Returns the pattern itself if nothing matches
+vector<string> expand_wildcards(const string& pattern) {
+    TraceSpan span("expand_wildcards", pattern);
+    // ~ at the start is the home directory
+    string expanded = pattern;
+    if (!expanded.empty() && expanded[0] == '~' && (expanded.size() == 1 || expanded[1] == '/')) {
+        if (const string* home = find_variable("HOME")) expanded = *home + expanded.substr(1);
+    }
+    
+    // A trailing / only matches directories
+    bool directories_only = !expanded.empty() && expanded.back() == '/';
+    vector<string> components;
+    stringstream ss(expanded);
+    string component;
+    while (getline(ss, component, '/')) {
+        if (!component.empty()) components.push_back(component);
+    }
+    
+    vector<string> current = {(!expanded.empty() && expanded[0] == '/') ? "/" : ""};
+    for (size_t i = 0; i < components.size() && !current.empty(); i++) {
+        const string& part = components[i];
+        bool last = (i + 1 == components.size());
+        vector<string> next;
+        
+        if (part == "**") {
+            // Zero or more directories (everything, when it is the last part)
+            for (const auto& directory : current) {
+                if (!last || (directories_only && !directory.empty())) next.push_back(directory);
+                for (const auto& entry : glob_tree(directory)) {
+                    bool is_dir = entry.type == DT_DIR;
+                    if ((last && (!directories_only || is_dir)) || (!last && is_dir)) {
+                        next.push_back(glob_join(directory, entry.name));
+                    }
+                }
+            }
+        } else if (!has_glob_characters(part)) {
+            // Literal part: only the final path has to exist
+            string literal = glob_unescape(part);
+            for (const auto& directory : current) {
+                string path = glob_join(directory, literal);
+                struct stat st;
+                if (!last || lstat(path.c_str(), &st) == 0) next.push_back(path);
+            }
+        } else {
+            for (const auto& directory : current) {
+                for (const auto& entry : glob_listing(directory)) {
+                    // Hidden files only match a pattern that starts with '.'
+                    if (entry.name[0] == '.' && part[0] != '.') continue;
+                    if (!glob_match(part, entry.name)) continue;
+                    
+                    string path = glob_join(directory, entry.name);
+                    bool is_dir = entry.type == DT_DIR;
+                    if (entry.type == DT_LNK && (!last || directories_only)) {
+                        struct stat st;
+                        is_dir = stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+                    }
+                    if ((!last || directories_only) && !is_dir) continue;
+                    next.push_back(path);
+                }
+            }
+        }
+        current.swap(next);
+    }
+    
+    if (components.empty() || current.empty()) return {pattern};
+    
+    sort(current.begin(), current.end());
+    current.erase(unique(current.begin(), current.end()), current.end());
+    if (directories_only) {
+        for (auto& path : current) path += '/';
+    }
+    return current;
+}
+
+// Search for an executable in PATH directories (no caching)
+// Returns true if found, and stores the full path in 'full_path'
+bool search_path_for_executable(const string& command, string& full_path) {
+    // Get the PATH variable
+    const string* path_ptr = find_variable("PATH");
+    if (path_ptr == nullptr) return false;
+    
+    const string& path_env = *path_ptr;
+    stringstream ss(path_env);
+    string directory;
+    
+    // Split PATH by ':' and check each directory
+    while (getline(ss, directory, ':')) {
+        if (directory.empty()) continue;
+        
+        // Build the full path: directory + "/" + command
+        string candidate = directory + "/" + command;
+        
+        // Check if file exists and is executable
+        // X_OK means check for execute permission
+        if (access(candidate.c_str(), X_OK) == 0) {
+            full_path = candidate;
+            return true;
+        }
+    }
+    
+    return false;  // Not found in any directory
+}
+
+// ---------------------------------------------------------------------------
+// Job resource sampling for `jobs -l` and `jobs --watch`
+// One pass over /proc reads every process's stat line and groups processes
+// by job (process group with job control, otherwise descendants of the
+// job's pid);
+// status and io are only read for the processes that belong to a job. CPU%
+// is measured between two samples of the same job, or over its whole life
+// on the first one.
+// ---------------------------------------------------------------------------
+
+// Resources used by all processes of one job
+struct JobUsage {
+    size_t processes = 0;
+    unsigned long long cpu_ticks = 0;     // utime + stime
+    unsigned long long rss_bytes = 0;     // VmRSS
+    unsigned long long read_bytes = 0;    // rchar: bytes read through any descriptor
+    unsigned long long write_bytes = 0;   // wchar
+    unsigned long long start_ticks = 0;   // Earliest process start, in ticks since boot
+    double cpu_percent = 0;
+    double elapsed = 0;                   // Seconds since start_ticks
+};
+
+// Read a small /proc file into content (st_size is 0 there, so no fstat)
+bool read_proc_file(const string& path, string& content) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    content.clear();
+    char buffer[4096];
+    while (true) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        content.append(buffer, n);
+    }
+    close(fd);
+    return true;
+}
+
+// Value of a "Key: value" line in /proc/<pid>/status or io
+unsigned long long proc_field(const string& content, const char* key) {
+    size_t pos = content.find(key);
+    if (pos == string::npos) return 0;
+    return strtoull(content.c_str() + pos + strlen(key), nullptr, 10);
+}
+
+// Sample every job in one pass over /proc and update their CPU baselines
+// Call with jobs_mutex held
+vector<JobUsage> sample_job_usage() {
+    vector<JobUsage> usage(jobs.size());
+    unordered_map<pid_t, size_t> owner;  // pgid (or pid) -> job
+    for (size_t i = 0; i < jobs.size(); i++) {
+        owner[jobs[i].pid] = i;
+    }
+    
+    static const long ticks_per_second = sysconf(_SC_CLK_TCK);
+    string uptime_text, stat_text, text;
+    double uptime = read_proc_file("/proc/uptime", uptime_text) ? strtod(uptime_text.c_str(), nullptr) : 0;
+    
+    // Pass 1: stat of every process
+    struct ProcessStat {
+        pid_t pid, ppid, pgrp;
+        unsigned long long cpu_ticks, start_ticks;
+    };
+    vector<ProcessStat> processes;
+    unordered_map<pid_t, pid_t> parent;
+    vector<GlobEntry> entries;
+    read_directory("/proc", entries);
+    for (const auto& entry : entries) {
+        if (entry.name[0] < '0' || entry.name[0] > '9') continue;
+        if (!read_proc_file("/proc/" + entry.name + "/stat", stat_text)) continue;  // Already gone
+        
+        // Fields after the parenthesized command name start at field 3 (state)
+        size_t close_paren = stat_text.rfind(')');
+        if (close_paren == string::npos) continue;
+        vector<unsigned long long> fields;
+        const char* p = stat_text.c_str() + close_paren + 2;
+        for (int field = 3; field <= 22 && p != nullptr; field++) {
+            fields.push_back(field == 3 ? 0 : strtoull(p, nullptr, 10));
+            p = strchr(p, ' ');
+            if (p != nullptr) p++;
+        }
+        if (fields.size() < 20) continue;
+        
+        ProcessStat process;
+        process.pid = (pid_t)atol(entry.name.c_str());
+        process.ppid = (pid_t)fields[4 - 3];
+        process.pgrp = (pid_t)fields[5 - 3];
+        process.cpu_ticks = fields[14 - 3] + fields[15 - 3];
+        process.start_ticks = fields[22 - 3];
+        processes.push_back(process);
+        parent[process.pid] = process.ppid;
+    }
+    
+    // Pass 2: assign processes to jobs and read status/io for those only.
+    // Without job control every job shares the shell's group, so a process
+    // belongs to the job whose pid is among its ancestors
+    for (const auto& process : processes) {
+        auto it = owner.find(job_control ? process.pgrp : process.pid);
+        if (!job_control) {
+            for (pid_t ancestor = process.pid; it == owner.end() && ancestor > 1;) {
+                auto up = parent.find(ancestor);
+                if (up == parent.end()) break;
+                ancestor = up->second;
+                it = owner.find(ancestor);
+            }
+        }
+        if (it == owner.end()) continue;
+        
+        JobUsage& job_usage = usage[it->second];
+        job_usage.processes++;
+        job_usage.cpu_ticks += process.cpu_ticks;
+        if (job_usage.start_ticks == 0 || process.start_ticks < job_usage.start_ticks) {
+            job_usage.start_ticks = process.start_ticks;
+        }
+        string dir = "/proc/" + to_string(process.pid);
+        if (read_proc_file(dir + "/status", text)) {
+            job_usage.rss_bytes += proc_field(text, "VmRSS:") * 1024;
+        }
+        if (read_proc_file(dir + "/io", text)) {
+            job_usage.read_bytes += proc_field(text, "rchar:");
+            job_usage.write_bytes += proc_field(text, "wchar:");
+        }
+    }
+    
+    auto now = chrono::steady_clock::now();
+    for (size_t i = 0; i < jobs.size(); i++) {
+        JobUsage& job_usage = usage[i];
+        Job& job = jobs[i];
+        if (job_usage.processes == 0) continue;
+        job_usage.elapsed = max(0.0, uptime - (double)job_usage.start_ticks / ticks_per_second);
+        
+        double cpu_seconds, wall_seconds;
+        if (job.sampled) {
+            // Ticks of processes that exited since the last sample are gone
+            cpu_seconds = job_usage.cpu_ticks > job.sampled_ticks
+                ? (double)(job_usage.cpu_ticks - job.sampled_ticks) / ticks_per_second : 0;
+            wall_seconds = chrono::duration<double>(now - job.sampled_at).count();
+        } else {
+            cpu_seconds = (double)job_usage.cpu_ticks / ticks_per_second;
+            wall_seconds = job_usage.elapsed;
+        }
+        job_usage.cpu_percent = wall_seconds > 0 ? 100.0 * cpu_seconds / wall_seconds : 0;
+        
+        job.sampled = true;
+        job.sampled_ticks = job_usage.cpu_ticks;
+        job.sampled_at = now;
+    }
+    return usage;
+}
+
+// 1536 -> "1.5K"
+string format_bytes(unsigned long long bytes) {
+    const char* units = "BKMGTP";
+    double value = bytes;
+    int unit = 0;
+    while (value >= 1024 && unit < 5) {
+        value /= 1024;
+        unit++;
+    }
+    ostringstream out;
+    if (unit == 0) {
+        out << bytes << "B";
+    } else {
+        out << fixed << setprecision(value < 10 ? 1 : 0) << value << units[unit];
+    }
+    return out.str();
+}
+
+// 75 -> "1:15", 3725 -> "1:02:05"
+string format_elapsed(double seconds) {
+    long total = (long)seconds;
+    char buffer[32];
+    if (total >= 3600) {
+        snprintf(buffer, sizeof(buffer), "%ld:%02ld:%02ld", total / 3600, total / 60 % 60, total % 60);
+    } else {
+        snprintf(buffer, sizeof(buffer), "%ld:%02ld", total / 60, total % 60);
+    }
+    return buffer;
+}
+
+// Lines of the `jobs -l` table (header first), cut to width columns if width > 0
+vector<string> job_table_lines(size_t width) {
+    lock_guard<mutex> lock(jobs_mutex);
+    vector<JobUsage> usage = sample_job_usage();
+    
+    vector<string> lines;
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "%-6s %-8s %-8s %6s %7s %7s %7s %8s  %s",
+             "JOB", "PID", "STATE", "CPU%", "RSS", "READ", "WRITE", "ELAPSED", "COMMAND");
+    lines.push_back(buffer);
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const Job& job = jobs[i];
+        if (job.status == DONE) continue;
+        const JobUsage& u = usage[i];
+        string id = "[" + to_string(job.job_id) + "]";
+        snprintf(buffer, sizeof(buffer), "%-6s %-8d %-8s %6.1f %7s %7s %7s %8s  ",
+                 id.c_str(), (int)job.pid, job.status == RUNNING ? "Running" : "Stopped",
+                 u.cpu_percent, format_bytes(u.rss_bytes).c_str(), format_bytes(u.read_bytes).c_str(),
+                 format_bytes(u.write_bytes).c_str(), format_elapsed(u.elapsed).c_str());
+        lines.push_back(string(buffer) + job.command);
+    }
+    if (width > 0) {
+        for (auto& line : lines) {
+            if (line.size() >= width) line.resize(width - 1);
+        }
+    }
+    return lines;
+}
+
+// Redraw the watch table in place, rewriting only the lines that changed
+void draw_job_table(const vector<string>& lines, vector<string>& previous) {
+    string frame;
+    if (!previous.empty()) frame += "\033[" + to_string(previous.size()) + "A";
+    for (size_t i = 0; i < lines.size(); i++) {
+        if (i < previous.size() && previous[i] == lines[i]) {
+            frame += "\n";
+            continue;
+        }
+        frame += "\r";
+        frame += (i == 0) ? COLOR_BOLD + lines[i] + COLOR_RESET : lines[i];
+        frame += "\033[K\n";
+    }
+    frame += "\033[J";  // Drop lines of jobs that went away
+    write_all(STDOUT_FILENO, frame.data(), frame.size());
+    previous = lines;
+}
+
+// `jobs --watch [seconds]`: refresh the table every interval and whenever
+// a job changes state, until q or Ctrl+C (or, without a terminal, until
+// no jobs are left)
+int watch_jobs(double interval) {
+    bool tty = isatty(STDIN_FILENO);
+    struct termios saved;
+    if (tty) {
+        // Read single keys without echo; Ctrl+C arrives as a byte
+        tcgetattr(STDIN_FILENO, &saved);
+        struct termios raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    }
+    
+    vector<string> previous;
+    while (true) {
+        reap_children();
+        struct winsize ws;
+        size_t width = (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0) ? ws.ws_col : 0;
+        vector<string> lines = job_table_lines(width);
+        draw_job_table(lines, previous);
+        if (!tty && lines.size() == 1) break;
+        
+        struct pollfd fds[2] = {{child_signal_fd, POLLIN, 0}, {tty ? STDIN_FILENO : -1, POLLIN, 0}};
+        if (poll(fds, 2, (int)(interval * 1000)) > 0 && (fds[1].revents & POLLIN)) {
+            char key = 0;
+            if (read(STDIN_FILENO, &key, 1) <= 0 || key == 'q' || key == 3 || key == 4) break;
+        }
+    }
+    
+    if (tty) tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    return 0;
+}
+
+// Handle the 'jobs' builtin: plain list, -l with resource usage, or --watch
+// can_watch is false for pipeline stages, which have no terminal to redraw
+int run_jobs_builtin(const vector<string>& args, ostream& out, bool can_watch) {
+    if (args.size() >= 2 && args[1] == "-l") {
+        for (const auto& line : job_table_lines(0)) {
+            out << line << endl;
+        }
+        return 0;
+    }
+    if (args.size() >= 2 && args[1] == "--watch") {
+        double interval = 2.0;
+        if (args.size() >= 3) {
+            char* end = nullptr;
+            interval = strtod(args[2].c_str(), &end);
+            if (*end != '\0' || interval < 0.1) {
+                cerr << "jobs: " << args[2] << ": invalid interval (at least 0.1 seconds)" << endl;
+                return 1;
+            }
+        }
+        if (!can_watch) {
+            cerr << "jobs: --watch cannot run in a pipeline" << endl;
+            return 1;
+        }
+        return watch_jobs(interval);
+    }
+    if (args.size() >= 2) {
+        cerr << "Usage: jobs [-l | --watch [seconds]]" << endl;
+        return 1;
+    }
+    print_jobs(out);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Command path hash table (like bash's `hash`)
+// Remembers where each command was found so repeated commands skip the PATH
+// walk. The table is dropped when $PATH changes (e.g. `export PATH=...`), and
+// unpinned entries are dropped when a PATH directory's mtime changes. Mtimes
+// are re-checked at most once per HASH_RECHECK_INTERVAL.
+// ---------------------------------------------------------------------------
+
+struct HashedCommand {
+    string path;
+    int hits = 0;
+    bool pinned = false;  // Set with `hash -p`, survives directory changes
+};
+
+unordered_map<string, HashedCommand> command_hash;
+string hashed_path_env;                              // $PATH the table was built for
+vector<pair<string, struct timespec>> hashed_path_dirs;  // PATH directories and their mtimes
+chrono::steady_clock::time_point hash_last_check;
+const chrono::milliseconds HASH_RECHECK_INTERVAL(1000);
+
+// Forget every hashed command (hash -r)
+void clear_command_hash() {
+    command_hash.clear();
+    hashed_path_dirs.clear();
+    hashed_path_env.clear();
+}
+
+// Record the current PATH directories and their modification times
+void snapshot_path_dirs(const string& path_env) {
+    hashed_path_env = path_env;
+    hashed_path_dirs.clear();
+    
+    stringstream ss(path_env);
+    string directory;
+    while (getline(ss, directory, ':')) {
+        if (directory.empty()) continue;
+        struct timespec mtime = {0, 0};
+        struct stat st;
+        if (stat(directory.c_str(), &st) == 0) {
+            mtime = st.st_mtim;
+        }
+        hashed_path_dirs.push_back({directory, mtime});
+    }
+    hash_last_check = chrono::steady_clock::now();
+}
+
+// Drop stale entries if PATH or one of its directories changed
+void validate_command_hash() {
+    string path_env = variable_value("PATH");
+    
+    // PATH itself changed: nothing in the table can be trusted
+    if (path_env != hashed_path_env) {
+        command_hash.clear();
+        snapshot_path_dirs(path_env);
+        return;
+    }
+    
+    auto now = chrono::steady_clock::now();
+    if (now - hash_last_check < HASH_RECHECK_INTERVAL) return;
+    hash_last_check = now;
+    
+    // A directory was modified: a command may have been added or removed
+    bool changed = false;
+    for (auto& [directory, mtime] : hashed_path_dirs) {
+        struct timespec current = {0, 0};
+        struct stat st;
+        if (stat(directory.c_str(), &st) == 0) {
+            current = st.st_mtim;
+        }
+        if (current.tv_sec != mtime.tv_sec || current.tv_nsec != mtime.tv_nsec) {
+            mtime = current;
+            changed = true;
+        }
+    }
+    
+    if (changed) {
+        for (auto it = command_hash.begin(); it != command_hash.end(); ) {
+            if (it->second.pinned) {
+                ++it;
+            } else {
+                it = command_hash.erase(it);
+            }
+        }
+    }
+}
+
+// Forget a single command (e.g. its hashed path no longer exists)
+void forget_hashed_command(const string& command) {
+    command_hash.erase(command);
+}
+
+// Search for an executable, consulting the hash table first
+// Returns true if found, and stores the full path in 'full_path'
+bool find_executable_in_path(const string& command, string& full_path) {
+    TraceSpan span("path_lookup", command);
+    // Commands with a slash are paths already and are never hashed
+    if (command.find('/') != string::npos) {
+        if (access(command.c_str(), X_OK) == 0) {
+            full_path = command;
+            return true;
+        }
+        return false;
+    }
+    
+    validate_command_hash();
+    
+    auto it = command_hash.find(command);
+    if (it != command_hash.end()) {
+        it->second.hits++;
+        full_path = it->second.path;
+        return true;
+    }
+    
+    if (!search_path_for_executable(command, full_path)) {
+        return false;
+    }
+    
+    HashedCommand entry;
+    entry.path = full_path;
+    entry.hits = 1;
+    command_hash[command] = entry;
+    return true;
+}
+
+// Handle the 'hash' builtin
+// hash            list hashed commands
+// hash -r         forget all hashed commands
+// hash -p PATH N  use PATH for command N
+// hash N...       look up and remember each command
+// Returns the exit status
+int run_hash_builtin(const vector<string>& args, ostream& out = cout) {
+    if (args.size() == 1) {
+        validate_command_hash();
+        if (command_hash.empty()) {
+            out << "hash: hash table empty" << endl;
+            return 0;
+        }
+        
+        // Sort by name so the listing is stable
+        vector<pair<string, HashedCommand>> entries(command_hash.begin(), command_hash.end());
+        sort(entries.begin(), entries.end(),
+            [](const auto& a, const auto& b) { return a.first < b.first; });
+        
+        out << "hits\tcommand" << endl;
+        for (const auto& [name, entry] : entries) {
+            out << setw(4) << entry.hits << "\t" << entry.path << endl;
+        }
+        return 0;
+    }
+    
+    if (args[1] == "-r") {
+        clear_command_hash();
+        return 0;
+    }
+    
+    if (args[1] == "-p") {
+        if (args.size() < 4) {
+            cerr << "hash: usage: hash -p pathname name" << endl;
+            return 1;
+        }
+        validate_command_hash();
+        HashedCommand entry;
+        entry.path = args[2];
+        entry.pinned = true;
+        command_hash[args[3]] = entry;
+        return 0;
+    }
+    
+    int status = 0;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (is_builtin(args[i])) continue;
+        
+        string full_path;
+        if (find_executable_in_path(args[i], full_path)) {
+            // Looking a command up is not a use of it
+            command_hash[args[i]].hits = 0;
+        } else {
+            cerr << "hash: " << args[i] << ": not found" << endl;
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// Handle the 'type' command
+void check_command_validity(const string& command, ostream& out = cout) {
+    // First, check if it's a builtin (`time` prefixes a command rather than running one)
+    const Builtin* builtin = find_builtin(command);
+    if (builtin != nullptr) {
+        out << command << ((builtin->flags & BUILTIN_KEYWORD) ? " is a shell keyword" : " is a shell builtin") << endl;
+        return;
+    }
+    
+    // If not builtin, search in PATH
+    string full_path;
+    if (find_executable_in_path(command, full_path)) {
+        out << command << " is " << full_path << endl;
+    } else {
+        out << command << ": not found" << endl;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Lexer
+// One pass over the line turns it into words and operators (&&, ||, ;, &,
+// |, redirections), honouring quotes and backslashes, so `echo 'a && b'` or
+// `echo "|"` stay single words. Runs of ordinary bytes are skipped with
+// strcspn(), which glibc implements with SIMD compares for small byte sets.
+// Words are string_views into the line; only words with quotes or escapes
+// are unescaped into the stream's own buffer, with a parallel buffer
+// recording how each byte was quoted, so expansion can leave quoted $, *,
+// ? and [ alone in a partly quoted word.
+// ---------------------------------------------------------------------------
+
+enum TokenKind {
+    TOKEN_WORD,
+    TOKEN_PIPE,        // |
+    TOKEN_AND,         // &&
+    TOKEN_OR,          // ||
+    TOKEN_SEMICOLON,   // ;
+    TOKEN_BACKGROUND,  // &
+    TOKEN_REDIRECT     // <, <<, <<-, <<<, >, >>, 1>, 1>>, 2>, 2>>
+};
+
+struct Token {
+    TokenKind kind = TOKEN_WORD;
+    string_view text;     // Word with quotes removed, or the operator itself
+    string_view quoting;  // QuoteKind of each byte of text, when it was unescaped
+    bool quoted = false;  // Some part of the word was quoted or escaped
+    bool expand = false;  // Has a $ outside single quotes
+    bool glob = false;    // Has an unquoted *, ? or [
+};
+
+struct TokenStream {
+    string unescaped;      // Backing store for words that needed unescaping
+    string quoting;        // QuoteKind of each byte of unescaped
+    vector<Token> tokens;
+};
+
+// Bytes that end a run of ordinary word characters
+const char* const LEXER_WORD_SPECIALS = " \t\n'\"\\|&;<>$*?[";
+
+// Split a command line into tokens
+void lex_command_line(const string& line, TokenStream& stream) {
+    TraceSpan span("lex");
+    stream.tokens.clear();
+    stream.unescaped.clear();
+    stream.quoting.clear();
+    // Unescaped text is never longer than the line, so views stay valid
+    stream.unescaped.reserve(line.size());
+    stream.quoting.reserve(line.size());
+    
+    const char* p = line.c_str();
+    const char* end = p + line.size();
+    
+    auto add_operator = [&](TokenKind kind, size_t length) {
+        stream.tokens.push_back({kind, string_view(p, length)});
+        p += length;
+    };
+    
+    while (p < end) {
+        char c = *p;
+        if (c == ' ' || c == '\t' || c == '\n') {
+            p++;
+            continue;
+        }
+        
+        // Operators
+        if (c == '|') {
+            add_operator(p[1] == '|' ? TOKEN_OR : TOKEN_PIPE, p[1] == '|' ? 2 : 1);
+            continue;
+        }
+        if (c == '&') {
+            add_operator(p[1] == '&' ? TOKEN_AND : TOKEN_BACKGROUND, p[1] == '&' ? 2 : 1);
+            continue;
+        }
+        if (c == ';') {
+            add_operator(TOKEN_SEMICOLON, 1);
+            continue;
+        }
+        if (c == '<') {
+            // <, << (here-doc), <<- (here-doc, leading tabs stripped), <<< (here-string)
+            size_t length = 1;
+            if (p[1] == '<') length = (p[2] == '<' || p[2] == '-') ? 3 : 2;
+            add_operator(TOKEN_REDIRECT, length);
+            continue;
+        }
+        if (c == '>' || ((c == '1' || c == '2') && p[1] == '>')) {
+            size_t length = (c == '>') ? 1 : 2;
+            if (p[length] == '>') length++;
+            add_operator(TOKEN_REDIRECT, length);
+            continue;
+        }
+        
+        // A # starting a word comments out the rest of the line
+        if (c == '#') break;
+        
+        // Word: stays a view into the line until a quote or backslash
+        // forces a copy into the unescaped buffer
+        Token token;
+        const char* word_start = p;
+        size_t copy_start = string::npos;
+        auto emit = [&](const char* text, size_t length, QuoteKind quote) {
+            stream.unescaped.append(text, length);
+            stream.quoting.append(length, quote);
+        };
+        auto start_copy = [&]() {
+            if (copy_start == string::npos) {
+                copy_start = stream.unescaped.size();
+                emit(word_start, p - word_start, QUOTE_NONE);
+            }
+        };
+        
+        while (p < end) {
+            size_t run = strcspn(p, LEXER_WORD_SPECIALS);
+            if (copy_start != string::npos) emit(p, run, QUOTE_NONE);
+            p += run;
+            if (p >= end) break;
+            
+            c = *p;
+            if (c == ' ' || c == '\t' || c == '\n' || c == '|' || c == '&' || c == ';' || c == '<' || c == '>') {
+                break;
+            }
+            
+            if (c == '$' || c == '*' || c == '?' || c == '[') {
+                size_t length = 1;
+                if (c == '$') {
+                    token.expand = true;
+                    // $? and $* are variables, not wildcards
+                    if (p + 1 < end && (p[1] == '?' || p[1] == '*')) length = 2;
+                } else {
+                    token.glob = true;
+                }
+                if (copy_start != string::npos) emit(p, length, QUOTE_NONE);
+                p += length;
+            } else if (c == '\\') {
+                // Backslash outside quotes: the next character is literal
+                start_copy();
+                token.quoted = true;
+                if (p + 1 < end) emit(p + 1, 1, QUOTE_LITERAL);
+                p = min(p + 2, end);
+            } else if (c == '\'') {
+                // Single quotes: everything literal up to the closing quote
+                start_copy();
+                token.quoted = true;
+                const char* close = (const char*)memchr(p + 1, '\'', end - p - 1);
+                const char* stop = close ? close : end;
+                emit(p + 1, stop - p - 1, QUOTE_LITERAL);
+                p = close ? close + 1 : end;
+            } else {
+                // Double quotes: \", \\, \$ and \` are escapes, $ still expands
+                start_copy();
+                token.quoted = true;
+                p++;
+                while (p < end && *p != '"') {
+                    size_t literal = strcspn(p, "\"\\$");
+                    emit(p, literal, QUOTE_DOUBLE);
+                    p += literal;
+                    if (p >= end || *p == '"') break;
+                    if (*p == '\\' && p + 1 < end && (p[1] == '"' || p[1] == '\\' || p[1] == '$' || p[1] == '`')) {
+                        emit(p + 1, 1, QUOTE_LITERAL);
+                        p += 2;
+                    } else {
+                        if (*p == '$') token.expand = true;
+                        emit(p, 1, QUOTE_DOUBLE);
+                        p++;
+                    }
+                }
+                if (p < end) p++;  // Closing quote
+            }
+        }
+        
+        if (copy_start == string::npos) {
+            token.text = string_view(word_start, p - word_start);
+        } else {
+            token.text = string_view(stream.unescaped.data() + copy_start, stream.unescaped.size() - copy_start);
+            token.quoting = string_view(stream.quoting.data() + copy_start, stream.quoting.size() - copy_start);
+        }
+        stream.tokens.push_back(token);
+    }
+}
+
+// Check for the operators that separate commands in a chain
+bool is_chain_separator(TokenKind kind) {
+    return kind == TOKEN_AND || kind == TOKEN_OR || kind == TOKEN_SEMICOLON || kind == TOKEN_BACKGROUND;
+}
+
+// ---------------------------------------------------------------------------
+// Command plans
+// A line is compiled once into an immutable plan: the chain of commands
+// with their operators, each command's pipeline stages, and each stage's
+// words and redirections. Words remember whether they need variable or
+// wildcard expansion, which is the only work left at run time. Plans are
+// kept in a small LRU cache keyed by the line, so repeated lines (loops,
+// generated scripts, history recalls) skip lexing and parsing entirely.
+// ---------------------------------------------------------------------------
+
+struct PlanWord {
+    string text;          // Quotes and escapes already removed
+    bool quoted = false;  // Some part was quoted or escaped
+    bool expand = false;  // Has a $ outside single quotes
+    bool glob = false;    // Has an unquoted *, ? or [
+    string quoting;       // QuoteKind of each byte of text, for a partly quoted word that expands
+};
+
+struct PlanRedirect {
+    string op;            // <, <<, <<-, <<<, >, >>, 1>, 1>>, 2>, 2>>
+    PlanWord target;      // For << and <<-, the delimiter
+    int here_doc = -1;    // For << and <<-, index into CommandPlan::here_docs
+};
+
+// A here-document's body follows the command line; the plan only knows
+// how to read it
+struct HereDocSpec {
+    string delimiter;
+    bool expand = true;       // Unquoted delimiter: $ expands in the body
+    bool strip_tabs = false;  // <<-: leading tabs are removed from each line
+};
+
+struct PlanStage {
+    vector<PlanWord> words;
+    vector<PlanRedirect> redirects;
+    vector<size_t> expansion_spots;  // Indices of words expanded at run time
+};
+
+struct PlanCommand {
+    TokenKind operator_before = TOKEN_SEMICOLON;  // ;, && or || before it
+    bool background = false;                      // Ended by &
+    bool timed = false;                           // `time`/`timer` prefix
+    bool pipeline = false;                        // Had a | (even if a stage is empty)
+    vector<PlanStage> stages;                     // Empty stages are dropped
+};
+
+struct CommandPlan {
+    vector<PlanCommand> commands;
+    vector<HereDocSpec> here_docs;  // In the order their bodies follow the line
+};
+
+const size_t PLAN_CACHE_LIMIT = 256;
+
+// Most recently used first; the map points into the list
+list<pair<string, shared_ptr<const CommandPlan>>> plan_cache_order;
+unordered_map<string, list<pair<string, shared_ptr<const CommandPlan>>>::iterator> plan_cache;
+
+bool word_needs_expansion(const PlanWord& word) {
+    return word.expand || word.glob;
+}
+
+PlanWord plan_word_from_token(const Token& token) {
+    PlanWord word;
+    word.text = string(token.text);
+    word.quoted = token.quoted;
+    word.expand = token.expand;
+    word.glob = token.glob;
+    if (word.quoted && (word.expand || word.glob)) word.quoting = string(token.quoting);
+    return word;
+}
+
+// Compile a line into a plan
+shared_ptr<const CommandPlan> compile_command_line(const string& line) {
+    TraceSpan span("compile_plan");
+    TokenStream stream;
+    lex_command_line(line, stream);
+    const vector<Token>& tokens = stream.tokens;
+    
+    auto plan = make_shared<CommandPlan>();
+    TokenKind operator_before = TOKEN_SEMICOLON;
+    size_t i = 0;
+    while (i < tokens.size()) {
+        PlanCommand command;
+        command.operator_before = operator_before;
+        
+        PlanStage stage;
+        auto finish_stage = [&]() {
+            if (!stage.words.empty() || !stage.redirects.empty()) command.stages.push_back(move(stage));
+            stage = PlanStage();
+        };
+        
+        for (; i < tokens.size() && !is_chain_separator(tokens[i].kind); i++) {
+            const Token& token = tokens[i];
+            if (token.kind == TOKEN_PIPE) {
+                command.pipeline = true;
+                finish_stage();
+            } else if (token.kind == TOKEN_REDIRECT) {
+                // A redirection without a target is ignored
+                if (i + 1 < tokens.size() && tokens[i + 1].kind == TOKEN_WORD) {
+                    PlanRedirect redirect = {string(token.text), plan_word_from_token(tokens[i + 1])};
+                    if (redirect.op == "<<" || redirect.op == "<<-") {
+                        redirect.here_doc = (int)plan->here_docs.size();
+                        plan->here_docs.push_back({redirect.target.text, !redirect.target.quoted, redirect.op == "<<-"});
+                    }
+                    stage.redirects.push_back(redirect);
+                    i++;
+                }
+            } else {
+                // A literal `time`/`timer` first word times the whole command
+                bool first_word = command.stages.empty() && stage.words.empty() && !command.timed;
+                if (first_word && !token.quoted && !token.expand && (token.text == "time" || token.text == "timer")) {
+                    command.timed = true;
+                    continue;
+                }
+                PlanWord word = plan_word_from_token(token);
+                if (word_needs_expansion(word)) {
+                    stage.expansion_spots.push_back(stage.words.size());
+                }
+                stage.words.push_back(move(word));
+            }
+        }
+        finish_stage();
+        
+        if (i < tokens.size()) {
+            command.background = tokens[i].kind == TOKEN_BACKGROUND;
+            operator_before = tokens[i].kind;
+            i++;
+        }
+        plan->commands.push_back(move(command));
+    }
+    return plan;
+}
+
+// Get the plan for a line, compiling it on a cache miss
+shared_ptr<const CommandPlan> get_command_plan(const string& line) {
+    auto it = plan_cache.find(line);
+    if (it != plan_cache.end()) {
+        plan_cache_order.splice(plan_cache_order.begin(), plan_cache_order, it->second);
+        return it->second->second;
+    }
+    
+    shared_ptr<const CommandPlan> plan = compile_command_line(line);
+    plan_cache_order.emplace_front(line, plan);
+    plan_cache[line] = plan_cache_order.begin();
+    if (plan_cache_order.size() > PLAN_CACHE_LIMIT) {
+        plan_cache.erase(plan_cache_order.back().first);
+        plan_cache_order.pop_back();
+    }
+    return plan;
+}
+
+// Expand a word: variables, then wildcards if it has unquoted ones
+// (or came from an unquoted variable that expanded to a pattern)
+void expand_word(const PlanWord& word, vector<string>& words) {
+    if (!word_needs_expansion(word)) {
+        words.push_back(word.text);
+        return;
+    }
+    
+    if (!word.quoting.empty()) {
+        // Partly quoted: quoted bytes stay literal for both expansions, so
+        // the glob pattern gets them backslash-escaped
+        string quoting = word.quoting;
+        string text = word.text;
+        if (word.expand) {
+            quoting.clear();
+            text = expand_variables(word.text, word.quoting, &quoting);
+        }
+        string pattern;
+        bool has_wildcard = false;
+        for (size_t i = 0; i < text.size(); i++) {
+            char c = text[i];
+            if (quoting[i] == QUOTE_NONE) {
+                if (c == '*' || c == '?' || c == '[') has_wildcard = true;
+            } else if (c == '*' || c == '?' || c == '[' || c == '\\' || (c == '~' && i == 0)) {
+                pattern += '\\';
+            }
+            pattern += c;
+        }
+        if (!has_wildcard) {
+            words.push_back(text);
+            return;
+        }
+        vector<string> matches = expand_wildcards(pattern);
+        if (matches.size() == 1 && matches[0] == pattern) {
+            words.push_back(text);  // No match: the word as written, unescaped
+        } else {
+            words.insert(words.end(), matches.begin(), matches.end());
+        }
+        return;
+    }
+    
+    string text = word.expand ? expand_variables(word.text) : word.text;
+    
+    bool may_glob = word.glob || (word.expand && !word.quoted);
+    if (may_glob && text.find_first_of("*?[") != string::npos) {
+        vector<string> matches = expand_wildcards(text);
+        words.insert(words.end(), matches.begin(), matches.end());
+    } else {
+        words.push_back(text);
+    }
+}
+
+// Expand a stage's words into its argument list: literal words are copied
+// from the plan, only the expansion spots go through expand_word()
+vector<string> expand_stage_words(const PlanStage& stage) {
+    vector<string> args;
+    args.reserve(stage.words.size());
+    size_t next_spot = 0;
+    for (size_t i = 0; i < stage.words.size(); i++) {
+        if (next_spot < stage.expansion_spots.size() && stage.expansion_spots[next_spot] == i) {
+            expand_word(stage.words[i], args);
+            next_spot++;
+        } else {
+            args.push_back(stage.words[i].text);
+        }
+    }
+    return args;
+}
+
+// Expand a redirection target (a pattern uses its first match)
+string expand_redirect_target(const PlanWord& target) {
+    vector<string> expanded;
+    expand_word(target, expanded);
+    return expanded.empty() ? "" : expanded[0];
+}
+
+// Expand the body of a here-document with an unquoted delimiter: variables
+// expand, and a backslash only escapes $, `, \ and a newline (which joins
+// the lines); other backslashes are kept
+string expand_here_document(const string& body) {
+    string result;
+    size_t start = 0;
+    for (size_t i = 0; i + 1 < body.size(); i++) {
+        char next = body[i + 1];
+        if (body[i] != '\\' || (next != '$' && next != '`' && next != '\\' && next != '\n')) continue;
+        result += expand_variables(body.substr(start, i - start));
+        if (next != '\n') result += next;
+        start = i + 2;
+        i++;
+    }
+    result += expand_variables(body.substr(start));
+    return result;
+}
+
+// Expand a redirection for execution. A here-document becomes "<<" with its
+// body (from bodies, read after the line) as the target, a here-string
+// "<<<" with its word and a newline. Neither is subject to wildcard expansion
+Redirection expand_redirect(const PlanRedirect& redirect, const CommandPlan& plan, const vector<string>& bodies) {
+    if (redirect.here_doc >= 0) {
+        const HereDocSpec& spec = plan.here_docs[redirect.here_doc];
+        const string& body = bodies[redirect.here_doc];
+        return {"<<", spec.expand ? expand_here_document(body) : body};
+    }
+    if (redirect.op == "<<<") {
+        const PlanWord& word = redirect.target;
+        return {"<<<", (word.expand ? expand_variables(word.text, word.quoting, nullptr) : word.text) + "\n"};
+    }
+    return {redirect.op, expand_redirect_target(redirect.target)};
+}
+
+// ---------------------------------------------------------------------------
+// Zero-copy data movement
+// Used by the fcat builtin to move bytes between files, pipes and redirection
+// targets inside the kernel: copy_file_range() between regular files, splice()
+// when either side is a pipe, sendfile() from a regular file to anything else.
+// A read()/write() loop is the fallback when none of those apply.
+// ---------------------------------------------------------------------------
+
+// Largest chunk handed to the kernel per call
+const size_t ZERO_COPY_CHUNK = 1 << 30;
+
+// Copy everything from in_fd (from its current offset) to out_fd
+// Returns 0 on success, -1 with errno set on error
+int copy_fd_contents(int in_fd, int out_fd) {
+    struct stat in_st, out_st;
+    if (fstat(in_fd, &in_st) < 0 || fstat(out_fd, &out_st) < 0) return -1;
+    
+    bool in_regular = S_ISREG(in_st.st_mode);
+    bool out_regular = S_ISREG(out_st.st_mode);
+    bool either_pipe = S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode);
+    
+    // Each method advances the file offsets, so a method that gives up
+    // part-way hands over to the next one without losing data
+    if (in_regular && out_regular) {
+        while (true) {
+            ssize_t n = copy_file_range(in_fd, nullptr, out_fd, nullptr, ZERO_COPY_CHUNK, 0);
+            if (n == 0) return 0;
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;  // EXDEV, EINVAL, EBADF (O_APPEND), ...: try the next method
+            }
+        }
+    }
+    
+    if (either_pipe) {
+        while (true) {
+            ssize_t n = splice(in_fd, nullptr, out_fd, nullptr, ZERO_COPY_CHUNK, SPLICE_F_MOVE);
+            if (n == 0) return 0;
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EPIPE) return -1;
+                break;
+            }
+        }
+    }
+    
+    if (in_regular) {
+        while (true) {
+            ssize_t n = sendfile(out_fd, in_fd, nullptr, ZERO_COPY_CHUNK);
+            if (n == 0) return 0;
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EPIPE) return -1;
+                break;
+            }
+        }
+    }
+    
+    // Plain copy through user space
+    vector<char> buffer(1 << 16);
+    while (true) {
+        ssize_t n = read(in_fd, buffer.data(), buffer.size());
+        if (n == 0) return 0;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (write_all(out_fd, buffer.data(), n) < 0) return -1;
+    }
+}
+
+// Handle the 'fcat' builtin: concatenate files to out_fd
+// With no file arguments (or "-") it copies in_fd instead
+// Returns the exit status
+int run_fcat_builtin(const vector<string>& args, int in_fd, int out_fd) {
+    vector<string> files(args.begin() + 1, args.end());
+    if (files.empty()) files.push_back("-");
+    
+    struct stat out_st;
+    bool out_regular = fstat(out_fd, &out_st) == 0 && S_ISREG(out_st.st_mode);
+    
+    int status = 0;
+    for (const auto& file : files) {
+        int fd = in_fd;
+        if (file != "-") {
+            fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                cerr << "fcat: " << file << ": " << strerror(errno) << endl;
+                status = 1;
+                continue;
+            }
+        }
+        
+        // Copying a file onto itself would never finish
+        struct stat in_st;
+        if (out_regular && fstat(fd, &in_st) == 0 &&
+            in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino) {
+            cerr << "fcat: " << file << ": input file is output file" << endl;
+            status = 1;
+        } else if (copy_fd_contents(fd, out_fd) < 0) {
+            int copy_errno = errno;
+            if (copy_errno == EPIPE) {
+                // Reader went away: stop quietly, like cat killed by SIGPIPE
+                if (fd != in_fd) close(fd);
+                return 1;
+            }
+            cerr << "fcat: " << file << ": " << strerror(copy_errno) << endl;
+            status = 1;
+        }
+        
+        if (fd != in_fd) close(fd);
+    }
+    return status;
+}
+
+// ---------------------------------------------------------------------------
+// Spawn engine
+// External commands are launched with posix_spawn(), which on glibc uses
+// clone(CLONE_VM|CLONE_VFORK) and does not copy the shell's page tables.
+// The process group, terminal and signal setup that used to run in a forked
+// child is expressed as spawn attributes and file actions instead.
+// ---------------------------------------------------------------------------
+
+// Everything needed to launch one child process.
+// File descriptors are opened by the parent; the child only dup2()s them.
+struct LaunchSpec {
+    string path;             // Resolved executable path
+    vector<string> args;     // argv (args[0] is the command name)
+    int stdin_fd = -1;       // Installed as fd 0 in the child (-1 = inherit)
+    int stdout_fd = -1;      // Installed as fd 1 in the child (-1 = inherit)
+    int stderr_fd = -1;      // Installed as fd 2 in the child (-1 = inherit)
+    vector<int> close_fds;   // Extra descriptors the child must not keep
+    pid_t pgid = -1;         // -1 = stay in shell's group, 0 = new group, >0 = join group
+    bool foreground = false; // Give the terminal to the child and restore SIGINT/SIGTSTP
+};
+
+// Open a redirection target in the parent (close-on-exec, so only the
+// child that dup2()s it keeps a copy)
+int open_redirect_file(const string& filename, bool append) {
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+    return open(filename.c_str(), flags, 0644);
+}
+
+// A readable descriptor holding content, for here-documents and
+// here-strings: a pipe when content fits in the pipe buffer (written up
+// front, so nothing blocks), a memfd otherwise. Either way there is no
+// temporary file and no process feeding it. Returns -1 on failure
+int open_here_content(const string& content) {
+    auto write_content = [&](int fd) {
+        for (size_t done = 0; done < content.size(); ) {
+            ssize_t n = write(fd, content.data() + done, content.size() - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            done += n;
+        }
+        return true;
+    };
+    
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == 0) {
+        int capacity = fcntl(pipe_fds[1], F_GETPIPE_SZ);
+        if (capacity > 0 && content.size() <= (size_t)capacity) {
+            bool written = write_content(pipe_fds[1]);
+            close(pipe_fds[1]);
+            if (written) return pipe_fds[0];
+            close(pipe_fds[0]);
+            return -1;
+        }
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+    
+    int fd = memfd_create("here-document", MFD_CLOEXEC);
+    if (fd < 0) return -1;
+    if (!write_content(fd) || lseek(fd, 0, SEEK_SET) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Open a redirection's file (close-on-exec) and set target_fd to the
+// descriptor it replaces (0, 1 or 2). Returns -1 after reporting a failure
+int open_redirection(const Redirection& redirect, int& target_fd) {
+    int fd;
+    if (redirect.op == "<<" || redirect.op == "<<<") {
+        // The target is the content itself
+        target_fd = STDIN_FILENO;
+        fd = open_here_content(redirect.target);
+        if (fd < 0) cerr << "here-document: " << strerror(errno) << endl;
+        return fd;
+    }
+    if (redirect.op == "<") {
+        target_fd = STDIN_FILENO;
+        fd = open(redirect.target.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) cerr << redirect.target << ": " << strerror(errno) << endl;
+        return fd;
+    }
+    if (redirect.op[0] == '2') {
+        target_fd = STDERR_FILENO;
+        fd = open_redirect_file(redirect.target, redirect.op == "2>>");
+    } else {
+        target_fd = STDOUT_FILENO;
+        fd = open_redirect_file(redirect.target, redirect.op == ">>" || redirect.op == "1>>");
+    }
+    if (fd < 0) cerr << "Error: Cannot open file " << redirect.target << endl;
+    return fd;
+}
+
+// Signals that must be back at SIG_DFL in the child
+void launch_default_signals(const LaunchSpec& spec, sigset_t& defaults) {
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTTOU);
+    sigaddset(&defaults, SIGCHLD);
+    if (spec.foreground) {
+        sigaddset(&defaults, SIGINT);
+        sigaddset(&defaults, SIGTSTP);
+    }
+}
+
+// Launch an external program described by spec with posix_spawn()
+// A file the kernel cannot execute (ENOEXEC: a script without #!) is run
+// by /bin/sh, as execvp() does
+// Returns the child pid, or -1 with errno set on failure
+pid_t spawn_process(const LaunchSpec& spec) {
+    TraceSpan span("posix_spawn", spec.path);
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+    
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+#ifdef POSIX_SPAWN_USEVFORK
+    flags |= POSIX_SPAWN_USEVFORK;
+#endif
+    
+    // Process group (same as setpgid() in the old fork path)
+    if (spec.pgid >= 0) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, spec.pgid);
+    }
+    
+    // Reset ignored signals and start with an empty signal mask
+    sigset_t defaults, empty_mask;
+    launch_default_signals(spec, defaults);
+    sigemptyset(&empty_mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, &empty_mask);
+    posix_spawnattr_setflags(&attr, flags);
+    
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+    // Take the terminal in the child before exec (the parent does it too,
+    // whichever runs first wins the race harmlessly)
+    if (spec.foreground && spec.pgid >= 0 && isatty(STDIN_FILENO)) {
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+    }
+#endif
+    
+    // Install redirections and pipe ends
+    if (spec.stdin_fd >= 0) posix_spawn_file_actions_adddup2(&actions, spec.stdin_fd, 0);
+    if (spec.stdout_fd >= 0) posix_spawn_file_actions_adddup2(&actions, spec.stdout_fd, 1);
+    if (spec.stderr_fd >= 0) posix_spawn_file_actions_adddup2(&actions, spec.stderr_fd, 2);
+    for (int fd : spec.close_fds) {
+        if (fd > 2) posix_spawn_file_actions_addclose(&actions, fd);
+    }
+    
+    // posix_spawn needs a NULL-terminated char* array
+    vector<char*> argv;
+    for (const auto& arg : spec.args) {
+        argv.push_back((char*)arg.c_str());
+    }
+    argv.push_back(nullptr);
+    
+    pid_t pid = -1;
+    int rc = posix_spawn(&pid, spec.path.c_str(), &actions, &attr, argv.data(), exported_environment());
+    if (rc == ENOEXEC) {
+        // /bin/sh path args..., replacing argv[0]
+        vector<char*> shell_argv = {(char*)"/bin/sh", (char*)spec.path.c_str()};
+        shell_argv.insert(shell_argv.end(), argv.begin() + min<size_t>(1, spec.args.size()), argv.end());
+        rc = posix_spawn(&pid, "/bin/sh", &actions, &attr, shell_argv.data(), exported_environment());
+    }
+    
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    return pid;
+}
+
+// Apply a LaunchSpec inside a forked child
+// Used by the fork fallback for builtins that must run in a copy of the shell
+void apply_launch_spec_in_child(const LaunchSpec& spec) {
+    if (spec.pgid >= 0) {
+        setpgid(0, spec.pgid);
+        if (spec.foreground && isatty(STDIN_FILENO)) {
+            tcsetpgrp(STDIN_FILENO, getpgrp());
+        }
+    }
+    
+    sigset_t defaults;
+    launch_default_signals(spec, defaults);
+    for (int sig = 1; sig < NSIG; sig++) {
+        if (sigismember(&defaults, sig) == 1) {
+            signal(sig, SIG_DFL);
+        }
+    }
+    sigset_t empty_mask;
+    sigemptyset(&empty_mask);
+    sigprocmask(SIG_SETMASK, &empty_mask, nullptr);
+    
+    if (spec.stdin_fd >= 0) dup2(spec.stdin_fd, 0);
+    if (spec.stdout_fd >= 0) dup2(spec.stdout_fd, 1);
+    if (spec.stderr_fd >= 0) dup2(spec.stderr_fd, 2);
+    for (int fd : spec.close_fds) {
+        if (fd > 2) close(fd);
+    }
+}
+
+// Fork a copy of the shell and apply spec in the child
+// Returns like fork(): 0 in the child, child pid in the parent, -1 on failure
+pid_t fork_process(const LaunchSpec& spec) {
+    TraceSpan span("fork", spec.args.empty() ? string_view() : string_view(spec.args[0]));
+    pid_t pid = fork();
+    if (pid == 0) {
+        apply_launch_spec_in_child(spec);
+        
+        // The copy of the shell supervises its own children through the signalfd
+        sigset_t chld_mask;
+        sigemptyset(&chld_mask);
+        sigaddset(&chld_mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &chld_mask, nullptr);
+    }
+    return pid;
+}
+
+// Spawn a command whose path came from find_executable_in_path(). If the
+// hashed path went stale (removed, or no longer executable), the command may
+// still exist further along PATH: search again and retry once
+// Returns the child pid, or -1 with errno set on failure
+pid_t spawn_hashed_command(LaunchSpec& spec, const string& command) {
+    pid_t pid = spawn_process(spec);
+    if (pid >= 0 || (errno != ENOENT && errno != EACCES)) return pid;
+    
+    int spawn_errno = errno;
+    forget_hashed_command(command);
+    string full_path;
+    if (command.find('/') == string::npos && find_executable_in_path(command, full_path) && full_path != spec.path) {
+        spec.path = full_path;
+        pid = spawn_process(spec);
+        if (pid >= 0) return pid;
+        spawn_errno = errno;
+        forget_hashed_command(command);
+    }
+    errno = spawn_errno;
+    return -1;
+}
+
+// ---------------------------------------------------------------------------
+// parallel builtin
+// Runs one external command per argument with at most N children alive.
+// Children come from the spawn engine and are reaped by reap_children();
+// the moment one finishes, its slot takes the next argument, so all N slots
+// stay busy until the list runs out. Each job's stdout and stderr go to
+// memfds and are copied out kernel-side in one piece per job, either as
+// jobs finish or (-k) in argument order.
+// ---------------------------------------------------------------------------
+
+// One job of a parallel run
+struct ParallelJob {
+    string command;     // Command line after substitution (for --timings)
+    int stdout_fd = -1; // memfds holding the job's output until it is written
+    int stderr_fd = -1;
+    string stdout_text; // Output parked in memory while waiting for its turn (-k)
+    string stderr_text;
+    bool finished = false;
+    int exit_status = 0;
+    chrono::steady_clock::time_point start;
+    double seconds = 0;
+};
+
+// Replace {} (argument), {.} (without extension), {/} (basename),
+// {//} (dirname), {/.} (basename without extension) and {#} (job number)
+// Sets replaced if the word contained any of them
+string parallel_substitute(const string& word, const string& arg, size_t number, bool& replaced) {
+    size_t slash = arg.rfind('/');
+    string base = (slash == string::npos) ? arg : arg.substr(slash + 1);
+    string dir = (slash == string::npos) ? "." : (slash == 0 ? "/" : arg.substr(0, slash));
+    auto strip_extension = [](const string& path) {
+        size_t dot = path.rfind('.');
+        size_t slash = path.rfind('/');
+        if (dot == string::npos || dot == 0 || (slash != string::npos && dot < slash + 2)) return path;
+        return path.substr(0, dot);
+    };
+    
+    const pair<const char*, string> replacements[] = {
+        {"{}", arg}, {"{.}", strip_extension(arg)}, {"{/}", base},
+        {"{//}", dir}, {"{/.}", strip_extension(base)}, {"{#}", to_string(number)}
+    };
+    
+    string result;
+    for (size_t i = 0; i < word.size();) {
+        bool matched = false;
+        if (word[i] == '{') {
+            for (const auto& replacement : replacements) {
+                if (word.compare(i, strlen(replacement.first), replacement.first) == 0) {
+                    result += replacement.second;
+                    i += strlen(replacement.first);
+                    matched = replaced = true;
+                    break;
+                }
+            }
+        }
+        if (!matched) result += word[i++];
+    }
+    return result;
+}
+
+// Read the rest of a memfd back into a string
+string read_memfd(int fd) {
+    string text;
+    char buffer[1 << 16];
+    lseek(fd, 0, SEEK_SET);
+    while (true) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        text.append(buffer, n);
+    }
+    return text;
+}
+
+// Write a finished job's output: stdout to out_fd, stderr to fd 2
+void emit_parallel_output(ParallelJob& job, int out_fd) {
+    if (job.stdout_fd >= 0) {
+        lseek(job.stdout_fd, 0, SEEK_SET);
+        copy_fd_contents(job.stdout_fd, out_fd);
+        close(job.stdout_fd);
+        job.stdout_fd = -1;
+    } else {
+        write_all(out_fd, job.stdout_text.data(), job.stdout_text.size());
+    }
+    if (job.stderr_fd >= 0) {
+        lseek(job.stderr_fd, 0, SEEK_SET);
+        copy_fd_contents(job.stderr_fd, STDERR_FILENO);
+        close(job.stderr_fd);
+        job.stderr_fd = -1;
+    } else {
+        write_all(STDERR_FILENO, job.stderr_text.data(), job.stderr_text.size());
+    }
+    job.stdout_text.clear();
+    job.stderr_text.clear();
+}
+
+// Handle the 'parallel' builtin:
+//   parallel [-j N] [-k] [--timings] command [args with {}...] ::: arguments...
+// Without ':::' the arguments are read from in_fd, one per line. Output goes
+// to out_fd. Returns the number of failed jobs (at most 101), like GNU parallel
+int run_parallel_builtin(const vector<string>& args, int in_fd, int out_fd) {
+    size_t slots = max(1u, thread::hardware_concurrency());
+    bool keep_order = false;
+    bool timings = false;
+    
+    size_t i = 1;
+    for (; i < args.size(); i++) {
+        const string& arg = args[i];
+        if (arg == "-k") {
+            keep_order = true;
+        } else if (arg == "--timings") {
+            timings = true;
+        } else if (arg.compare(0, 2, "-j") == 0) {
+            string value = (arg.size() > 2) ? arg.substr(2) : (i + 1 < args.size() ? args[++i] : "");
+            char* end = nullptr;
+            long count = strtol(value.c_str(), &end, 10);
+            if (value.empty() || *end != '\0' || count < 0) {
+                cerr << "parallel: " << value << ": invalid job count" << endl;
+                return 2;
+            }
+            slots = (count == 0) ? SIZE_MAX : (size_t)count;  // -j 0: no limit
+        } else if (arg == "--") {
+            i++;
+            break;
+        } else {
+            break;
+        }
+    }
+    
+    vector<string> command_template;
+    vector<string> inputs;
+    bool inline_inputs = false;
+    for (; i < args.size(); i++) {
+        if (args[i] == ":::") {
+            inputs.assign(args.begin() + i + 1, args.end());
+            inline_inputs = true;
+            break;
+        }
+        command_template.push_back(args[i]);
+    }
+    if (command_template.empty()) {
+        cerr << "Usage: parallel [-j N] [-k] [--timings] command [{}] [::: args...]" << endl;
+        return 2;
+    }
+    if (!inline_inputs) {
+        string text;
+        char buffer[1 << 16];
+        while (true) {
+            ssize_t n = read(in_fd, buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            text.append(buffer, n);
+        }
+        stringstream lines(text);
+        string line;
+        while (getline(lines, line)) inputs.push_back(line);
+    }
+    
+    vector<ParallelJob> tasks(inputs.size());
+    unordered_map<pid_t, size_t> running;  // pid -> task
+    size_t next = 0, emitted = 0, failed = 0;
+    bool interrupted = false;
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    auto wall_start = chrono::steady_clock::now();
+    
+    // Record a finished task and write out whatever output is due
+    auto finish = [&](size_t index, int exit_status) {
+        ParallelJob& task = tasks[index];
+        task.finished = true;
+        task.exit_status = exit_status;
+        task.seconds = chrono::duration<double>(chrono::steady_clock::now() - task.start).count();
+        if (exit_status != 0) failed++;
+        
+        if (!keep_order) {
+            emit_parallel_output(task, out_fd);
+            emitted++;
+            return;
+        }
+        while (emitted < tasks.size() && tasks[emitted].finished) {
+            emit_parallel_output(tasks[emitted++], out_fd);
+        }
+        if (emitted <= index) {
+            // Not its turn yet: park the output so descriptors stay bounded
+            if (task.stdout_fd >= 0) task.stdout_text = read_memfd(task.stdout_fd);
+            if (task.stderr_fd >= 0) task.stderr_text = read_memfd(task.stderr_fd);
+            if (task.stdout_fd >= 0) close(task.stdout_fd);
+            if (task.stderr_fd >= 0) close(task.stderr_fd);
+            task.stdout_fd = task.stderr_fd = -1;
+        }
+    };
+    
+    while (running.size() > 0 || (next < tasks.size() && !interrupted)) {
+        // Fill every free slot
+        while (!interrupted && next < tasks.size() && running.size() < slots) {
+            size_t index = next++;
+            ParallelJob& task = tasks[index];
+            task.start = chrono::steady_clock::now();
+            
+            bool replaced = false;
+            vector<string> command_args;
+            for (const auto& word : command_template) {
+                command_args.push_back(parallel_substitute(word, inputs[index], index + 1, replaced));
+            }
+            if (!replaced) command_args.push_back(inputs[index]);
+            for (const auto& word : command_args) {
+                if (!task.command.empty()) task.command += " ";
+                task.command += word;
+            }
+            
+            LaunchSpec spec;
+            if (!find_executable_in_path(command_args[0], spec.path)) {
+                cerr << "parallel: " << command_args[0] << ": command not found" << endl;
+                finish(index, 127);
+                continue;
+            }
+            spec.args = command_args;
+            spec.stdin_fd = null_fd;
+            spec.stdout_fd = task.stdout_fd = memfd_create("parallel-stdout", MFD_CLOEXEC);
+            spec.stderr_fd = task.stderr_fd = memfd_create("parallel-stderr", MFD_CLOEXEC);
+            spec.foreground = true;  // Ctrl+C reaches the jobs (they stay in the shell's group)
+            
+            pid_t pid = (task.stdout_fd >= 0 && task.stderr_fd >= 0) ? spawn_process(spec) : -1;
+            if (pid < 0) {
+                cerr << "parallel: " << command_args[0] << ": " << strerror(errno) << endl;
+                finish(index, 1);
+                continue;
+            }
+            running[pid] = index;
+        }
+        if (running.empty()) continue;
+        
+        // Collect every job that finished since the last pass
+        bool have_children = reap_children();
+        bool progressed = false;
+        for (auto it = running.begin(); it != running.end();) {
+            ChildStatus child;
+            bool claimed = claim_child(it->first, child);
+            if (claimed && WIFSTOPPED(child.status)) claimed = false;
+            if (!claimed && have_children) {
+                ++it;
+                continue;
+            }
+            int exit_status = claimed ? status_to_exit_code(child.status) : 1;
+            if (claimed && WIFSIGNALED(child.status) && WTERMSIG(child.status) == SIGINT) {
+                interrupted = true;  // Ctrl+C: let running jobs end, start no more
+            }
+            finish(it->second, exit_status);
+            it = running.erase(it);
+            progressed = true;
+        }
+        if (!progressed) wait_for_child_event(-1);
+    }
+    if (null_fd >= 0) close(null_fd);
+    
+    if (timings) {
+        double wall = chrono::duration<double>(chrono::steady_clock::now() - wall_start).count();
+        double total = 0;
+        size_t ran = 0;
+        cerr << COLOR_GRAY << "  job  status   seconds  command" << COLOR_RESET << endl;
+        for (size_t j = 0; j < tasks.size(); j++) {
+            if (!tasks[j].finished) continue;
+            ran++;
+            total += tasks[j].seconds;
+            cerr << setw(5) << (j + 1) << "  " << setw(6) << tasks[j].exit_status << "  "
+                 << fixed << setprecision(3) << setw(8) << tasks[j].seconds << "  " << tasks[j].command << endl;
+        }
+        cerr << COLOR_CYAN << "parallel: " << ran << " jobs, " << failed << " failed, "
+             << fixed << setprecision(3) << wall << "s wall, " << total << "s job time"
+             << " (" << setprecision(2) << (wall > 0 ? total / wall : 0) << "x)" << COLOR_RESET << endl;
+        cerr << defaultfloat;
+    }
+    
+    if (interrupted) return 130;
+    return (int)min<size_t>(failed, 101);
+}
+
+// ---------------------------------------------------------------------------
+// Builtin commands
+// One handler per builtin, shared by the standalone and the pipeline paths:
+// handlers write to io.out (and errors to cerr) and return the exit status.
+// ---------------------------------------------------------------------------
+
+// Set by `exit`; the main loop stops after the current command
+bool exit_requested = false;
+
+// History length at the last `history -a` (later entries are appended next)
+int history_appended_position = 0;
+
+// Parse a job ID argument for fg/bg, or pick the default job
+// Returns nullptr (after printing why) if there is no such job
+Job* builtin_job_argument(const vector<string>& args, bool stopped_only) {
+    const string& command = args[0];
+    if (jobs.empty()) {
+        cerr << command << ": no current job" << endl;
+        return nullptr;
+    }
+    
+    if (args.size() > 1) {
+        // Specific job ID
+        try {
+            int job_id = stoi(args[1]);
+            Job* job = find_job_by_id(job_id);
+            if (!job) cerr << command << ": " << job_id << ": no such job" << endl;
+            return job;
+        } catch (...) {
+            cerr << command << ": invalid job id" << endl;
+            return nullptr;
+        }
+    }
+    if (!stopped_only) return &jobs.back();  // Most recent job
+    
+    // Most recent stopped job
+    for (auto it = jobs.rbegin(); it != jobs.rend(); ++it) {
+        if (it->status == STOPPED) return &(*it);
+    }
+    cerr << command << ": no stopped jobs" << endl;
+    return nullptr;
+}
+
+int builtin_exit(const vector<string>& args, BuiltinIO& io) {
+    // Exit the shell, optionally with a status (default: the last one)
+    int status = last_exit_status;
+    if (args.size() > 1) {
+        try {
+            status = stoi(args[1]) & 0xff;
+        } catch (...) {
+            cerr << "exit: " << args[1] << ": numeric argument required" << endl;
+            status = 2;
+        }
+    }
+    exit_requested = true;
+    return status;
+}
+
+int builtin_type(const vector<string>& args, BuiltinIO& io) {
+    // Check each argument after 'type'
+    for (size_t i = 1; i < args.size(); i++) {
+        check_command_validity(args[i], io.out);
+    }
+    return 0;
+}
+
+int builtin_echo(const vector<string>& args, BuiltinIO& io) {
+    // Print all words after 'echo'
+    for (size_t i = 1; i < args.size(); i++) {
+        io.out << args[i];
+        if (i < args.size() - 1) {
+            io.out << " ";
+        }
+    }
+    io.out << endl;
+    return 0;
+}
+
+int builtin_pwd(const vector<string>& args, BuiltinIO& io) {
+    // Print current working directory
+    vector<char> cwd(1024);
+    if (getcwd(cwd.data(), cwd.size()) == nullptr) {
+        cerr << "Error: Unable to get current directory" << endl;
+        return 1;
+    }
+    io.out << cwd.data() << endl;
+    return 0;
+}
+
+int builtin_cd(const vector<string>& args, BuiltinIO& io) {
+    if (args.size() < 2) {
+        cerr << "cd: missing argument" << endl;
+        return 1;
+    }
+    string path = args[1];
+    
+    // Handle ~ (home directory), e.g. ~/Documents
+    if (path == "~" || path.substr(0, 2) == "~/") {
+        const string* home = find_variable("HOME");
+        if (home == nullptr) {
+            cerr << "cd: HOME not set" << endl;
+            return 1;
+        }
+        path = *home + path.substr(1);
+    }
+    
+    // Works for absolute and relative paths
+    if (chdir(path.c_str()) != 0) {
+        cerr << "cd: " << args[1] << ": No such file or directory" << endl;
+        return 1;
+    }
+    
+    // Count the visit for `jump` (not from a forked pipeline copy)
+    char cwd[4096];
+    if (!io.pipeline && getcwd(cwd, sizeof(cwd)) != nullptr) dirdb_visit(cwd);
+    return 0;
+}
+
+int builtin_export(const vector<string>& args, BuiltinIO& io) {
+    for (size_t i = 1; i < args.size(); i++) {
+        const string& arg = args[i];
+        size_t eq_pos = arg.find('=');
+        if (eq_pos != string::npos) {
+            // VAR=value: set the variable and mark it for export
+            string var_name = arg.substr(0, eq_pos);
+            set_variable(var_name, arg.substr(eq_pos + 1));
+            export_variable(var_name);
+        } else {
+            // Just VAR (export existing shell variable)
+            export_variable(arg);
+        }
+    }
+    return 0;
+}
+
+int builtin_unset(const vector<string>& args, BuiltinIO& io) {
+    for (size_t i = 1; i < args.size(); i++) {
+        unset_variable(args[i]);
+    }
+    return 0;
+}
+
+int builtin_env(const vector<string>& args, BuiltinIO& io) {
+    // Print all exported variables
+    for (char** env = exported_environment(); *env != nullptr; env++) {
+        io.out << *env << endl;
+    }
+    return 0;
+}
+
+int builtin_history(const vector<string>& args, BuiltinIO& io) {
+    return run_history_builtin(args, history_appended_position, io.out);
+}
+
+int builtin_git_status(const vector<string>& args, BuiltinIO& io) {
+    // Show git repository status with branch information
+    if (!is_git_repo()) {
+        io.out << COLOR_RED << "Not a git repository" << COLOR_RESET << endl;
+        return 1;
+    }
+    
+    string branch = get_git_branch();
+    string status = get_git_status();
+    if (branch.empty()) {
+        io.out << COLOR_YELLOW << "No branch (detached HEAD?)" << COLOR_RESET << endl;
+        return 0;
+    }
+    io.out << COLOR_CYAN << "Branch: " << COLOR_GREEN << branch << COLOR_RESET;
+    if (status == "✓") {
+        io.out << COLOR_GREEN << " [clean]" << COLOR_RESET << endl;
+    } else {
+        io.out << COLOR_YELLOW << " [dirty]" << COLOR_RESET << endl;
+    }
+    return 0;
+}
+
+int builtin_git_branch(const vector<string>& args, BuiltinIO& io) {
+    // Switch git branch or list branches
+    if (!is_git_repo()) {
+        io.out << COLOR_RED << "Not a git repository" << COLOR_RESET << endl;
+        return 1;
+    }
+    if (args.size() == 1) {
+        // List all branches (read from refs, no git process)
+        print_git_branches(io.out);
+        return 0;
+    }
+    
+    // Switch to specified branch
+    string git_cmd = "git checkout " + args[1];
+    io.out.flush();
+    exported_environment();  // Sync environ for system()
+    int ret = system(git_cmd.c_str());
+    return (ret == 0) ? 0 : 1;
+}
+
+int builtin_bookmark(const vector<string>& args, BuiltinIO& io) {
+    load_bookmarks();
+    if (args.size() == 1) {
+        // List all bookmarks
+        if (bookmarks.empty()) {
+            io.out << COLOR_YELLOW << "No bookmarks saved" << COLOR_RESET << endl;
+        } else {
+            io.out << COLOR_CYAN << "Bookmarks:" << COLOR_RESET << endl;
+            for (const auto& [name, path] : bookmarks) {
+                io.out << "  " << COLOR_GREEN << name << COLOR_RESET << " -> " << path << endl;
+            }
+        }
+        return 0;
+    }
+    
+    if (args[1] == "rm" && args.size() == 3) {
+        // Remove a bookmark
+        const string& name = args[2];
+        if (bookmarks.erase(name) == 0) {
+            io.out << COLOR_RED << "Bookmark not found: " << name << COLOR_RESET << endl;
+            return 1;
+        }
+        save_bookmark_change(name, "");
+        io.out << COLOR_GREEN << "Removed bookmark: " << name << COLOR_RESET << endl;
+        return 0;
+    }
+    
+    // Save current directory with given name
+    const string& name = args[1];
+    char cwd_buf[1024];
+    if (!getcwd(cwd_buf, sizeof(cwd_buf))) {
+        io.out << COLOR_RED << "Failed to get current directory" << COLOR_RESET << endl;
+        return 1;
+    }
+    bookmarks[name] = string(cwd_buf);
+    save_bookmark_change(name, cwd_buf);
+    io.out << COLOR_GREEN << "Bookmarked: " << name << " -> " << cwd_buf << COLOR_RESET << endl;
+    return 0;
+}
+
+// jump <bookmark>, jump <fragments...> (best visited directory), jump -l [fragments...]
+int builtin_jump(const vector<string>& args, BuiltinIO& io) {
+    load_bookmarks();
+    if (args.size() < 2) {
+        io.out << COLOR_YELLOW << "Usage: jump <bookmark-name> | jump <fragments...> | jump -l [fragments...]" << COLOR_RESET << endl;
+        return 1;
+    }
+    
+    // -l: list the best matches with their ranks
+    if (args[1] == "-l") {
+        vector<string> fragments(args.begin() + 2, args.end());
+        for (const auto& [rank, directory] : dirdb_rank(fragments, 20)) {
+            io.out << COLOR_CYAN << fixed << setprecision(1) << setw(8) << rank << COLOR_RESET << "  " << directory << endl;
+        }
+        io.out.unsetf(ios::floatfield);
+        io.out << setprecision(6);
+        return 0;
+    }
+    
+    // A bookmark name wins; otherwise the best visited directory
+    string target;
+    auto it = bookmarks.find(args[1]);
+    if (args.size() == 2 && it != bookmarks.end()) {
+        target = it->second;
+    } else {
+        vector<pair<double, string>> best = dirdb_rank(vector<string>(args.begin() + 1, args.end()), 1);
+        if (best.empty()) {
+            string fragments;
+            for (size_t i = 1; i < args.size(); i++) fragments += (i > 1 ? " " : "") + args[i];
+            io.out << COLOR_RED << "No bookmark or visited directory matches: " << fragments << COLOR_RESET << endl;
+            return 1;
+        }
+        target = best[0].second;
+    }
+    
+    if (chdir(target.c_str()) != 0) {
+        io.out << COLOR_RED << "Failed to change directory to: " << target << COLOR_RESET << endl;
+        return 1;
+    }
+    if (!io.pipeline) dirdb_visit(target);
+    io.out << COLOR_GREEN << "Jumped to: " << target << COLOR_RESET << endl;
+    return 0;
+}
+
+int builtin_calc(const vector<string>& args, BuiltinIO& io) {
+    return run_calc_builtin(args, io.out);
+}
+
+int builtin_timer(const vector<string>& args, BuiltinIO& io) {
+    // time/timer only work as a prefix of the whole pipeline
+    io.out << COLOR_YELLOW << "Use 'timer' before a command to time it" << COLOR_RESET << endl;
+    io.out << COLOR_GRAY << "Example: timer sleep 2 | wc -c" << COLOR_RESET << endl;
+    return 1;
+}
+
+int builtin_hash(const vector<string>& args, BuiltinIO& io) {
+    return run_hash_builtin(args, io.out);
+}
+
+int builtin_fcat(const vector<string>& args, BuiltinIO& io) {
+    // Zero-copy concatenation: writes straight to the descriptor, not through io.out
+    io.out.flush();
+    return run_fcat_builtin(args, io.in_fd, io.out_fd);
+}
+
+int builtin_parallel(const vector<string>& args, BuiltinIO& io) {
+    io.out.flush();
+    return run_parallel_builtin(args, io.in_fd, io.out_fd);
+}
+
+int builtin_jobs(const vector<string>& args, BuiltinIO& io) {
+    // Reaping and cleanup change the job table: not on a pipeline thread
+    if (!io.pipeline) notify_job_changes();
+    return run_jobs_builtin(args, io.out, !io.pipeline);
+}
+
+int builtin_wait(const vector<string>& args, BuiltinIO& io) {
+    return run_wait_builtin(args);
+}
+
+int builtin_fg(const vector<string>& args, BuiltinIO& io) {
+    Job* job = builtin_job_argument(args, false);
+    if (job == nullptr) return 1;
+    return foreground_job(job, io.out);
+}
+
+int builtin_bg(const vector<string>& args, BuiltinIO& io) {
+    Job* job = builtin_job_argument(args, true);
+    if (job == nullptr) return 1;
+    
+    // Send SIGCONT to resume
+    kill(job->pid, SIGCONT);
+    job->status = RUNNING;
+    job->is_background = true;
+    io.out << "[" << job->job_id << "]+ " << job->command << " &" << endl;
+    return 0;
+}
+
+// trace on|off|clear|status|dump [file]
+int builtin_trace(const vector<string>& args, BuiltinIO& io) {
+    string action = args.size() > 1 ? args[1] : "status";
+    if (action == "on") {
+        trace_enabled = true;
+    } else if (action == "off") {
+        trace_enabled = false;
+    } else if (action == "clear") {
+        trace_clear();
+    } else if (action == "status") {
+        uint64_t events = 0;
+        {
+            lock_guard<mutex> lock(trace_buffers_mutex);
+            for (auto& buffer : trace_buffers) {
+                lock_guard<mutex> buffer_lock(buffer->lock);
+                events += min<uint64_t>(buffer->written, TRACE_RING_SIZE);
+            }
+        }
+        io.out << "tracing " << (trace_enabled ? "on" : "off") << ", " << events << " events buffered" << endl;
+    } else if (action == "dump") {
+        string path = args.size() > 2 ? args[2] : "shell-trace.json";
+        if (!trace_dump(path)) return 1;
+        io.out << COLOR_GREEN << "Trace written to " << path << COLOR_RESET << endl;
+    } else {
+        io.out << COLOR_YELLOW << "Usage: trace on|off|clear|status|dump [file]" << COLOR_RESET << endl;
+        return 2;
+    }
+    return 0;
+}
+
+// Listing forms of builtins that can also modify state are output-only
+bool history_is_listing(const vector<string>& args) {
+    return args.size() < 2 || (args[1] != "-r" && args[1] != "-w" && args[1] != "-a");
+}
+
+bool bare_invocation(const vector<string>& args) {
+    return args.size() == 1;
+}
+
+// Argument completion hooks
+void complete_bookmarks(const string& prefix, vector<string>& matches) {
+    load_bookmarks();
+    for (const auto& entry : bookmarks) {
+        if (entry.first.compare(0, prefix.size(), prefix) == 0) matches.push_back(entry.first);
+    }
+}
+
+void complete_git_branches(const string& prefix, vector<string>& matches) {
+    GitRepo repo;
+    if (!find_git_repo(repo)) return;
+    for (const auto& branch : list_git_branches(repo)) {
+        if (branch.compare(0, prefix.size(), prefix) == 0) matches.push_back(branch);
+    }
+}
+
+void complete_job_ids(const string& prefix, vector<string>& matches) {
+    for (const auto& job : jobs) {
+        string id = to_string(job.job_id);
+        if (job.status != DONE && id.compare(0, prefix.size(), prefix) == 0) matches.push_back(id);
+    }
+}
+
+void complete_variables(const string& prefix, vector<string>& matches) {
+    for (const auto& entry : variables) {
+        if (entry.first.compare(0, prefix.size(), prefix) == 0) matches.push_back(entry.first);
+    }
+}
+
+void complete_jobs_options(const string& prefix, vector<string>& matches) {
+    for (const char* option : {"-l", "--watch"}) {
+        if (string(option).compare(0, prefix.size(), prefix) == 0) matches.push_back(option);
+    }
+}
+
+void complete_trace_actions(const string& prefix, vector<string>& matches) {
+    for (const char* action : {"on", "off", "clear", "status", "dump"}) {
+        if (string(action).compare(0, prefix.size(), prefix) == 0) matches.push_back(action);
+    }
+}
+
+void complete_command_names(const string& prefix, vector<string>& matches);  // Command catalog
+
+// The builtin table. Flags: BUILTIN_OUTPUT_ONLY builtins (or invocations the
+// output_only predicate accepts) may run on a pipeline thread; the others
+// fork a copy of the shell in a pipeline, so state changes stay local to it
+constexpr Builtin builtin_table[] = {
+    // name          handler              flags                                   output_only         complete
+    {"exit",         builtin_exit,        0,                                      nullptr,            nullptr},
+    {"echo",         builtin_echo,        BUILTIN_OUTPUT_ONLY,                    nullptr,            nullptr},
+    {"type",         builtin_type,        BUILTIN_OUTPUT_ONLY,                    nullptr,            complete_command_names},
+    {"pwd",          builtin_pwd,         BUILTIN_OUTPUT_ONLY,                    nullptr,            nullptr},
+    {"cd",           builtin_cd,          0,                                      nullptr,            nullptr},
+    {"export",       builtin_export,      0,                                      nullptr,            complete_variables},
+    {"unset",        builtin_unset,       0,                                      nullptr,            complete_variables},
+    {"env",          builtin_env,         BUILTIN_OUTPUT_ONLY,                    nullptr,            nullptr},
+    {"history",      builtin_history,     0,                                      history_is_listing, nullptr},
+    {"bookmark",     builtin_bookmark,    0,                                      bare_invocation,    complete_bookmarks},
+    {"jump",         builtin_jump,        0,                                      nullptr,            complete_bookmarks},
+    {"git-status",   builtin_git_status,  BUILTIN_OUTPUT_ONLY,                    nullptr,            nullptr},
+    {"git-branch",   builtin_git_branch,  0,                                      bare_invocation,    complete_git_branches},
+    {"calc",         builtin_calc,        BUILTIN_OUTPUT_ONLY,                    nullptr,            nullptr},
+    {"timer",        builtin_timer,       BUILTIN_OUTPUT_ONLY,                    nullptr,            complete_command_names},
+    {"time",         builtin_timer,       BUILTIN_OUTPUT_ONLY | BUILTIN_KEYWORD,  nullptr,            complete_command_names},
+    {"hash",         builtin_hash,        0,                                      bare_invocation,    complete_command_names},
+    {"fcat",         builtin_fcat,        BUILTIN_OUTPUT_ONLY | BUILTIN_RAW_FDS,  nullptr,            nullptr},
+    {"parallel",     builtin_parallel,    BUILTIN_RAW_FDS,                        nullptr,            complete_command_names},
+    {"jobs",         builtin_jobs,        BUILTIN_OUTPUT_ONLY,                    nullptr,            complete_jobs_options},
+    {"fg",           builtin_fg,          0,                                      nullptr,            complete_job_ids},
+    {"bg",           builtin_bg,          0,                                      nullptr,            complete_job_ids},
+    {"wait",         builtin_wait,        0,                                      nullptr,            complete_job_ids},
+    {"trace",        builtin_trace,       0,                                      nullptr,            complete_trace_actions},
+};
+
+constexpr size_t BUILTIN_COUNT = sizeof(builtin_table) / sizeof(builtin_table[0]);
+constexpr unsigned BUILTIN_SLOT_BITS = 6;
+constexpr size_t BUILTIN_SLOTS = 1u << BUILTIN_SLOT_BITS;
+static_assert(BUILTIN_COUNT < BUILTIN_SLOTS, "grow BUILTIN_SLOTS");
+
+// FNV-1a, perturbed by seed, reduced to a slot (the top bits: FNV's low
+// bits only depend on the low bits of the seed)
+constexpr size_t builtin_hash(string_view name, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (char c : name) {
+        hash ^= (unsigned char)c;
+        hash *= 16777619u;
+    }
+    return hash >> (32 - BUILTIN_SLOT_BITS);
+}
+
+// First seed that gives every builtin its own slot (found by the compiler)
+constexpr uint32_t find_builtin_seed() {
+    for (uint32_t seed = 0;; seed++) {
+        bool used[BUILTIN_SLOTS] = {};
+        bool collision = false;
+        for (size_t i = 0; i < BUILTIN_COUNT && !collision; i++) {
+            size_t slot = builtin_hash(builtin_table[i].name, seed);
+            collision = used[slot];
+            used[slot] = true;
+        }
+        if (!collision) return seed;
+    }
+}
+
+constexpr uint32_t BUILTIN_SEED = find_builtin_seed();
+
+// Slot -> index into builtin_table (-1 = empty)
+struct BuiltinSlots {
+    signed char index[BUILTIN_SLOTS];
+};
+
+constexpr BuiltinSlots make_builtin_slots() {
+    BuiltinSlots slots = {};
+    for (size_t i = 0; i < BUILTIN_SLOTS; i++) slots.index[i] = -1;
+    for (size_t i = 0; i < BUILTIN_COUNT; i++) {
+        slots.index[builtin_hash(builtin_table[i].name, BUILTIN_SEED)] = (signed char)i;
+    }
+    return slots;
+}
+
+constexpr BuiltinSlots builtin_slots = make_builtin_slots();
+
+const Builtin* find_builtin(string_view name) {
+    int index = builtin_slots.index[builtin_hash(name, BUILTIN_SEED)];
+    if (index < 0 || name != builtin_table[index].name) return nullptr;
+    return &builtin_table[index];
+}
+
+// Run a builtin in the shell itself. Its redirections are applied to the
+// shell's own descriptors 0/1/2 for the duration of the call, so everything
+// it prints (including from helpers writing to cout/cerr) lands in them
+int run_builtin_standalone(const Builtin& builtin, const vector<string>& args, const vector<Redirection>& redirects) {
+    TraceSpan span("builtin", builtin.name);
+    // Open every target first, so a failure leaves the shell's descriptors alone
+    vector<pair<int, int>> opened;  // (descriptor it replaces, file)
+    for (const auto& redirect : redirects) {
+        int target_fd;
+        int fd = open_redirection(redirect, target_fd);
+        if (fd < 0) {
+            for (auto& entry : opened) close(entry.second);
+            return 1;
+        }
+        opened.push_back({target_fd, fd});
+    }
+    
+    cout.flush();
+    cerr.flush();
+    vector<pair<int, int>> saved;  // (descriptor, saved copy)
+    for (auto& [target_fd, fd] : opened) {
+        saved.push_back({target_fd, fcntl(target_fd, F_DUPFD_CLOEXEC, 10)});
+        dup2(fd, target_fd);
+        close(fd);
+    }
+    
+    BuiltinIO io = {STDIN_FILENO, STDOUT_FILENO, cout, false};
+    int status = builtin.handler(args, io);
+    
+    cout.flush();
+    cerr.flush();
+    // Restore in reverse order, so a descriptor redirected twice gets its original back
+    for (auto it = saved.rbegin(); it != saved.rend(); ++it) {
+        if (it->second >= 0) {
+            dup2(it->second, it->first);
+            close(it->second);
+        }
+    }
+    return status;
+}
+
+// ---------------------------------------------------------------------------
+// Process accounting for `time` and $PIPESTATUS
+// Foreground children are reaped with wait4(), which returns their rusage.
+// ---------------------------------------------------------------------------
+
+// Exit status, timing and resource usage of one finished process
+struct StageStats {
+    string command;
+    int exit_status = 0;
+    chrono::steady_clock::time_point start;
+    double real_seconds = 0;
+    struct rusage usage = {};
+};
+
+// Stages of the last foreground external command or pipeline
+vector<StageStats> last_command_stats;
+
+double timeval_seconds(const struct timeval& tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Wait for every stage of a foreground pipeline, recording each one's
+// status, rusage and finish time. Stages are collected in whatever order
+// they exit so per-stage wall times are accurate. Entries with pid 0 are
+// not processes and are skipped.
+void wait_for_stages(const vector<pid_t>& pids, vector<StageStats>& stats) {
+    vector<bool> done(pids.size(), false);
+    size_t remaining = 0;
+    for (size_t i = 0; i < pids.size(); i++) {
+        if (pids[i] > 0) {
+            remaining++;
+        } else {
+            done[i] = true;
+        }
+    }
+    
+    while (remaining > 0) {
+        bool have_children = reap_children();
+        for (size_t i = 0; i < pids.size(); i++) {
+            if (done[i]) continue;
+            
+            ChildStatus child;
+            if (claim_child(pids[i], child)) {
+                if (WIFSTOPPED(child.status)) continue;  // Stages are not stopped as jobs
+                stats[i].exit_status = status_to_exit_code(child.status);
+                stats[i].usage = child.usage;
+            } else if (!have_children) {
+                stats[i].exit_status = 1;  // Lost the child (should not happen)
+            } else {
+                continue;
+            }
+            stats[i].real_seconds = chrono::duration<double>(
+                chrono::steady_clock::now() - stats[i].start).count();
+            done[i] = true;
+            remaining--;
+        }
+        if (remaining == 0) break;
+        
+        // Sleep until some child changes state
+        wait_for_child_event(-1);
+    }
+}
+
+// Format seconds the way bash's `time` does: 0m1.234s
+string format_duration(double seconds) {
+    int minutes = (int)(seconds / 60);
+    ostringstream out;
+    out << minutes << "m" << fixed << setprecision(3) << (seconds - minutes * 60) << "s";
+    return out.str();
+}
+
+// Print the report for a timed command to stderr
+// real is the wall time of the whole command, usage the summed rusage;
+// stages (if more than one) get a per-stage breakdown
+void print_time_report(double real, const struct rusage& usage, const vector<StageStats>& stages) {
+    cerr << "\n"
+         << "real\t" << format_duration(real) << "\n"
+         << "user\t" << format_duration(timeval_seconds(usage.ru_utime)) << "\n"
+         << "sys\t" << format_duration(timeval_seconds(usage.ru_stime)) << "\n"
+         << "maxrss\t" << usage.ru_maxrss << "K\n"
+         << "ctxsw\t" << usage.ru_nvcsw << " voluntary, " << usage.ru_nivcsw << " involuntary" << endl;
+    
+    if (stages.size() < 2) return;
+    
+    cerr << left << setw(6) << "stage" << setw(8) << "status" << setw(11) << "real"
+         << setw(11) << "user" << setw(11) << "sys" << setw(10) << "maxrss"
+         << setw(8) << "vcsw" << setw(8) << "ivcsw" << "command" << endl;
+    for (size_t i = 0; i < stages.size(); i++) {
+        const StageStats& st = stages[i];
+        cerr << left << setw(6) << i << setw(8) << st.exit_status
+             << setw(11) << format_duration(st.real_seconds)
+             << setw(11) << format_duration(timeval_seconds(st.usage.ru_utime))
+             << setw(11) << format_duration(timeval_seconds(st.usage.ru_stime))
+             << setw(10) << (to_string(st.usage.ru_maxrss) + "K")
+             << setw(8) << st.usage.ru_nvcsw << setw(8) << st.usage.ru_nivcsw
+             << st.command << endl;
+    }
+}
+
+// Book-keeping for the command currently running in the main loop, so its
+// PIPESTATUS (and `time` report) can be produced once it has finished
+struct CommandTiming {
+    bool active = false;
+    bool timed = false;
+    chrono::steady_clock::time_point start;
+    struct rusage self_start = {};
+};
+
+CommandTiming current_command;
+
+// Called before a (possibly timed) command runs
+void begin_command(bool timed) {
+    last_command_stats.clear();
+    current_command.active = true;
+    current_command.timed = timed;
+    current_command.start = chrono::steady_clock::now();
+    getrusage(RUSAGE_SELF, &current_command.self_start);
+}
+
+// Called after a command finished: update PIPESTATUS and print the report
+void finish_command() {
+    if (!current_command.active) return;
+    current_command.active = false;
+    
+    double real = chrono::duration<double>(chrono::steady_clock::now() - current_command.start).count();
+    struct rusage total = {};
+    
+    if (last_command_stats.empty()) {
+        // Builtin (or nothing launched): the shell itself did the work
+        pipe_status = {last_exit_status};
+        struct rusage self_now;
+        getrusage(RUSAGE_SELF, &self_now);
+        timersub(&self_now.ru_utime, &current_command.self_start.ru_utime, &total.ru_utime);
+        timersub(&self_now.ru_stime, &current_command.self_start.ru_stime, &total.ru_stime);
+        total.ru_maxrss = self_now.ru_maxrss;
+        total.ru_nvcsw = self_now.ru_nvcsw - current_command.self_start.ru_nvcsw;
+        total.ru_nivcsw = self_now.ru_nivcsw - current_command.self_start.ru_nivcsw;
+    } else {
+        pipe_status.clear();
+        for (const auto& st : last_command_stats) {
+            pipe_status.push_back(st.exit_status);
+            timeradd(&total.ru_utime, &st.usage.ru_utime, &total.ru_utime);
+            timeradd(&total.ru_stime, &st.usage.ru_stime, &total.ru_stime);
+            total.ru_maxrss = max(total.ru_maxrss, st.usage.ru_maxrss);
+            total.ru_nvcsw += st.usage.ru_nvcsw;
+            total.ru_nivcsw += st.usage.ru_nivcsw;
+        }
+    }
+    
+    if (current_command.timed) {
+        print_time_report(real, total, last_command_stats);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// In-process builtin pipeline stages
+// Builtins that only produce output run on a worker thread that writes into
+// the stage's pipe, instead of forking a whole copy of the shell for them.
+// Builtins that change shell state (cd, export, ...) still fork, so they keep
+// their subshell semantics inside a pipeline.
+// ---------------------------------------------------------------------------
+
+// Output stream buffer that writes to a file descriptor
+// Output is written in BUFFER_SIZE chunks and when the buffer is destroyed;
+// flush()/endl do not force a write, so a builtin printing many short lines
+// costs a handful of write() calls
+class FdOutputBuffer : public streambuf {
+public:
+    explicit FdOutputBuffer(int fd) : fd(fd) {
+        setp(buffer, buffer + BUFFER_SIZE);
+    }
+    
+    ~FdOutputBuffer() override {
+        write_buffer();
+    }
+    
+protected:
+    int overflow(int ch) override {
+        if (write_buffer() < 0) return traits_type::eof();
+        if (ch != traits_type::eof()) {
+            *pptr() = (char)ch;
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+    
+    int sync() override {
+        return 0;
+    }
+    
+private:
+    static const int BUFFER_SIZE = 8192;
+    
+    // Write out everything buffered so far; -1 once the reader has gone away
+    int write_buffer() {
+        char* data = pbase();
+        size_t remaining = pptr() - pbase();
+        while (remaining > 0) {
+            ssize_t n = write(fd, data, remaining);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                setp(buffer, buffer + BUFFER_SIZE);
+                return -1;
             }
+            data += n;
+            remaining -= n;
         }
+        setp(buffer, buffer + BUFFER_SIZE);
+        return 0;
     }
-    else if (command == "bg") {
-        // Continue job in background
-        if (jobs.empty()) {
-            cerr << "bg: no current job" << endl;
-            return true;
-        }
-        
-        Job* job = nullptr;
-        if (args.size() > 1) {
-            // Specific job ID
-            try {
-                int job_id = stoi(args[1]);
-                job = find_job_by_id(job_id);
-                if (!job) {
-                    cerr << "bg: " << job_id << ": no such job" << endl;
-                    return true;
-                }
-            } catch (...) {
-                cerr << "bg: invalid job id" << endl;
-                return true;
-            }
-        } else {
-            // Most recent stopped job
-            for (auto it = jobs.rbegin(); it != jobs.rend(); ++it) {
-                if (it->status == STOPPED) {
-                    job = &(*it);
-                    break;
-                }
-            }
-            if (!job) {
-                cerr << "bg: no stopped jobs" << endl;
-                return true;
-            }
-        }
-        
-        // Send SIGCONT to resume
-        kill(job->pid, SIGCONT);
-        job->status = RUNNING;
-        job->is_background = true;
-        
-        cout << "[" << job->job_id << "]+ " << job->command << " &" << endl;
+    
+    int fd;
+    char buffer[BUFFER_SIZE];
+};
+
+// Builtin stages share the shell's state, so they run one at a time
+mutex builtin_stage_mutex;
+
+// Check whether a builtin pipeline stage can run on a thread in the shell
+// (it only reads shell state and writes output)
+bool builtin_runs_in_thread(const vector<string>& args) {
+    const Builtin* builtin = find_builtin(args[0]);
+    if (builtin == nullptr) return false;
+    if (builtin->flags & BUILTIN_OUTPUT_ONLY) return true;
+    return builtin->output_only != nullptr && builtin->output_only(args);
+}
+
+// Body of a builtin stage's worker thread
+// Writes the builtin's output to out_fd (which it owns and closes) and
+// records the thread's resource usage in stats
+void run_builtin_stage(const vector<string>& args, int in_fd, int out_fd, StageStats& stats) {
+    TraceSpan span("builtin_stage", args[0]);
+    // Writing to a pipe whose reader exited must fail with EPIPE instead of
+    // killing the shell with SIGPIPE
+    sigset_t pipe_mask;
+    sigemptyset(&pipe_mask);
+    sigaddset(&pipe_mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_mask, nullptr);
+    
+    const Builtin& builtin = *find_builtin(args[0]);
+    int exit_status;
+    {
+        // Builtins that only move bytes (fcat) touch no shell state, and may
+        // be reading another builtin's output, so they must not wait for the lock
+        unique_lock<mutex> lock(builtin_stage_mutex, defer_lock);
+        if (!(builtin.flags & BUILTIN_RAW_FDS)) lock.lock();
+        FdOutputBuffer buffer(out_fd);
+        ostream out(&buffer);
+        BuiltinIO io = {in_fd, out_fd, out, true};
+        exit_status = builtin.handler(args, io);
     }
+    if (in_fd >= 0) close(in_fd);
+    close(out_fd);
     
-    return true;  // Was a builtin
+    stats.exit_status = exit_status;
+    stats.real_seconds = chrono::duration<double>(chrono::steady_clock::now() - stats.start).count();
+    getrusage(RUSAGE_THREAD, &stats.usage);
 }
 
 // Execute a pipeline with multiple commands
-void execute_multi_pipeline(const vector<vector<string>>& commands) {
+// redirects[i] (if present) are stage i's redirections; they replace the
+// stage's pipe ends, like in other shells
+void execute_multi_pipeline(const vector<vector<string>>& commands, const vector<vector<Redirection>>& redirects = {}) {
     if (commands.empty()) return;
     
     int num_commands = commands.size();
     
-    // Verify all commands exist (builtins or in PATH)
-    for (const auto& cmd_args : commands) {
+    // Verify all commands exist (builtins or in PATH) and remember their paths
+    vector<string> paths(num_commands);
+    for (int i = 0; i < num_commands; i++) {
+        const auto& cmd_args = commands[i];
         if (cmd_args.empty()) return;
         
         string cmd = cmd_args[0];
         if (!is_builtin(cmd)) {
-            string cmd_path;
-            if (!find_executable_in_path(cmd, cmd_path)) {
+            if (!find_executable_in_path(cmd, paths[i])) {
                 cout << cmd << ": command not found" << endl;
                 return;
             }
@@ -1043,222 +6042,161 @@ void execute_multi_pipeline(const vector<vector<string>>& commands) {
     // Create pipes: we need (num_commands - 1) pipes
     // Each pipe has 2 file descriptors: [0] = read end, [1] = write end
     vector<pair<int, int>> pipes(num_commands - 1);
+    vector<int> pipe_fd_list;
     for (int i = 0; i < num_commands - 1; i++) {
         int pipe_fds[2];
         if (pipe(pipe_fds) < 0) {
             cerr << "Error: Failed to create pipe" << endl;
             // Close previously created pipes
-            for (int j = 0; j < i; j++) {
-                close(pipes[j].first);
-                close(pipes[j].second);
+            for (int fd : pipe_fd_list) {
+                close(fd);
             }
             return;
         }
         pipes[i] = make_pair(pipe_fds[0], pipe_fds[1]);
+        pipe_fd_list.push_back(pipe_fds[0]);
+        pipe_fd_list.push_back(pipe_fds[1]);
     }
     
-    // Fork processes for each command
+    // Launch a process for each command; output-only builtins are deferred
+    // to worker threads below (pid 0 marks a thread stage)
     vector<pid_t> pids;
+    vector<StageStats> stats;
+    vector<pair<int, size_t>> thread_stages;  // (command index, stats index)
+    vector<array<int, 3>> stage_fds(num_commands, {-1, -1, -1});  // Redirection targets per stage
     
     for (int i = 0; i < num_commands; i++) {
-        pid_t pid = fork();
+        const vector<string>& cmd_args = commands[i];
         
-        if (pid < 0) {
-            cerr << "Error: Failed to fork process" << endl;
-            // Clean up pipes
-            for (int j = 0; j < num_commands - 1; j++) {
-                close(pipes[j].first);
-                close(pipes[j].second);
-            }
-            // Wait for already forked processes
-            for (pid_t p : pids) {
-                waitpid(p, nullptr, 0);
-            }
-            return;
+        StageStats stage;
+        for (const auto& arg : cmd_args) {
+            if (!stage.command.empty()) stage.command += " ";
+            stage.command += arg;
         }
+        stage.start = chrono::steady_clock::now();
         
-        if (pid == 0) {
-            // Child process
-            
-            // Set up stdin: read from previous pipe (if not first command)
-            if (i > 0) {
-                dup2(pipes[i - 1].first, 0);
-            }
-            
-            // Set up stdout: write to next pipe (if not last command)
-            if (i < num_commands - 1) {
-                dup2(pipes[i].second, 1);
-            }
-            
-            // Close all pipe file descriptors
-            for (int j = 0; j < num_commands - 1; j++) {
-                close(pipes[j].first);
-                close(pipes[j].second);
-            }
-            
-            // Execute the command
-            const vector<string>& cmd_args = commands[i];
-            
-            // Check if it's a builtin
-            if (is_builtin(cmd_args[0])) {
-                int dummy_position = 0;
-                execute_builtin_in_pipeline(cmd_args, dummy_position);
-                exit(0);
-            }
-            
-            // Prepare arguments for execvp
-            vector<char*> argv;
-            for (int k = 0; k < cmd_args.size(); k++) {
-                argv.push_back((char*)cmd_args[k].c_str());
+        // Open the stage's redirections (the last one for a descriptor wins)
+        bool redirect_failed = false;
+        if (i < (int)redirects.size()) {
+            for (const auto& redirect : redirects[i]) {
+                int target_fd;
+                int fd = open_redirection(redirect, target_fd);
+                if (fd < 0) {
+                    redirect_failed = true;
+                    break;
+                }
+                if (stage_fds[i][target_fd] >= 0) close(stage_fds[i][target_fd]);
+                stage_fds[i][target_fd] = fd;
             }
-            argv.push_back(nullptr);
-            
-            // Execute external command
-            execvp(argv[0], argv.data());
-            
-            // If execvp returns, it failed
-            cerr << cmd_args[0] << ": command not found" << endl;
-            exit(1);
+        }
+        if (redirect_failed) {
+            stage.exit_status = 1;
+            pids.push_back(0);
+            stats.push_back(stage);
+            continue;
         }
         
-        // Parent process: store the pid
-        pids.push_back(pid);
-    }
-    
-    // Parent process: close all pipe file descriptors
-    for (int i = 0; i < num_commands - 1; i++) {
-        close(pipes[i].first);
-        close(pipes[i].second);
-    }
-    
-    // Wait for all children to complete
-    for (pid_t pid : pids) {
-        waitpid(pid, nullptr, 0);
-    }
-}
-
-void execute_pipeline(const vector<string>& cmd1_args, const vector<string>& cmd2_args) {
-    if (cmd1_args.empty() || cmd2_args.empty()) return;
-    
-    // Check if commands are builtins or exist in PATH
-    bool cmd1_is_builtin = is_builtin(cmd1_args[0]);
-    bool cmd2_is_builtin = is_builtin(cmd2_args[0]);
-    
-    string cmd1_path, cmd2_path;
-    if (!cmd1_is_builtin && !find_executable_in_path(cmd1_args[0], cmd1_path)) {
-        cout << cmd1_args[0] << ": command not found" << endl;
-        return;
-    }
-    if (!cmd2_is_builtin && !find_executable_in_path(cmd2_args[0], cmd2_path)) {
-        cout << cmd2_args[0] << ": command not found" << endl;
-        return;
-    }
-    
-    // Create a pipe
-    // pipe_fds[0] is the read end, pipe_fds[1] is the write end
-    int pipe_fds[2];
-    if (pipe(pipe_fds) < 0) {
-        cerr << "Error: Failed to create pipe" << endl;
-        return;
-    }
-    
-    // Fork first command
-    pid_t pid1 = fork();
-    
-    if (pid1 < 0) {
-        cerr << "Error: Failed to fork first process" << endl;
-        close(pipe_fds[0]);
-        close(pipe_fds[1]);
-        return;
-    }
-    
-    if (pid1 == 0) {
-        // First child process - executes first command
-        
-        // Redirect stdout to the write end of the pipe
-        dup2(pipe_fds[1], 1);
+        // A builtin thread writes errors to the shell's stderr, so a stage
+        // with 2> runs in a forked copy instead
+        const Builtin* builtin = find_builtin(cmd_args[0]);
+        if (builtin != nullptr && builtin_runs_in_thread(cmd_args) && stage_fds[i][2] < 0) {
+            thread_stages.push_back({i, stats.size()});
+            pids.push_back(0);
+            stats.push_back(stage);
+            continue;
+        }
         
-        // Close both pipe file descriptors (we have them as stdout now)
-        close(pipe_fds[0]);
-        close(pipe_fds[1]);
+        // Stages stay in the shell's process group, wired to their neighbours
+        LaunchSpec spec;
+        spec.path = paths[i];
+        spec.args = cmd_args;
+        spec.stdin_fd = (stage_fds[i][0] >= 0) ? stage_fds[i][0] : (i > 0) ? pipes[i - 1].first : -1;
+        spec.stdout_fd = (stage_fds[i][1] >= 0) ? stage_fds[i][1] : (i < num_commands - 1) ? pipes[i].second : -1;
+        spec.stderr_fd = stage_fds[i][2];
+        spec.close_fds = pipe_fd_list;
         
-        // Check if it's a builtin
-        if (cmd1_is_builtin) {
-            int dummy_position = 0;
-            execute_builtin_in_pipeline(cmd1_args, dummy_position);
-            exit(0);
+        pid_t pid;
+        if (builtin != nullptr) {
+            // Builtins that change shell state need a copy of the shell: fork fallback
+            pid = fork_process(spec);
+            if (pid == 0) {
+                BuiltinIO io = {STDIN_FILENO, STDOUT_FILENO, cout, true};
+                int status = builtin->handler(cmd_args, io);
+                cout.flush();
+                exit(status);
+            }
+        } else {
+            pid = spawn_hashed_command(spec, cmd_args[0]);
         }
         
-        // Prepare arguments for execvp
-        vector<char*> argv;
-        for (int i = 0; i < cmd1_args.size(); i++) {
-            argv.push_back((char*)cmd1_args[i].c_str());
+        if (pid < 0) {
+            cerr << cmd_args[0] << ": " << strerror(errno) << endl;
+            continue;
         }
-        argv.push_back(nullptr);
         
-        // Execute first command
-        execvp(argv[0], argv.data());
-        
-        // If execvp returns, it failed
-        cerr << cmd1_args[0] << ": command not found" << endl;
-        exit(1);
-    }
-    
-    // Fork second command
-    pid_t pid2 = fork();
-    
-    if (pid2 < 0) {
-        cerr << "Error: Failed to fork second process" << endl;
-        close(pipe_fds[0]);
-        close(pipe_fds[1]);
-        waitpid(pid1, nullptr, 0);
-        return;
+        pids.push_back(pid);
+        stats.push_back(stage);
     }
     
-    if (pid2 == 0) {
-        // Second child process - executes second command
-        
-        // Redirect stdin to the read end of the pipe
-        dup2(pipe_fds[0], 0);
-        
-        // Close both pipe file descriptors (we have them as stdin now)
-        close(pipe_fds[0]);
-        close(pipe_fds[1]);
+    // Start the builtin threads now that no more children will be created,
+    // so their private output descriptors cannot leak into one
+    vector<thread> workers;
+    for (auto [i, stage_index] : thread_stages) {
+        // The thread gets its own copy of the stage's output end and closes it
+        // when done; the parent's copies are closed below as usual
+        int target_fd = (stage_fds[i][1] >= 0) ? stage_fds[i][1] : (i < num_commands - 1) ? pipes[i].second : STDOUT_FILENO;
+        int out_fd = fcntl(target_fd, F_DUPFD_CLOEXEC, 3);
         
-        // Check if it's a builtin
-        if (cmd2_is_builtin) {
-            int dummy_position = 0;
-            execute_builtin_in_pipeline(cmd2_args, dummy_position);
-            exit(0);
+        // Only builtins that move bytes themselves (fcat) read their input;
+        // the others leave the pipe unread
+        bool reads_input = find_builtin(commands[i][0])->flags & BUILTIN_RAW_FDS;
+        int in_fd = -1;
+        if (reads_input) {
+            int source_fd = (stage_fds[i][0] >= 0) ? stage_fds[i][0] : (i > 0) ? pipes[i - 1].first : STDIN_FILENO;
+            in_fd = fcntl(source_fd, F_DUPFD_CLOEXEC, 3);
         }
         
-        // Prepare arguments for execvp
-        vector<char*> argv;
-        for (int i = 0; i < cmd2_args.size(); i++) {
-            argv.push_back((char*)cmd2_args[i].c_str());
+        if (out_fd < 0 || (reads_input && in_fd < 0)) {
+            cerr << commands[i][0] << ": " << strerror(errno) << endl;
+            if (out_fd >= 0) close(out_fd);
+            if (in_fd >= 0) close(in_fd);
+            stats[stage_index].exit_status = 1;
+        } else {
+            workers.emplace_back(run_builtin_stage, cref(commands[i]), in_fd, out_fd, ref(stats[stage_index]));
+        }
+    }
+    
+    // Parent process: close all pipe and redirection file descriptors
+    for (int fd : pipe_fd_list) {
+        close(fd);
+    }
+    for (const auto& fds : stage_fds) {
+        for (int fd : fds) {
+            if (fd >= 0) close(fd);
         }
-        argv.push_back(nullptr);
-        
-        // Execute second command
-        execvp(argv[0], argv.data());
-        
-        // If execvp returns, it failed
-        cerr << cmd2_args[0] << ": command not found" << endl;
-        exit(1);
     }
     
-    // Parent process
-    // Close both ends of the pipe (children have their own copies)
-    close(pipe_fds[0]);
-    close(pipe_fds[1]);
+    // Wait for all children and threads to complete, collecting their status and rusage
+    wait_for_stages(pids, stats);
+    for (auto& worker : workers) {
+        worker.join();
+    }
     
-    // Wait for both children to complete
-    waitpid(pid1, nullptr, 0);
-    waitpid(pid2, nullptr, 0);
+    // The pipeline's status is the status of its last stage
+    if (!stats.empty()) {
+        last_exit_status = stats.back().exit_status;
+    }
+    last_command_stats = stats;
+}
+
+// Execute a pipeline of two commands
+void execute_pipeline(const vector<string>& cmd1_args, const vector<string>& cmd2_args) {
+    if (cmd1_args.empty() || cmd2_args.empty()) return;
+    execute_multi_pipeline({cmd1_args, cmd2_args});
 }
 
-// Execute an external program with arguments and optional output redirection
-void execute_program(const vector<string>& args, const string& stdout_file = "", bool stdout_append = false, const string& stderr_file = "", bool stderr_append = false, bool background = false) {
+// Execute an external program with arguments and optional redirections
+void execute_program(const vector<string>& args, const vector<Redirection>& redirects = {}, bool background = false) {
     if (args.empty()) return;
     
     string command = args[0];
@@ -1266,353 +6204,621 @@ void execute_program(const vector<string>& args, const string& stdout_file = "",
     // Check if command exists in PATH
     string full_path;
     if (!find_executable_in_path(command, full_path)) {
+        // A path that exists but cannot be run says why
+        if (command.find('/') != string::npos && access(command.c_str(), X_OK) != 0 && errno != ENOENT) {
+            cerr << command << ": " << strerror(errno) << endl;
+            last_exit_status = 126;
+            return;
+        }
         cout << command << ": command not found" << endl;
         last_exit_status = 127;  // Command not found
         return;
     }
     
-    // We need to convert vector<string> to char* array for execvp
-    // This is required by the system call (it's old C-style)
-    vector<char*> argv_pointers;
-    for (int i = 0; i < args.size(); i++) {
-        // Get pointer to the string data
-        argv_pointers.push_back((char*)args[i].c_str());
+    LaunchSpec spec;
+    spec.path = full_path;
+    spec.args = args;
+    spec.pgid = job_control ? 0 : -1;  // New process group for job control
+    spec.foreground = !background;
+    
+    // Open redirection targets up front so failures are reported before launch;
+    // a later redirection of the same descriptor replaces an earlier one
+    int* spec_fds[3] = {&spec.stdin_fd, &spec.stdout_fd, &spec.stderr_fd};
+    for (const auto& redirect : redirects) {
+        int target_fd;
+        int fd = open_redirection(redirect, target_fd);
+        if (fd < 0) {
+            for (int* spec_fd : spec_fds) {
+                if (*spec_fd >= 0) close(*spec_fd);
+            }
+            last_exit_status = 1;
+            return;
+        }
+        if (*spec_fds[target_fd] >= 0) close(*spec_fds[target_fd]);
+        *spec_fds[target_fd] = fd;
     }
-    // execvp needs NULL at the end
-    argv_pointers.push_back(nullptr);
     
-    // Create a child process using fork
-    pid_t process_id = fork();
+    pid_t process_id = spawn_hashed_command(spec, command);
+    int spawn_errno = errno;
+    
+    // The child has its own copies of the redirection targets now
+    if (spec.stdout_fd >= 0) close(spec.stdout_fd);
+    if (spec.stderr_fd >= 0) close(spec.stderr_fd);
+    if (spec.stdin_fd >= 0) close(spec.stdin_fd);
     
     if (process_id < 0) {
-        // Fork failed
-        cerr << "Error: Failed to create process" << endl;
+        if (spawn_errno == ENOENT) {
+            // Not found anywhere along PATH either
+            cerr << command << ": command not found" << endl;
+            last_exit_status = 127;
+        } else {
+            // Found but not runnable (permission denied, bad binary, ...)
+            cerr << command << ": " << strerror(spawn_errno) << endl;
+            last_exit_status = 126;
+        }
         return;
     }
     
-    if (process_id == 0) {
-        // This code runs in the CHILD process
-        
-        // Create new process group for job control
-        setpgid(0, 0);
-        
-        // If not background, give terminal control to child
-        if (!background) {
-            tcsetpgrp(STDIN_FILENO, getpid());
-            // Reset signal handlers
-            signal(SIGINT, SIG_DFL);
-            signal(SIGTSTP, SIG_DFL);
+    // Also set the group from the parent to avoid racing the child
+    if (job_control) setpgid(process_id, process_id);
+    
+    if (background) {
+        // Background job - don't wait
+        string cmd_str;
+        for (const auto& arg : args) {
+            if (!cmd_str.empty()) cmd_str += " ";
+            cmd_str += arg;
         }
+        int job_id = add_job(process_id, cmd_str, true);
+        cout << "[" << job_id << "] " << process_id << endl;
+        last_exit_status = 0;
+    } else {
+        // Foreground job - wait for it
+        foreground_pgid = process_id;
+        if (job_control) tcsetpgrp(STDIN_FILENO, process_id);
         
-        // If stdout redirection is specified, redirect stdout to file
-        if (!stdout_file.empty()) {
-            // Open file for writing
-            // O_APPEND to append, O_TRUNC to overwrite
-            int flags = O_WRONLY | O_CREAT | (stdout_append ? O_APPEND : O_TRUNC);
-            int file_fd = open(stdout_file.c_str(), flags, 0644);
-            
-            if (file_fd < 0) {
-                cerr << "Error: Cannot open file " << stdout_file << endl;
-                exit(1);
-            }
-            
-            // Redirect stdout (file descriptor 1) to the file
-            dup2(file_fd, 1);
-            
-            // Close the file descriptor (we already have it as stdout now)
-            close(file_fd);
-        }
+        StageStats stage;
+        stage.command = command;
+        stage.start = chrono::steady_clock::now();
         
-        // If stderr redirection is specified, redirect stderr to file
-        if (!stderr_file.empty()) {
-            // Open file for writing
-            // O_APPEND to append, O_TRUNC to overwrite
-            int flags = O_WRONLY | O_CREAT | (stderr_append ? O_APPEND : O_TRUNC);
-            int file_fd = open(stderr_file.c_str(), flags, 0644);
-            
-            if (file_fd < 0) {
-                cerr << "Error: Cannot open file " << stderr_file << endl;
-                exit(1);
-            }
-            
-            // Redirect stderr (file descriptor 2) to the file
-            dup2(file_fd, 2);
-            
-            // Close the file descriptor (we already have it as stderr now)
-            close(file_fd);
+        int status = 0;
+        if (!wait_for_child(process_id, status, &stage.usage)) {
+            status = 1 << 8;  // Lost the child: report exit status 1
         }
+        stage.real_seconds = chrono::duration<double>(chrono::steady_clock::now() - stage.start).count();
         
-        // Replace child process with the new program
-        execvp(argv_pointers[0], argv_pointers.data());
-        
-        // If execvp returns, it means it failed
-        cerr << command << ": command not found" << endl;
-        exit(1);
-    } 
-    else {
-        // This code runs in the PARENT process
-        setpgid(process_id, process_id);
+        // Give terminal back to shell
+        if (job_control) tcsetpgrp(STDIN_FILENO, getpgrp());
+        foreground_pgid = 0;
         
-        if (background) {
-            // Background job - don't wait
+        // Update exit status
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            last_exit_status = status_to_exit_code(status);
+            stage.exit_status = last_exit_status;
+            last_command_stats = {stage};
+        } else if (WIFSTOPPED(status)) {
+            // Job was stopped (Ctrl+Z)
             string cmd_str;
             for (const auto& arg : args) {
                 if (!cmd_str.empty()) cmd_str += " ";
                 cmd_str += arg;
             }
-            int job_id = add_job(process_id, cmd_str, true);
-            cout << "[" << job_id << "] " << process_id << endl;
+            int job_id = add_job(process_id, cmd_str, false);
+            find_job_by_pid(process_id)->status = STOPPED;
+            cout << "\n[" << job_id << "]+ Stopped\t" << cmd_str << endl;
             last_exit_status = 0;
         } else {
-            // Foreground job - wait for it
-            foreground_pgid = process_id;
-            tcsetpgrp(STDIN_FILENO, process_id);
-            
-            int status;
-            waitpid(process_id, &status, WUNTRACED);
-            
-            // Give terminal back to shell
-            tcsetpgrp(STDIN_FILENO, getpgrp());
-            foreground_pgid = 0;
-            
-            // Update exit status
-            if (WIFEXITED(status)) {
-                last_exit_status = WEXITSTATUS(status);
-            } else if (WIFSIGNALED(status)) {
-                last_exit_status = 128 + WTERMSIG(status);
-            } else if (WIFSTOPPED(status)) {
-                // Job was stopped (Ctrl+Z)
-                string cmd_str;
-                for (const auto& arg : args) {
-                    if (!cmd_str.empty()) cmd_str += " ";
-                    cmd_str += arg;
-                }
-                int job_id = add_job(process_id, cmd_str, false);
-                cout << "\n[" << job_id << "]+ Stopped\t" << cmd_str << endl;
-                last_exit_status = 0;
-            } else {
-                last_exit_status = 1;  // Abnormal termination
-            }
+            last_exit_status = 1;  // Abnormal termination
         }
     }
 }
 
-// Completion generator function for readline
-// This function is called repeatedly to generate matches
-char* command_generator(const char* text, int state) {
-    // List of builtin commands to autocomplete
-    static vector<string> builtin_commands = {"echo", "exit"};
-    static vector<string> all_commands;
-    static int list_index;
-    static int len;
+// ---------------------------------------------------------------------------
+// Command catalog for tab completion
+// A sorted, deduplicated list of builtins and PATH executables. Each PATH
+// directory keeps its own scan result and is only re-read when its mtime
+// changes, so a Tab press costs one stat() per PATH directory plus a binary
+// search, independent of how many files the directories hold.
+// ---------------------------------------------------------------------------
+
+// Executables found in one PATH directory
+struct CatalogDir {
+    string path;
+    struct timespec mtime = {0, 0};
+    bool scanned = false;
+    vector<string> executables;
+};
+
+struct CommandCatalog {
+    string path_env;          // $PATH the directory list was built from
+    vector<CatalogDir> dirs;  // One entry per PATH directory, in PATH order
+    vector<string> names;     // Sorted, unique builtins + executables
+    bool dirty = true;        // names must be rebuilt from dirs
+};
+
+CommandCatalog command_catalog;
+
+// Read the executables of one directory
+void scan_catalog_dir(CatalogDir& dir) {
+    dir.executables.clear();
+    dir.scanned = true;
     
-    // If this is a new word to complete, initialize
-    if (state == 0) {
-        list_index = 0;
-        len = strlen(text);
-        all_commands.clear();
+    DIR* d = opendir(dir.path.c_str());
+    if (d == nullptr) return;
+    
+    int dir_fd = dirfd(d);
+    struct dirent* entry;
+    while ((entry = readdir(d)) != nullptr) {
+        const char* name = entry->d_name;
         
-        // Add builtin commands that match
-        for (const auto& cmd : builtin_commands) {
-            if (cmd.substr(0, len) == text) {
-                all_commands.push_back(cmd);
-            }
+        // Skip . and .. and anything that cannot be a command
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+        if (entry->d_type == DT_DIR) continue;
+        
+        if (faccessat(dir_fd, name, X_OK, 0) == 0) {
+            dir.executables.push_back(name);
         }
+    }
+    closedir(d);
+}
+
+// Bring the catalog up to date with $PATH and the directories' mtimes
+void refresh_command_catalog() {
+    string path_env = variable_value("PATH");
+    
+    // PATH changed: rebuild the directory list, reusing scans we already have
+    if (path_env != command_catalog.path_env) {
+        vector<CatalogDir> old_dirs;
+        old_dirs.swap(command_catalog.dirs);
         
-        // Search for executables in PATH
-        const char* path_ptr = getenv("PATH");
-        if (path_ptr != nullptr) {
-            string path_env = string(path_ptr);
-            stringstream ss(path_env);
-            string directory;
+        stringstream ss(path_env);
+        string directory;
+        while (getline(ss, directory, ':')) {
+            if (directory.empty()) continue;
             
-            // Split PATH by ':' and check each directory
-            while (getline(ss, directory, ':')) {
-                if (directory.empty()) continue;
-                
-                // Open directory to list files
-                DIR* dir = opendir(directory.c_str());
-                if (dir == nullptr) continue;
-                
-                struct dirent* entry;
-                while ((entry = readdir(dir)) != nullptr) {
-                    string filename = entry->d_name;
-                    
-                    // Skip . and ..
-                    if (filename == "." || filename == "..") continue;
-                    
-                    // Check if filename starts with the text
-                    if (filename.substr(0, len) == text) {
-                        // Build full path
-                        string full_path = directory + "/" + filename;
-                        
-                        // Check if it's executable
-                        if (access(full_path.c_str(), X_OK) == 0) {
-                            // Check if not already in the list (avoid duplicates)
-                            bool already_added = false;
-                            for (const auto& cmd : all_commands) {
-                                if (cmd == filename) {
-                                    already_added = true;
-                                    break;
-                                }
-                            }
-                            if (!already_added) {
-                                all_commands.push_back(filename);
-                            }
-                        }
-                    }
+            CatalogDir dir;
+            dir.path = directory;
+            for (auto& old : old_dirs) {
+                if (old.path == directory && old.scanned) {
+                    dir = old;
+                    break;
                 }
-                closedir(dir);
             }
+            command_catalog.dirs.push_back(dir);
+        }
+        command_catalog.path_env = path_env;
+        command_catalog.dirty = true;
+    }
+    
+    // Re-read only the directories whose contents changed
+    for (auto& dir : command_catalog.dirs) {
+        struct timespec mtime = {0, 0};
+        struct stat st;
+        if (stat(dir.path.c_str(), &st) == 0) {
+            mtime = st.st_mtim;
         }
+        if (!dir.scanned || mtime.tv_sec != dir.mtime.tv_sec || mtime.tv_nsec != dir.mtime.tv_nsec) {
+            dir.mtime = mtime;
+            scan_catalog_dir(dir);
+            command_catalog.dirty = true;
+        }
+    }
+    
+    if (!command_catalog.dirty) return;
+    
+    // Merge everything into one sorted, unique list
+    vector<string>& names = command_catalog.names;
+    names.clear();
+    for (const auto& builtin : builtin_table) {
+        names.push_back(builtin.name);
+    }
+    for (const auto& dir : command_catalog.dirs) {
+        names.insert(names.end(), dir.executables.begin(), dir.executables.end());
+    }
+    sort(names.begin(), names.end());
+    names.erase(unique(names.begin(), names.end()), names.end());
+    command_catalog.dirty = false;
+}
+
+// Find the catalog entries starting with prefix
+// Sets [first, last) to the matching index range
+void catalog_prefix_range(const string& prefix, size_t& first, size_t& last) {
+    const vector<string>& names = command_catalog.names;
+    auto begin = lower_bound(names.begin(), names.end(), prefix);
+    auto end = begin;
+    while (end != names.end() && end->compare(0, prefix.size(), prefix) == 0) {
+        ++end;
+    }
+    first = begin - names.begin();
+    last = end - names.begin();
+}
+
+// Completion generator function for readline
+// This function is called repeatedly to generate matches
+char* command_generator(const char* text, int state) {
+    static size_t list_index;
+    static size_t list_end;
+    
+    // If this is a new word to complete, look up the matching range
+    if (state == 0) {
+        refresh_command_catalog();
+        catalog_prefix_range(text, list_index, list_end);
     }
     
     // Return the next match
-    if (list_index < all_commands.size()) {
-        string command = all_commands[list_index];
-        list_index++;
-        return strdup(command.c_str());
+    if (list_index < list_end) {
+        return strdup(command_catalog.names[list_index++].c_str());
     }
     
     // No more matches
     return nullptr;
 }
 
-// Completion function for readline
-char** command_completion(const char* text, int start, int end) {
-    // Don't use default filename completion
-    rl_attempted_completion_over = 1;
-    
-    // If we're at the start of the line, complete command names
-    if (start == 0) {
-        return rl_completion_matches(text, command_generator);
-    }
-    
-    // Otherwise, no completion
-    return nullptr;
+// Catalog entries starting with prefix (argument completion hook for
+// builtins that take a command, like type and hash)
+void complete_command_names(const string& prefix, vector<string>& matches) {
+    refresh_command_catalog();
+    size_t first, last;
+    catalog_prefix_range(prefix, first, last);
+    matches.insert(matches.end(), command_catalog.names.begin() + first, command_catalog.names.begin() + last);
+}
+
+// Matches from a builtin's completion hook, served by argument_generator
+vector<string> argument_matches;
+
+char* argument_generator(const char* text, int state) {
+    static size_t list_index;
+    if (state == 0) list_index = 0;
+    if (list_index < argument_matches.size()) {
+        return strdup(argument_matches[list_index++].c_str());
+    }
+    return nullptr;
+}
+
+// Completion function for readline
+char** command_completion(const char* text, int start, int end) {
+    // Find the start of the current command (after the last |, ; or &)
+    size_t segment = 0;
+    for (int i = 0; i < start; i++) {
+        char c = rl_line_buffer[i];
+        if (c == '|' || c == ';' || c == '&') segment = i + 1;
+    }
+    while (segment < (size_t)start && isspace((unsigned char)rl_line_buffer[segment])) segment++;
+    
+    // In command position, complete command names
+    if (segment == (size_t)start) {
+        rl_attempted_completion_over = 1;
+        return rl_completion_matches(text, command_generator);
+    }
+    
+    // Arguments of a builtin with a completion hook come from the hook
+    size_t word_end = segment;
+    while (word_end < (size_t)start && !isspace((unsigned char)rl_line_buffer[word_end])) word_end++;
+    const Builtin* builtin = find_builtin(string_view(rl_line_buffer + segment, word_end - segment));
+    if (builtin != nullptr && builtin->complete != nullptr) {
+        rl_attempted_completion_over = 1;
+        argument_matches.clear();
+        builtin->complete(text, argument_matches);
+        return rl_completion_matches(text, argument_generator);
+    }
+    
+    // Anything else: readline's filename completion
+    rl_attempted_completion_over = 0;
+    return nullptr;
+}
+
+// Check if a line is a variable assignment (VAR=value)
+bool is_variable_assignment(const string& line, string& var_name, string& var_value) {
+    size_t eq_pos = line.find('=');
+    if (eq_pos == string::npos || eq_pos == 0) {
+        return false;
+    }
+    
+    // Check if left side is valid variable name (alphanumeric + underscore)
+    for (size_t i = 0; i < eq_pos; i++) {
+        if (!isalnum(line[i]) && line[i] != '_') {
+            return false;
+        }
+    }
+    
+    var_name = line.substr(0, eq_pos);
+    var_value = line.substr(eq_pos + 1);
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Batch input
+// Scripts, -c strings and non-terminal stdin are read without readline,
+// history or terminal setup. A script file or -c string is read in one go.
+// Stdin is shared with the commands being run, so they must find its
+// offset at the end of the current line: a seekable stdin is read in large
+// blocks and the offset moved back only before running a command that could
+// read stdin (batch_sync_input), a pipe is read a byte at a time (as
+// readline and other shells do).
+// ---------------------------------------------------------------------------
+
+struct BatchReader {
+    int fd = -1;          // Shared stdin, or -1 when buffer holds everything
+    bool seekable = false;
+    string buffer;        // For a seekable stdin: read ahead of pos
+    size_t pos = 0;
+};
+
+// Size of the blocks read from a seekable stdin
+const size_t BATCH_READ_BLOCK = 64 * 1024;
+
+// Get the next line (without its newline); false at end of input
+bool batch_read_line(BatchReader& reader, string& line) {
+    if (reader.fd < 0 || reader.seekable) {
+        size_t newline = reader.buffer.find('\n', reader.pos);
+        while (newline == string::npos && reader.fd >= 0) {
+            // Keep the unread tail and read another block after it
+            reader.buffer.erase(0, reader.pos);
+            reader.pos = 0;
+            size_t searched = reader.buffer.size();
+            reader.buffer.resize(searched + BATCH_READ_BLOCK);
+            ssize_t n;
+            do {
+                n = read(reader.fd, &reader.buffer[searched], BATCH_READ_BLOCK);
+            } while (n < 0 && errno == EINTR);
+            reader.buffer.resize(searched + max<ssize_t>(n, 0));
+            if (n <= 0) break;
+            newline = reader.buffer.find('\n', searched);
+        }
+        if (reader.pos >= reader.buffer.size()) return false;
+        if (newline == string::npos) newline = reader.buffer.size();
+        line.assign(reader.buffer, reader.pos, newline - reader.pos);
+        reader.pos = min(newline + 1, reader.buffer.size());
+        return true;
+    }
+    
+    line.clear();
+    char c;
+    while (true) {
+        ssize_t n = read(reader.fd, &c, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return !line.empty();
+        if (c == '\n') return true;
+        line += c;
+    }
+}
+
+// Move a seekable stdin's offset back to the end of the current line, so
+// the command about to run reads what follows it
+void batch_sync_input(BatchReader& reader) {
+    if (reader.fd < 0 || !reader.seekable) return;
+    off_t ahead = reader.buffer.size() - reader.pos;
+    if (ahead > 0) lseek(reader.fd, -ahead, SEEK_CUR);
+    reader.buffer.clear();
+    reader.pos = 0;
+}
+
+// Whether a command's stdin comes from one of its redirections
+bool redirects_stdin(const vector<Redirection>& redirects) {
+    for (const auto& redirect : redirects) {
+        if (redirect.op[0] == '<') return true;
+    }
+    return false;
+}
+
+// Read the body of a here-document from the lines after the command:
+// from the prompt "> " when interactive, otherwise from the script. Ends at
+// a line equal to the delimiter (after leading tabs are stripped, for <<-)
+string read_here_document(const HereDocSpec& spec, bool interactive, BatchReader& batch) {
+    string body;
+    string line;
+    while (true) {
+        if (interactive) {
+            char* line_ptr = readline("> ");
+            if (line_ptr == nullptr) break;
+            line = line_ptr;
+            free(line_ptr);
+        } else if (!batch_read_line(batch, line)) {
+            break;
+        }
+        
+        if (spec.strip_tabs) line.erase(0, line.find_first_not_of('\t'));
+        if (line == spec.delimiter) return body;
+        body += line;
+        body += '\n';
+    }
+    cerr << "warning: here-document delimited by end-of-file (wanted '" << spec.delimiter << "')" << endl;
+    return body;
+}
+
+// Set $0, $1, ... and $# for a script or -c string
+void set_positional_parameters(const vector<string>& params) {
+    for (size_t i = 0; i < params.size(); i++) {
+        set_variable(to_string(i), params[i]);
+    }
+    set_variable("#", to_string(params.empty() ? 0 : params.size() - 1));
+}
+
+// ---------------------------------------------------------------------------
+// Startup profile and deferred initialization
+// Only what the first prompt needs runs before it: the rest (the command
+// catalog for completion; bookmarks load on first use) is done while
+// readline sits idle after the prompt is shown. `--startup-profile` prints
+// the time spent in each startup step to stderr once the prompt is up.
+// ---------------------------------------------------------------------------
+
+bool startup_profile = false;
+
+// Static initialization is the earliest point the shell can time from
+const chrono::steady_clock::time_point startup_begin = chrono::steady_clock::now();
+chrono::steady_clock::time_point startup_last_mark = startup_begin;
+vector<pair<const char*, double>> startup_steps;  // (step, milliseconds)
+
+// Close the current startup step (from the previous mark to now)
+void startup_mark(const char* step) {
+    if (!startup_profile) return;
+    auto now = chrono::steady_clock::now();
+    startup_steps.push_back({step, chrono::duration<double, milli>(now - startup_last_mark).count()});
+    startup_last_mark = now;
+}
+
+void print_startup_profile() {
+    if (!startup_profile) return;
+    startup_profile = false;  // Once
+    double total = chrono::duration<double, milli>(startup_last_mark - startup_begin).count();
+    cerr << COLOR_CYAN << "Startup profile:" << COLOR_RESET << endl;
+    for (const auto& [step, ms] : startup_steps) {
+        cerr << "  " << left << setw(22) << step << right << fixed << setprecision(3) << setw(9) << ms << " ms" << endl;
+    }
+    cerr << "  " << left << setw(22) << "total" << right << fixed << setprecision(3) << setw(9) << total << " ms" << endl;
+    cerr.unsetf(ios::floatfield);
+    cerr << setprecision(6);
+}
+
+// readline calls this just before it prints the first prompt
+int startup_prompt_hook() {
+    startup_mark("readline init");
+    print_startup_profile();
+    rl_startup_hook = nullptr;
+    return 0;
+}
+
+// readline calls this while waiting for input (after ~0.1s without a key):
+// do the deferred work once, then stop being called
+int deferred_init_hook() {
+    TraceSpan span("deferred_init");
+    refresh_command_catalog();
+    rl_event_hook = nullptr;
+    return 0;
 }
 
-// Check if a line is a variable assignment (VAR=value)
-bool is_variable_assignment(const string& line, string& var_name, string& var_value) {
-    size_t eq_pos = line.find('=');
-    if (eq_pos == string::npos || eq_pos == 0) {
-        return false;
+int shell_main(int argc, char* argv[]) {
+    // --startup-profile: report the startup steps (the flag is dropped from argv)
+    if (argc >= 2 && string(argv[1]) == "--startup-profile") {
+        startup_profile = true;
+        argv[1] = argv[0];
+        argv++;
+        argc--;
     }
+    startup_mark("static init");
     
-    // Check if left side is valid variable name (alphanumeric + underscore)
-    for (size_t i = 0; i < eq_pos; i++) {
-        if (!isalnum(line[i]) && line[i] != '_') {
-            return false;
-        }
-    }
+    // Variables start out as the inherited environment
+    import_environment();
+    startup_mark("environment");
     
-    var_name = line.substr(0, eq_pos);
-    var_value = line.substr(eq_pos + 1);
-    return true;
-}
-
-// Split command line by logical operators (&&, ||, ;)
-// Returns pairs of (command_string, operator_before_it)
-vector<pair<string, string>> split_by_logical_operators(const string& line) {
-    vector<pair<string, string>> commands;
-    string current_cmd = "";
-    string last_operator = "";  // Operator before the current command
-    
-    int i = 0;
-    while (i < line.length()) {
-        if (i + 1 < line.length() && line.substr(i, 2) == "&&") {
-            // Found &&
-            if (!current_cmd.empty()) {
-                commands.push_back({current_cmd, last_operator});
-                current_cmd = "";
-            }
-            last_operator = "&&";
-            i += 2;
-        } else if (i + 1 < line.length() && line.substr(i, 2) == "||") {
-            // Found ||
-            if (!current_cmd.empty()) {
-                commands.push_back({current_cmd, last_operator});
-                current_cmd = "";
-            }
-            last_operator = "||";
-            i += 2;
-        } else if (line[i] == ';') {
-            // Found ;
-            if (!current_cmd.empty()) {
-                commands.push_back({current_cmd, last_operator});
-                current_cmd = "";
-            }
-            last_operator = ";";
-            i++;
-        } else {
-            current_cmd += line[i];
-            i++;
-        }
+    // $SHELL_TRACE=1 traces from startup; any other value (except 0) is a
+    // file the trace is written to on exit
+    const char* trace_setting = getenv("SHELL_TRACE");
+    if (trace_setting != nullptr && *trace_setting != '\0' && strcmp(trace_setting, "0") != 0) {
+        trace_enabled = true;
+        if (strcmp(trace_setting, "1") != 0) trace_exit_file = trace_setting;
     }
     
-    // Add the last command
-    if (!current_cmd.empty()) {
-        commands.push_back({current_cmd, last_operator});
+    // Batch mode: `shell -c 'commands' [name [args...]]`, `shell script [args...]`
+    // or commands piped/redirected into stdin
+    BatchReader batch;
+    bool interactive = false;
+    if (argc >= 2 && string(argv[1]) == "-c") {
+        if (argc < 3) {
+            cerr << argv[0] << ": -c: option requires an argument" << endl;
+            return 2;
+        }
+        batch.buffer = argv[2];
+        vector<string> params = {argc >= 4 ? argv[3] : argv[0]};
+        for (int i = 4; i < argc; i++) params.push_back(argv[i]);
+        set_positional_parameters(params);
+    } else if (argc >= 2) {
+        if (!read_file(argv[1], batch.buffer)) {
+            cerr << argv[0] << ": " << argv[1] << ": " << strerror(errno) << endl;
+            return 127;
+        }
+        set_positional_parameters(vector<string>(argv + 1, argv + argc));
+    } else if (!isatty(STDIN_FILENO)) {
+        batch.fd = STDIN_FILENO;
+        batch.seekable = lseek(STDIN_FILENO, 0, SEEK_CUR) >= 0;
+    } else {
+        interactive = true;
     }
+    job_control = interactive;
+    startup_mark("arguments");
     
-    return commands;
-}
-
-int main() {
     // Enable automatic flushing of output
     cout << unitbuf;
     cerr << unitbuf;
     
     // Setup signal handlers for job control
     setup_signals();
+    startup_mark("signals");
     
-    // Put shell in its own process group
-    setpgid(0, 0);
-    
-    // Take control of terminal
-    tcsetpgrp(STDIN_FILENO, getpgrp());
-    
-    // Set up readline completion
-    rl_attempted_completion_function = command_completion;
-    
-    // Load history from HISTFILE if the environment variable is set
-    const char* histfile = getenv("HISTFILE");
-    if (histfile != nullptr) {
-        // Load history from the file (ignore errors if file doesn't exist)
-        custom_read_history(histfile);
+    if (interactive) {
+        // Put shell in its own process group
+        setpgid(0, 0);
+        
+        // Take control of terminal
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+        startup_mark("terminal");
+        
+        // Set up readline completion
+        rl_attempted_completion_function = command_completion;
+        
+        // Keep readline from setenv()ing LINES/COLUMNS behind the variable table
+        rl_change_environment = 0;
+        
+        // Map history from HISTFILE if the environment variable is set
+        // (entries are read lazily; a missing file just means no history yet)
+        const string* histfile = find_variable("HISTFILE");
+        if (histfile != nullptr) {
+            history_store_open(histfile->c_str());
+        }
+        startup_mark("history map");
+        install_history_navigation();
+        startup_mark("key bindings");
+        
+        // cd and jump feed the directory database
+        dir_tracking = true;
+        
+        // Bookmarks load on first use; completion data once the prompt is idle
+        rl_event_hook = deferred_init_hook;
+        rl_startup_hook = startup_prompt_hook;
+    } else {
+        // Batch mode has no prompt: report before the first command
+        print_startup_profile();
     }
     
-    // Load bookmarks from file
-    load_bookmarks();
-    
-    // Track the history position for append operations
-    int last_appended_position = 0;
-    
     // Flag to exit the shell
     bool should_exit = false;
     
     // Main shell loop
     while (true) {
-        // Read a line of input using readline (handles tab completion)
-        char* line_ptr = readline("$ ");
-        
-        // Check if EOF (Ctrl+D)
-        if (line_ptr == nullptr) {
-            cout << endl;
-            break;
-        }
-        
-        // Convert to C++ string
-        string line(line_ptr);
-        
-        // Add to history if line is not empty
-        if (!line.empty()) {
-            add_history(line_ptr);
+        string line;
+        if (!interactive) {
+            // Batch mode: no prompt, editing or history
+            if (!batch_read_line(batch, line)) break;
+        } else {
+            // Read a line of input using readline (handles tab completion)
+            history_nav_position = -1;
+            history_store_refresh();
+            notify_job_changes();
+            char* line_ptr;
+            {
+                TraceSpan span("readline");
+                line_ptr = readline("$ ");
+            }
+            
+            // Check if EOF (Ctrl+D)
+            if (line_ptr == nullptr) {
+                cout << endl;
+                break;
+            }
+            
+            // Convert to C++ string
+            line = line_ptr;
+            
+            // Add to history if line is not empty
+            if (!line.empty()) {
+                add_history(line_ptr);
+                history_store_append(line);
+            }
+            
+            // Free the memory allocated by readline
+            free(line_ptr);
         }
         
-        // Free the memory allocated by readline
-        free(line_ptr);
-        
         // Skip empty lines and comments
         if (line.empty() || line[0] == '#') continue;
         
@@ -1621,147 +6827,78 @@ int main() {
         if (is_variable_assignment(line, var_name, var_value)) {
             // Expand variables in the value
             var_value = expand_variables(var_value);
-            shell_variables[var_name] = var_value;
+            set_variable(var_name, var_value);
             last_exit_status = 0;
             continue;
         }
         
-        // Split by logical operators (&&, ||, ;)
-        vector<pair<string, string>> command_chain = split_by_logical_operators(line);
+        // Compile the line (or reuse its cached plan); commands in the chain
+        // run according to the operator before them
+        shared_ptr<const CommandPlan> plan = get_command_plan(line);
+        
+        // Here-document bodies follow the line, in the order of their operators
+        vector<string> here_doc_bodies;
+        for (const HereDocSpec& spec : plan->here_docs) {
+            here_doc_bodies.push_back(read_here_document(spec, interactive, batch));
+        }
         
         // Execute each command in the chain
-        for (const auto& cmd_pair : command_chain) {
-            string cmd_line = cmd_pair.first;
-            string operator_before = cmd_pair.second;
+        for (const PlanCommand& plan_command : plan->commands) {
+            // Wrap up the previous command (PIPESTATUS, time report)
+            finish_command();
             
             // Check if we should skip this command based on previous exit status
-            if (operator_before == "&&" && last_exit_status != 0) {
+            if (plan_command.operator_before == TOKEN_AND && last_exit_status != 0) {
                 continue;  // Skip because previous command failed
             }
-            if (operator_before == "||" && last_exit_status == 0) {
+            if (plan_command.operator_before == TOKEN_OR && last_exit_status == 0) {
                 continue;  // Skip because previous command succeeded
             }
             
-            // Parse the command line with quote support
-            vector<string> tokens = parse_command_line(cmd_line);
-            
-            // Skip empty commands
-            if (tokens.empty()) continue;
-            
-            // Expand variables in all tokens (except in single quotes - handled in parse)
-            vector<string> expanded_tokens;
-            for (const auto& token : tokens) {
-                // Expand variables
-                string expanded = expand_variables(token);
-                
-                // Check if token contains wildcards (* or ?)
-                if (expanded.find('*') != string::npos || expanded.find('?') != string::npos) {
-                    // Expand wildcards
-                    vector<string> matches = expand_wildcards(expanded);
-                    expanded_tokens.insert(expanded_tokens.end(), matches.begin(), matches.end());
-                } else {
-                    expanded_tokens.push_back(expanded);
-                }
+            // `time`/`timer` prefix: report resource usage once the command finishes
+            if (plan_command.timed && plan_command.stages.empty()) {
+                cout << COLOR_YELLOW << "Usage: time <command>" << COLOR_RESET << endl;
+                continue;
             }
             
-            tokens = expanded_tokens;
-        
-        // Check for pipeline (|) - support multiple pipes
-        vector<int> pipe_indices;
-        for (int i = 0; i < tokens.size(); i++) {
-            if (tokens[i] == "|") {
-                pipe_indices.push_back(i);
-            }
-        }
+            // Skip empty commands
+            if (plan_command.stages.empty()) continue;
+            begin_command(plan_command.timed);
+            glob_cache_clear();
+            TraceSpan command_span("command", line);
         
-        // If pipeline exists, handle it separately
-        if (!pipe_indices.empty()) {
-            // Split tokens into multiple commands
+        // Pipelines: expand each stage's words
+        if (plan_command.pipeline) {
             vector<vector<string>> pipeline_commands;
-            int start = 0;
-            
-            for (int pipe_idx : pipe_indices) {
-                vector<string> cmd_tokens;
-                for (int i = start; i < pipe_idx; i++) {
-                    cmd_tokens.push_back(tokens[i]);
-                }
+            vector<vector<Redirection>> pipeline_redirects;
+            for (const auto& stage : plan_command.stages) {
+                vector<string> cmd_tokens = expand_stage_words(stage);
                 if (!cmd_tokens.empty()) {
+                    vector<Redirection> stage_redirects;
+                    for (const auto& redirect : stage.redirects) {
+                        stage_redirects.push_back(expand_redirect(redirect, *plan, here_doc_bodies));
+                    }
                     pipeline_commands.push_back(cmd_tokens);
+                    pipeline_redirects.push_back(stage_redirects);
                 }
-                start = pipe_idx + 1;
-            }
-            
-            // Add the last command after the final pipe
-            vector<string> last_cmd_tokens;
-            for (int i = start; i < tokens.size(); i++) {
-                last_cmd_tokens.push_back(tokens[i]);
-            }
-            if (!last_cmd_tokens.empty()) {
-                pipeline_commands.push_back(last_cmd_tokens);
             }
             
             // Execute multi-command pipeline
             if (pipeline_commands.size() >= 2) {
-                execute_multi_pipeline(pipeline_commands);
+                if (!redirects_stdin(pipeline_redirects[0])) batch_sync_input(batch);
+                execute_multi_pipeline(pipeline_commands, pipeline_redirects);
             }
             continue;
         }
         
-        // Check for output redirection (>, 1>, >>, 1>>), error redirection (2>, 2>>), and background (&)
-        string stdout_file = "";
-        bool stdout_append = false;
-        string stderr_file = "";
-        bool stderr_append = false;
-        bool background = false;
-        vector<string> command_tokens;
-        
-        // Check for '&' at the end (background execution)
-        if (!tokens.empty() && tokens.back() == "&") {
-            background = true;
-            tokens.pop_back();  // Remove the '&'
-        }
-        
-        for (int i = 0; i < tokens.size(); i++) {
-            // Check if token is >> or 1>> (stdout append)
-            if (tokens[i] == ">>" || tokens[i] == "1>>") {
-                // Next token should be the filename
-                if (i + 1 < tokens.size()) {
-                    stdout_file = tokens[i + 1];
-                    stdout_append = true;
-                    i++;  // Skip the filename in next iteration
-                }
-            }
-            // Check if token is > or 1> (stdout redirection)
-            else if (tokens[i] == ">" || tokens[i] == "1>") {
-                // Next token should be the filename
-                if (i + 1 < tokens.size()) {
-                    stdout_file = tokens[i + 1];
-                    stdout_append = false;
-                    i++;  // Skip the filename in next iteration
-                }
-            }
-            // Check if token is 2>> (stderr append)
-            else if (tokens[i] == "2>>") {
-                // Next token should be the filename
-                if (i + 1 < tokens.size()) {
-                    stderr_file = tokens[i + 1];
-                    stderr_append = true;
-                    i++;  // Skip the filename in next iteration
-                }
-            }
-            // Check if token is 2> (stderr redirection)
-            else if (tokens[i] == "2>") {
-                // Next token should be the filename
-                if (i + 1 < tokens.size()) {
-                    stderr_file = tokens[i + 1];
-                    stderr_append = false;
-                    i++;  // Skip the filename in next iteration
-                }
-            }
-            else {
-                // Regular token, add to command
-                command_tokens.push_back(tokens[i]);
-            }
+        // Input redirection (<, <<, <<<), output redirection (>, 1>, >>, 1>>), error redirection (2>, 2>>), and background (&)
+        const PlanStage& stage = plan_command.stages[0];
+        bool background = plan_command.background;
+        vector<string> command_tokens = expand_stage_words(stage);
+        
+        vector<Redirection> redirects;
+        for (const auto& redirect : stage.redirects) {
+            redirects.push_back(expand_redirect(redirect, *plan, here_doc_bodies));
         }
         
         // Skip empty commands
@@ -1770,508 +6907,41 @@ int main() {
         // First word is the command
         string command = command_tokens[0];
         
-        // Handle different commands
-        if (command == "exit") {
-            // Exit the shell
-            should_exit = true;
-            break;
-        }
-        else if (command == "export") {
-            // Export variables to environment
-            for (int i = 1; i < command_tokens.size(); i++) {
-                string arg = command_tokens[i];
-                size_t eq_pos = arg.find('=');
-                
-                if (eq_pos != string::npos) {
-                    // VAR=value format
-                    string var_name = arg.substr(0, eq_pos);
-                    string var_value = arg.substr(eq_pos + 1);
-                    
-                    // Set in both shell variables and environment
-                    shell_variables[var_name] = var_value;
-                    setenv(var_name.c_str(), var_value.c_str(), 1);
-                } else {
-                    // Just VAR (export existing shell variable)
-                    if (shell_variables.count(arg)) {
-                        setenv(arg.c_str(), shell_variables[arg].c_str(), 1);
-                    }
-                }
-            }
-            last_exit_status = 0;
-        }
-        else if (command == "unset") {
-            // Unset variables
-            for (int i = 1; i < command_tokens.size(); i++) {
-                shell_variables.erase(command_tokens[i]);
-                unsetenv(command_tokens[i].c_str());
-            }
-            last_exit_status = 0;
-        }
-        else if (command == "env") {
-            // Print all environment variables
-            extern char** environ;
-            for (char** env = environ; *env != nullptr; env++) {
-                cout << *env << endl;
-            }
-            last_exit_status = 0;
-        }
-        else if (command == "type") {
-            // Check each argument after 'type'
-            for (int i = 1; i < command_tokens.size(); i++) {
-                check_command_validity(command_tokens[i]);
-            }
-            last_exit_status = 0;
-        }
-        else if (command == "echo") {
-            // Handle stderr redirection - create empty file if specified
-            if (!stderr_file.empty()) {
-                // Create empty stderr file (echo doesn't write to stderr)
-                int flags = O_WRONLY | O_CREAT | (stderr_append ? O_APPEND : O_TRUNC);
-                int file_fd = open(stderr_file.c_str(), flags, 0644);
-                if (file_fd >= 0) {
-                    close(file_fd);
-                }
-            }
-            
-            // Handle output redirection for echo
-            if (!stdout_file.empty()) {
-                // Redirect to file (append or truncate)
-                int flags = O_WRONLY | O_CREAT | (stdout_append ? O_APPEND : O_TRUNC);
-                int file_fd = open(stdout_file.c_str(), flags, 0644);
-                if (file_fd >= 0) {
-                    // Print all words after 'echo' to the file
-                    string output = "";
-                    for (int i = 1; i < command_tokens.size(); i++) {
-                        output += command_tokens[i];
-                        if (i < command_tokens.size() - 1) {
-                            output += " ";
-                        }
-                    }
-                    output += "\n";
-                    write(file_fd, output.c_str(), output.length());
-                    close(file_fd);
-                } else {
-                    cerr << "Error: Cannot open file " << stdout_file << endl;
-                }
-            } else {
-                // Print all words after 'echo' to stdout
-                for (int i = 1; i < command_tokens.size(); i++) {
-                    cout << command_tokens[i];
-                    if (i < command_tokens.size() - 1) {
-                        cout << " ";  // Add space between words
-                    }
-                }
-                cout << endl;
-            }
-            last_exit_status = 0;
-        }
-        else if (command == "pwd") {
-            // Print current working directory
-            vector<char>cwd(1024);
-            if (getcwd(cwd.data(), cwd.size()) != nullptr) {
-                cout << cwd.data() << endl;
-                last_exit_status = 0;
-            } else {
-                cerr << "Error: Unable to get current directory" << endl;
-                last_exit_status = 1;
-            }
-        }
-        else if (command == "cd") {
-            // Change directory
-            if (command_tokens.size() < 2) {
-                cerr << "cd: missing argument" << endl;
-                last_exit_status = 1;
-            } else {
-                string path = command_tokens[1];
-                
-                // Handle ~ (home directory)
-                if (path == "~" || path.substr(0, 2) == "~/") {
-                    const char* home = getenv("HOME");
-                    if (home != nullptr) {
-                        if (path == "~") {
-                            path = string(home);
-                        } else {
-                            // Replace ~ with home directory (e.g., ~/Documents)
-                            path = string(home) + path.substr(1);
-                        }
-                    } else {
-                        cout << "cd: HOME not set" << endl;
-                        continue;
-                    }
-                }
-                
-                // Try to change directory (works for absolute and relative paths)
-                if (chdir(path.c_str()) != 0) {
-                    // Failed to change directory
-                    cout << "cd: " << command_tokens[1] << ": No such file or directory" << endl;
-                    last_exit_status = 1;
-                } else {
-                    last_exit_status = 0;
-                }
-                // If successful, directory is changed (no output needed)
-            }
-        }
-        else if (command == "history") {
-            // Handle history -r <file> (read history from file)
-            if (command_tokens.size() >= 3 && command_tokens[1] == "-r") {
-                string filename = command_tokens[2];
-                // Read history from file and append to current history
-                if (read_history(filename.c_str()) == 0) {
-                    // Successfully read history
-                } else {
-                    cerr << "history: " << filename << ": cannot read" << endl;
-                }
-                continue;
-            }
-            
-            // Handle history -w <file> (write history to file)
-            if (command_tokens.size() >= 3 && command_tokens[1] == "-w") {
-                string filename = command_tokens[2];
-                // Write history to file
-                if (write_history(filename.c_str()) == 0) {
-                    // Successfully wrote history
-                    last_appended_position = history_length;
-                } else {
-                    cerr << "history: " << filename << ": cannot write" << endl;
-                }
-                continue;
-            }
-            
-            // Handle history -a <file> (append new commands to file)
-            if (command_tokens.size() >= 3 && command_tokens[1] == "-a") {
-                string filename = command_tokens[2];
-                // Calculate how many new entries to append
-                int new_entries = history_length - last_appended_position;
-                if (new_entries > 0) {
-                    // Append only the new entries
-                    if (custom_append_history(new_entries, filename.c_str()) == 0) {
-                        // Successfully appended history
-                        last_appended_position = history_length;
-                    } else {
-                        cerr << "history: " << filename << ": cannot append" << endl;
-                    }
-                } else {
-                    // No new entries to append, just update position
-                    last_appended_position = history_length;
-                }
-                continue;
-            }
-            
-            // Display command history using readline's history
-            int num_to_show = history_length;  // Default: show all
-            
-            // Check if user specified a limit
-            if (command_tokens.size() > 1) {
-                try {
-                    num_to_show = stoi(command_tokens[1]);
-                    if (num_to_show < 0) {
-                        num_to_show = 0;
-                    }
-                } catch (...) {
-                    cerr << "history: numeric argument required" << endl;
-                    continue;
-                }
-            }
-            
-            // Calculate start index (show last num_to_show entries)
-            int start_index = max(0, history_length - num_to_show);
-            
-            for (int i = start_index; i < history_length; i++) {
-                HIST_ENTRY* entry = history_get(i + history_base);
-                if (entry) {
-                    cout << "    " << (i + 1) << "  " << entry->line << endl;
-                }
-            }
-            last_exit_status = 0;
-        }
-        else if (command == "git-status") {
-            // Show git repository status with branch information
-            if (!is_git_repo()) {
-                cout << COLOR_RED << "Not a git repository" << COLOR_RESET << endl;
-                last_exit_status = 1;
-            } else {
-                string branch = get_git_branch();
-                string status = get_git_status();
-                
-                cout << COLOR_CYAN << "Branch: " << COLOR_GREEN << branch << COLOR_RESET;
-                
-                if (status == "✓") {
-                    cout << COLOR_GREEN << " [clean]" << COLOR_RESET << endl;
-                } else {
-                    cout << COLOR_YELLOW << " [dirty]" << COLOR_RESET << endl;
-                }
-                last_exit_status = 0;
-            }
-        }
-        else if (command == "git-branch") {
-            // Switch git branch or list branches
-            if (!is_git_repo()) {
-                cout << COLOR_RED << "Not a git repository" << COLOR_RESET << endl;
-                last_exit_status = 1;
-            } else {
-                if (command_tokens.size() == 1) {
-                    // List all branches (with colors)
-                    system("git branch --color=always");
-                    last_exit_status = 0;
-                } else {
-                    // Switch to specified branch
-                    string branch = command_tokens[1];
-                    string git_cmd = "git checkout " + branch;
-                    int ret = system(git_cmd.c_str());
-                    last_exit_status = (ret == 0) ? 0 : 1;
-                }
-            }
-        }
-        else if (command == "bookmark") {
-            // Bookmark system: save, list, remove bookmarks
-            if (command_tokens.size() == 1) {
-                // List all bookmarks
-                if (bookmarks.empty()) {
-                    cout << COLOR_YELLOW << "No bookmarks saved" << COLOR_RESET << endl;
-                } else {
-                    cout << COLOR_CYAN << "Bookmarks:" << COLOR_RESET << endl;
-                    for (const auto& [name, path] : bookmarks) {
-                        cout << "  " << COLOR_GREEN << name << COLOR_RESET << " -> " << path << endl;
-                    }
-                }
-                last_exit_status = 0;
-            } else if (command_tokens.size() >= 2) {
-                if (command_tokens[1] == "rm" && command_tokens.size() == 3) {
-                    // Remove a bookmark
-                    string name = command_tokens[2];
-                    if (bookmarks.erase(name) > 0) {
-                        save_bookmarks();
-                        cout << COLOR_GREEN << "Removed bookmark: " << name << COLOR_RESET << endl;
-                        last_exit_status = 0;
-                    } else {
-                        cout << COLOR_RED << "Bookmark not found: " << name << COLOR_RESET << endl;
-                        last_exit_status = 1;
-                    }
-                } else {
-                    // Save current directory with given name
-                    string name = command_tokens[1];
-                    char cwd_buf[1024];
-                    if (getcwd(cwd_buf, sizeof(cwd_buf))) {
-                        bookmarks[name] = string(cwd_buf);
-                        save_bookmarks();
-                        cout << COLOR_GREEN << "Bookmarked: " << name << " -> " << cwd_buf << COLOR_RESET << endl;
-                        last_exit_status = 0;
-                    } else {
-                        cout << COLOR_RED << "Failed to get current directory" << COLOR_RESET << endl;
-                        last_exit_status = 1;
-                    }
-                }
-            }
-        }
-        else if (command == "jump") {
-            // Jump to a bookmarked directory
-            if (command_tokens.size() < 2) {
-                cout << COLOR_YELLOW << "Usage: jump <bookmark-name>" << COLOR_RESET << endl;
-                last_exit_status = 1;
-            } else {
-                string name = command_tokens[1];
-                auto it = bookmarks.find(name);
-                if (it != bookmarks.end()) {
-                    if (chdir(it->second.c_str()) == 0) {
-                        cout << COLOR_GREEN << "Jumped to: " << it->second << COLOR_RESET << endl;
-                        last_exit_status = 0;
-                    } else {
-                        cout << COLOR_RED << "Failed to change directory to: " << it->second << COLOR_RESET << endl;
-                        last_exit_status = 1;
-                    }
-                } else {
-                    cout << COLOR_RED << "Bookmark not found: " << name << COLOR_RESET << endl;
-                    last_exit_status = 1;
-                }
-            }
-        }
-        else if (command == "calc") {
-            // Calculator using bc
-            if (command_tokens.size() < 2) {
-                cout << COLOR_YELLOW << "Usage: calc <expression>" << COLOR_RESET << endl;
-                cout << COLOR_YELLOW << "Example: calc 2 + 2" << COLOR_RESET << endl;
-                last_exit_status = 1;
-            } else {
-                // Join all arguments into expression
-                string expr;
-                for (size_t i = 1; i < command_tokens.size(); i++) {
-                    if (i > 1) expr += " ";
-                    expr += command_tokens[i];
-                }
-                string result = calculate_str(expr);
-                if (!result.empty()) {
-                    cout << COLOR_CYAN << result << COLOR_RESET << endl;
-                    last_exit_status = 0;
-                } else {
-                    last_exit_status = 1;
-                }
-            }
-        }
-        else if (command == "timer") {
-            // Timer functionality - measure command execution time
-            cout << COLOR_YELLOW << "Timer: Use 'time <command>' to measure execution time" << COLOR_RESET << endl;
-            last_exit_status = 0;
-        }
-        else if (command == "jobs") {
-            // List all jobs
-            cleanup_jobs();
-            if (jobs.empty()) {
-                // No output if no jobs
-            } else {
-                for (const auto& job : jobs) {
-                    string status_str;
-                    switch (job.status) {
-                        case RUNNING:
-                            status_str = string(COLOR_GREEN) + "Running" + COLOR_RESET;
-                            break;
-                        case STOPPED:
-                            status_str = string(COLOR_YELLOW) + "Stopped" + COLOR_RESET;
-                            break;
-                        case DONE:
-                            status_str = string(COLOR_GRAY) + "Done" + COLOR_RESET;
-                            break;
-                    }
-                    cout << "[" << job.job_id << "]  " << status_str << "\t\t" << job.command << endl;
-                }
-            }
-            last_exit_status = 0;
-        }
-        else if (command == "fg") {
-            // Bring job to foreground
-            if (jobs.empty()) {
-                cerr << "fg: no current job" << endl;
-                last_exit_status = 1;
-                continue;
-            }
-            
-            Job* job = nullptr;
-            if (command_tokens.size() > 1) {
-                // Specific job ID
-                try {
-                    int job_id = stoi(command_tokens[1]);
-                    job = find_job_by_id(job_id);
-                    if (!job) {
-                        cerr << "fg: " << job_id << ": no such job" << endl;
-                        last_exit_status = 1;
-                        continue;
-                    }
-                } catch (...) {
-                    cerr << "fg: invalid job id" << endl;
-                    last_exit_status = 1;
-                    continue;
-                }
-            } else {
-                // Most recent job
-                job = &jobs.back();
-            }
-            
-            // Send SIGCONT to resume if stopped
-            kill(job->pid, SIGCONT);
-            job->status = RUNNING;
-            job->is_background = false;
-            
-            // Give terminal control to job
-            tcsetpgrp(STDIN_FILENO, job->pid);
-            foreground_pgid = job->pid;
-            
-            cout << job->command << endl;
-            
-            // Wait for job
-            int status;
-            pid_t pid = job->pid;
-            int job_id = job->job_id;
-            string cmd = job->command;
-            
-            waitpid(pid, &status, WUNTRACED);
-            
-            // Take back terminal control
-            tcsetpgrp(STDIN_FILENO, getpgrp());
-            foreground_pgid = 0;
-            
-            if (WIFEXITED(status) || WIFSIGNALED(status)) {
-                // Job completed
-                jobs.erase(remove_if(jobs.begin(), jobs.end(),
-                    [pid](const Job& j) { return j.pid == pid; }), jobs.end());
-                if (WIFEXITED(status)) {
-                    last_exit_status = WEXITSTATUS(status);
-                } else {
-                    last_exit_status = 128 + WTERMSIG(status);
-                }
-            } else if (WIFSTOPPED(status)) {
-                // Job stopped again
-                for (auto& j : jobs) {
-                    if (j.pid == pid) {
-                        j.status = STOPPED;
-                        cout << "\n[" << job_id << "]+ Stopped\t" << cmd << endl;
-                        break;
-                    }
-                }
-                last_exit_status = 0;
-            }
-        }
-        else if (command == "bg") {
-            // Continue job in background
-            if (jobs.empty()) {
-                cerr << "bg: no current job" << endl;
-                last_exit_status = 1;
-                continue;
-            }
-            
-            Job* job = nullptr;
-            if (command_tokens.size() > 1) {
-                // Specific job ID
-                try {
-                    int job_id = stoi(command_tokens[1]);
-                    job = find_job_by_id(job_id);
-                    if (!job) {
-                        cerr << "bg: " << job_id << ": no such job" << endl;
-                        last_exit_status = 1;
-                        continue;
-                    }
-                } catch (...) {
-                    cerr << "bg: invalid job id" << endl;
-                    last_exit_status = 1;
-                    continue;
-                }
-            } else {
-                // Most recent stopped job
-                for (auto it = jobs.rbegin(); it != jobs.rend(); ++it) {
-                    if (it->status == STOPPED) {
-                        job = &(*it);
-                        break;
-                    }
-                }
-                if (!job) {
-                    cerr << "bg: no stopped jobs" << endl;
-                    last_exit_status = 1;
-                    continue;
-                }
+        // Builtins run in the shell with their redirections applied in place
+        const Builtin* builtin = find_builtin(command);
+        if (builtin != nullptr) {
+            if ((builtin->flags & BUILTIN_RAW_FDS) && !redirects_stdin(redirects)) batch_sync_input(batch);
+            last_exit_status = run_builtin_standalone(*builtin, command_tokens, redirects);
+            if (exit_requested) {
+                should_exit = true;
+                break;
             }
-            
-            // Send SIGCONT to resume
-            kill(job->pid, SIGCONT);
-            job->status = RUNNING;
-            job->is_background = true;
-            
-            cout << "[" << job->job_id << "]+ " << job->command << " &" << endl;
-            last_exit_status = 0;
-        }
-        else {
-            // Not a builtin, try to execute as external program
-            execute_program(command_tokens, stdout_file, stdout_append, stderr_file, stderr_append, background);
+            continue;
         }
         
+        // Not a builtin, try to execute as external program
+        if (!redirects_stdin(redirects)) batch_sync_input(batch);
+        execute_program(command_tokens, redirects, background);
+        
         }  // End of command chain for loop
         
+        // Wrap up the last command of the chain
+        finish_command();
+        
         // Check if we should exit
         if (should_exit) break;
         
     }  // End of main while loop
     
-    // Save history to HISTFILE if the environment variable is set
-    if (histfile != nullptr) {
-        write_history(histfile);
-    }
+    // Leave a shared stdin just past the last line run
+    batch_sync_input(batch);
+    if (!trace_exit_file.empty()) trace_dump(trace_exit_file);
     
-    return 0;
+    return last_exit_status;
+}
+
+#ifndef SHELL_CORE_LIBRARY
+int main(int argc, char* argv[]) {
+    return shell_main(argc, argv);
 }
+#endif
@@ -0,0 +1,49 @@
+// Core entry points of the shell
+// main.cpp builds either the whole shell or, with SHELL_CORE_LIBRARY
+// defined, everything but main(): the shell_core library that the shell
+// executable and the benchmarks (bench/shell_bench.cpp) link against.
+// Only what those need is declared here; the rest stays private to main.cpp.
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// A redirection with its target expanded
+struct Redirection {
+    std::string op;       // <, <<, <<<, >, >>, 1>, 1>>, 2>, 2>>
+    std::string target;   // For << and <<<, the content itself
+};
+
+struct CommandPlan;  // A compiled command line
+
+// Process groups and terminal hand-off (off for scripts and -c)
+extern bool job_control;
+
+// Startup: load the environment into the variable table, install the
+// signal dispositions and the SIGCHLD signalfd
+void import_environment();
+void setup_signals();
+
+// Parsing: lex and compile a line, or fetch its plan from the LRU cache
+std::shared_ptr<const CommandPlan> compile_command_line(const std::string& line);
+std::shared_ptr<const CommandPlan> get_command_plan(const std::string& line);
+
+// Expansion
+std::string expand_variables(const std::string& str);
+std::vector<std::string> expand_wildcards(const std::string& pattern);
+void glob_cache_clear();
+
+// Command lookup (through the hash table)
+bool find_executable_in_path(const std::string& command, std::string& full_path);
+void clear_command_hash();
+
+// Prompt-side rendering
+std::string highlight_syntax(const std::string& line);
+
+// Run a pipeline of two or more commands in the foreground
+void execute_multi_pipeline(const std::vector<std::vector<std::string>>& commands,
+                            const std::vector<std::vector<Redirection>>& redirects);
+
+// The shell itself (argument handling, startup, the read-execute loop)
+int shell_main(int argc, char* argv[]);
@@ -0,0 +1,7 @@
+// Entry point of the CMake build, where main.cpp is compiled into the
+// shell_core library (single-file builds get main() from main.cpp itself)
+#include "shell_core.hpp"
+
+int main(int argc, char* argv[]) {
+    return shell_main(argc, argv);
+}
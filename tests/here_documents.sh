@@ -0,0 +1,51 @@
+#!/bin/sh
+# Here-document and here-string expansion
+# Runs small scripts through the shell in batch mode and compares the output.
+#
+# Usage: here_documents.sh path/to/shell
+
+shell="$1"
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+touch a1.txt b1.txt
+failures=0
+
+# check <name> <expected output> <script>
+check() {
+    actual=$(printf '%s\n' "$3" | "$shell" 2>&1)
+    if [ "$actual" != "$2" ]; then
+        printf 'FAIL %s\n--- expected\n%s\n--- actual\n%s\n' "$1" "$2" "$actual"
+        failures=$((failures + 1))
+    fi
+}
+
+# Here-strings expand variables but never wildcards
+check "here-string glob" '*.txt' 'cat <<< *.txt'
+check "here-string variables" '5 *.txt' 'X=5
+cat <<< "$X *.txt"'
+
+# Unquoted here-documents: \$, \` and \\ are escapes, \newline joins lines,
+# other backslashes are kept
+check "here-doc escaped dollar" 'cost $5 and 7' 'X=7
+cat <<EOF
+cost \$5 and $X
+EOF'
+check "here-doc backslashes" 'a\b ` \q' 'cat <<EOF
+a\\b \` \q
+EOF'
+check "here-doc line continuation" 'joined line' 'cat <<EOF
+joined \
+line
+EOF'
+
+# A quoted delimiter leaves the body alone
+check "here-doc quoted delimiter" 'cost \$5 $X' "cat <<'EOF'
+cost \\\$5 \$X
+EOF"
+
+if [ "$failures" -ne 0 ]; then
+    echo "$failures here-document check(s) failed"
+    exit 1
+fi
+echo "all here-document checks passed"
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Quoting inside partly quoted words
+# Quoted $, *, ?, [ stay literal even when another part of the same word
+# expands. Runs small scripts through the shell in batch mode and compares
+# the output.
+#
+# Usage: quoting.sh path/to/shell
+
+shell="$1"
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+touch a1 b1
+failures=0
+
+# check <name> <expected output> <script>
+check() {
+    actual=$(printf '%s\n' "$3" | "$shell" 2>&1)
+    if [ "$actual" != "$2" ]; then
+        printf 'FAIL %s\n--- expected\n%s\n--- actual\n%s\n' "$1" "$2" "$actual"
+        failures=$((failures + 1))
+    fi
+}
+
+# A quoted * is literal next to an unquoted one
+check "quoted star" 'a**' "echo 'a*'*"
+check "unquoted star" 'a1' "echo a*"
+
+# A single-quoted $ does not expand, and does not join the name that follows
+check "single-quoted dollar" '$HOMExv' "V=v
+echo '\$HOME'\"x\$V\""
+
+# An escaped $ does not expand either
+check "escaped dollar" '$HOMEv' 'V=v
+echo \$HOME$V'
+
+if [ "$failures" -ne 0 ]; then
+    echo "$failures quoting check(s) failed"
+    exit 1
+fi
+echo "all quoting checks passed"